@@ -0,0 +1,472 @@
+/*
+ * compare results of performance_test
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * 18/10/2026
+ *
+ * Read two CSV results of performance_test (-o csv) and compare
+ * the times of each tree and test: the change of the median and
+ * whether the two sets of trials are different, with a
+ * Mann-Whitney U test.
+ *
+ * A change larger than the threshold with a p-value smaller
+ * than alpha is a regression (slower) or an improvement. The
+ * exit status is 1 if there's a regression.
+ */
+
+#include <math.h> /* erfc sqrt */
+#include <stdio.h>
+#include <stdlib.h> /* malloc qsort strtod */
+#include <string.h>
+#include <unistd.h> /* getopt */
+
+/* percent */
+#define DEFAULT_THRESHOLD  2.0
+#define DEFAULT_ALPHA  0.05
+
+/* exact distribution of U up to this many trials in each file */
+#define MAX_EXACT  20
+
+#define MAX_FIELDS  32
+
+/* columns used, see performance_test.c */
+enum {
+	COLUMN_MODULE,
+	COLUMN_ISA,
+	COLUMN_KEYS,
+	COLUMN_N_OPS,
+	COLUMN_TEST,
+	COLUMN_SECONDS,
+	COLUMN_LAST,
+};
+
+static const char *column_names[] = {
+	[COLUMN_MODULE] = "module",
+	[COLUMN_ISA] = "isa",
+	[COLUMN_KEYS] = "keys",
+	[COLUMN_N_OPS] = "n_ops",
+	[COLUMN_TEST] = "test",
+	[COLUMN_SECONDS] = "seconds",
+};
+
+/*
+ * columns of newer results, with the value of older results
+ * that don't have them
+ */
+enum {
+	OPTIONAL_CACHE,
+	OPTIONAL_PLACEMENT,
+	OPTIONAL_DISTRIBUTION,
+	OPTIONAL_LAST,
+};
+
+static const char *optional_names[] = {
+	[OPTIONAL_CACHE] = "cache",
+	[OPTIONAL_PLACEMENT] = "placement",
+	[OPTIONAL_DISTRIBUTION] = "distribution",
+};
+
+static const char *optional_defaults[] = {
+	[OPTIONAL_CACHE] = "warm",
+	[OPTIONAL_PLACEMENT] = "sequential",
+	[OPTIONAL_DISTRIBUTION] = "dense",
+};
+
+struct samples {
+	double *times;
+	unsigned long n;
+	unsigned long size;
+};
+
+/* a tree (module, isa, keys, optional columns, n_ops) and a test */
+struct group {
+	char *tree;
+	char *test;
+	/* old and new */
+	struct samples samples[2];
+};
+
+static struct group *groups;
+static unsigned long n_groups;
+
+/*
+ * split a CSV line in fields (in place). Quoted fields may have
+ * commas and doubled quotes. Return the number of fields
+ */
+static int
+split_fields(char *line, char **fields)
+{
+	char *src = line, *dst;
+	int n = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+
+	while (n < MAX_FIELDS) {
+		fields[n++] = dst = src;
+
+		if (*src == '"') {
+			src++;
+			while (*src) {
+				if (*src == '"' && src[1] != '"')
+					break;
+				if (*src == '"')
+					src++;
+				*dst++ = *src++;
+			}
+			if (*src == '"')
+				src++;
+		} else {
+			while (*src && *src != ',')
+				*dst++ = *src++;
+		}
+
+		if (*src != ',') {
+			*dst = '\0';
+			break;
+		}
+		src++;
+		*dst = '\0';
+	}
+
+	return n;
+}
+
+static struct group*
+get_group(const char *tree, const char *test)
+{
+	struct group *tmp;
+	unsigned long i;
+
+	for (i = 0; i < n_groups; i++) {
+		if (strcmp(groups[i].tree, tree) == 0 &&
+		    strcmp(groups[i].test, test) == 0)
+			return &groups[i];
+	}
+
+	tmp = realloc(groups, (n_groups + 1) * sizeof(*groups));
+	if (tmp == NULL)
+		return NULL;
+	groups = tmp;
+
+	tmp = &groups[n_groups];
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->tree = strdup(tree);
+	tmp->test = strdup(test);
+	if (tmp->tree == NULL || tmp->test == NULL)
+		return NULL;
+
+	n_groups++;
+
+	return tmp;
+}
+
+static int
+add_sample(struct samples *s, double t)
+{
+	double *tmp;
+
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 16;
+		tmp = realloc(s->times, s->size * sizeof(*tmp));
+		if (tmp == NULL)
+			return -1;
+		s->times = tmp;
+	}
+
+	s->times[s->n++] = t;
+
+	return 0;
+}
+
+/* read the samples of file (0 is old, 1 is new) */
+static int
+read_results(const char *path, int file)
+{
+	char *line = NULL, *fields[MAX_FIELDS], tree[512];
+	int columns[COLUMN_LAST], optional[OPTIONAL_LAST], n, i, c;
+	const char *values[OPTIONAL_LAST];
+	int ret = -1;
+	struct group *group;
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		printf("couldn't open %s\n", path);
+		return -1;
+	}
+
+	/* the header has the names of the columns */
+	if (getline(&line, &size, f) == -1)
+		goto _go_bad_file;
+	n = split_fields(line, fields);
+	for (c = 0; c < COLUMN_LAST; c++) {
+		for (i = 0; i < n; i++) {
+			if (strcmp(fields[i], column_names[c]) == 0)
+				break;
+		}
+		if (i == n)
+			goto _go_bad_file;
+		columns[c] = i;
+	}
+	for (c = 0; c < OPTIONAL_LAST; c++) {
+		optional[c] = -1;
+		for (i = 0; i < n; i++) {
+			if (strcmp(fields[i], optional_names[c]) == 0)
+				optional[c] = i;
+		}
+	}
+
+	while (getline(&line, &size, f) != -1) {
+		if (*line == '\n')
+			continue;
+
+		if (split_fields(line, fields) < n)
+			goto _go_bad_file;
+
+		for (c = 0; c < OPTIONAL_LAST; c++) {
+			values[c] = optional[c] == -1 ? optional_defaults[c] :
+			            fields[optional[c]];
+		}
+
+		snprintf(tree, sizeof(tree),
+		         "%s (%s, %s %s keys, %s cache, %s placement, %s ops)",
+		         fields[columns[COLUMN_MODULE]],
+		         fields[columns[COLUMN_ISA]],
+		         values[OPTIONAL_DISTRIBUTION],
+		         fields[columns[COLUMN_KEYS]],
+		         values[OPTIONAL_CACHE], values[OPTIONAL_PLACEMENT],
+		         fields[columns[COLUMN_N_OPS]]);
+
+		group = get_group(tree, fields[columns[COLUMN_TEST]]);
+		if (group == NULL ||
+		    add_sample(&group->samples[file],
+		               strtod(fields[columns[COLUMN_SECONDS]],
+		                      NULL)) == -1) {
+			printf("out of memory\n");
+			goto _go_close;
+		}
+	}
+
+	ret = 0;
+	goto _go_close;
+
+_go_bad_file:
+	printf("%s is not a CSV result of performance_test\n", path);
+_go_close:
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+static int
+compare_double(const void *_a, const void *_b)
+{
+	const double *a = _a, *b = _b;
+
+	return (*a > *b) - (*a < *b);
+}
+
+static double
+median(struct samples *s)
+{
+	qsort(s->times, s->n, sizeof(*s->times), compare_double);
+
+	return (s->n & 1) ? s->times[s->n / 2] :
+	       (s->times[s->n / 2 - 1] + s->times[s->n / 2]) / 2;
+}
+
+/*
+ * P(U <= u) with n1 and n2 trials and no ties. count[j][v] is
+ * the number of orderings of i values of the first sample and j
+ * of the second where v pairs have the second value smaller.
+ * The largest value is from the first sample (smaller than the
+ * j values of the second) or from the second
+ */
+static double
+exact_cdf(unsigned long n1, unsigned long n2, unsigned long u)
+{
+	unsigned long i, j, v, max = n1 * n2;
+	double *count, total = 0, below = 0;
+
+	count = calloc((n2 + 1) * (max + 1), sizeof(*count));
+	if (count == NULL)
+		return 1;
+
+#define COUNT(j, v)  count[(j) * (max + 1) + (v)]
+
+	/* i = 0: only the second sample, U is 0 */
+	for (j = 0; j <= n2; j++)
+		COUNT(j, 0) = 1;
+
+	for (i = 1; i <= n1; i++) {
+		/* j = 0 stays 1 at v = 0. v goes down to reuse i - 1 */
+		for (j = 1; j <= n2; j++) {
+			for (v = max + 1; v-- > 0; ) {
+				COUNT(j, v) = (v >= j ? COUNT(j, v - j) : 0) +
+				              COUNT(j - 1, v);
+			}
+		}
+	}
+
+	for (v = 0; v <= max; v++) {
+		total += COUNT(n2, v);
+		if (v <= u)
+			below += COUNT(n2, v);
+	}
+
+#undef COUNT
+
+	free(count);
+
+	return below / total;
+}
+
+/*
+ * two-sided p-value of the Mann-Whitney U test. The exact
+ * distribution is used for few trials without ties, the normal
+ * approximation (with tie correction) otherwise
+ */
+static double
+mann_whitney(struct samples *a, struct samples *b)
+{
+	unsigned long n1 = a->n, n2 = b->n, n = n1 + n2, i, j, t;
+	double u = 0, ties = 0, mean, variance, z, p;
+
+	/* U: pairs with the value of b smaller, ties count half */
+	for (i = 0; i < n1; i++) {
+		for (j = 0; j < n2; j++) {
+			if (b->times[j] < a->times[i])
+				u += 1;
+			else if (b->times[j] == a->times[i])
+				u += 0.5;
+		}
+	}
+
+	/* ties in both samples (they are sorted by median()) */
+	for (i = 0, j = 0; i < n1 || j < n2; ) {
+		double v = (j == n2 || (i < n1 && a->times[i] < b->times[j])) ?
+		           a->times[i] : b->times[j];
+
+		for (t = 0; i < n1 && a->times[i] == v; i++)
+			t++;
+		for (; j < n2 && b->times[j] == v; j++)
+			t++;
+		ties += (double) t * t * t - t;
+	}
+
+	if (ties == 0 && n1 <= MAX_EXACT && n2 <= MAX_EXACT) {
+		/* the distribution is symmetric around n1 * n2 / 2 */
+		if (u > n1 * n2 / 2.0)
+			u = n1 * n2 - u;
+		p = 2 * exact_cdf(n1, n2, u);
+		return p > 1 ? 1 : p;
+	}
+
+	mean = n1 * n2 / 2.0;
+	variance = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1.0)));
+	if (variance <= 0)
+		return 1;
+
+	/* continuity correction */
+	z = (fabs(u - mean) - 0.5) / sqrt(variance);
+	if (z < 0)
+		z = 0;
+
+	return erfc(z / sqrt(2));
+}
+
+static void
+usage(void)
+{
+	printf("usage: cmd [-t threshold] [-a alpha] old.csv new.csv\n"
+	       "  -t: flag changes of the median larger than threshold\n"
+	       "      percent (default %.1f)\n"
+	       "  -a: significance level (default %.2f)\n"
+	       "Results are written by performance_test -o csv, with\n"
+	       "-n trials (e.g. 10) to be compared.\n",
+	       DEFAULT_THRESHOLD, DEFAULT_ALPHA);
+}
+
+int
+main(int argc, char **argv)
+{
+	double threshold = DEFAULT_THRESHOLD, alpha = DEFAULT_ALPHA;
+	double old, new, change, p;
+	struct samples *a, *b;
+	const char *verdict;
+	int opt, regressions = 0;
+	unsigned long i;
+
+	while ((opt = getopt(argc, argv, "t:a:")) != -1) {
+		switch (opt) {
+		case 't':
+			threshold = strtod(optarg, NULL);
+			break;
+		case 'a':
+			alpha = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage();
+		return 2;
+	}
+
+	if (read_results(argv[optind], 0) == -1 ||
+	    read_results(argv[optind + 1], 1) == -1)
+		return 2;
+
+	for (i = 0; i < n_groups; i++) {
+		a = &groups[i].samples[0];
+		b = &groups[i].samples[1];
+
+		if (i == 0 || strcmp(groups[i].tree, groups[i - 1].tree))
+			printf("Tree %s\n", groups[i].tree);
+
+		if (!a->n || !b->n) {
+			printf("  %s: only in the %s results\n",
+			       groups[i].test, a->n ? "old" : "new");
+			continue;
+		}
+
+		old = median(a);
+		new = median(b);
+		change = (new - old) / old * 100;
+		p = mann_whitney(a, b);
+
+		verdict = "";
+		if (p < alpha && change > threshold) {
+			verdict = ": regression";
+			regressions++;
+		} else if (p < alpha && change < -threshold) {
+			verdict = ": improvement";
+		}
+
+		printf("  %s: %.9f -> %.9f (%+.2f%%), p %.4f%s\n",
+		       groups[i].test, old, new, change, p, verdict);
+	}
+
+	printf("%d regressions\n", regressions);
+
+	return regressions ? 1 : 0;
+}
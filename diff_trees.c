@@ -30,104 +30,6 @@
 /* number of elements to insert in the trees during the test */
 #define N_ELEMENTS  1000000
 
-/* maximum size of node stack used in tree_is_identical() */
-#define STACK_SIZE  1024
-
-#define get_left(tree, ptr)  tree_node_get_left(tree, ptr)
-#define get_right(tree, ptr) tree_node_get_right(tree, ptr)
-#define get_key(tree, ptr)  tree_node_get_key(tree, ptr)
-
-/*
- * based on:
- * <https://www.geeksforgeeks.org/
- *  iterative-function-check-two-trees-identical>
- * and
- * <http://www.techiedelight.com/
- *  check-if-two-binary-trees-are-identical-not-iterative-recursive>
- */
-int /* NOTE: boolean function */
-tree_is_identical(struct tree_info *a, void *_root_a,
-                  struct tree_info *b, void *_root_b)
-{
-	void *root_a, *root_b;
-	void *stack_a[STACK_SIZE];
-	void *stack_b[STACK_SIZE];
-	unsigned long idx = 0;
-
-	/* NOTE: debug */
-	unsigned long max_idx = 0, n_checked = 0;
-
-	root_a = tree_root_get_node(a, _root_a);
-	root_b = tree_root_get_node(b, _root_b);
-
-	/* identical if both trees are empty */
-	if (!root_a && !root_b)
-		return 1;
-
-	/* not identical if one is empty and other is not */
-	if (!root_a || !root_b)
-		return 0;
-
-	/* push roots */
-	stack_a[idx] = root_a;
-	stack_b[idx++] = root_b;
-
-	while (idx) {
-		/* NOTE: debug */
-		n_checked++;
-		if (idx > max_idx)
-			max_idx = idx;
-
-		/* get top nodes and compare them */
-		void *node_a = stack_a[idx - 1];
-		void *node_b = stack_b[idx - 1];
-
-		if (get_key(a, node_a) != get_key(b, node_b)) {
-			printf("keys differ a=%ld b=%ld\n",
-			       get_key(a, node_a),
-			       get_key(b, node_b));
-			return 0;
-		}
-
-		/*
-		 * corresponding nodes are compared
-		 * only once. pop them from stack
-		 */
-		idx--;
-
-		/*
-		 * if corresponding children are not
-		 * null push them to the stack
-		 */
-
-		if (get_left(a, node_a) && get_left(b, node_b)) {
-			stack_a[idx] = get_left(a, node_a);
-			stack_b[idx++] = get_left(b, node_b);
-			if (idx == STACK_SIZE)
-				return -1;
-		} else if (get_left(a, node_a) || get_left(b, node_b)) {
-			/* one left child is empty and other is not */
-			return 0;
-		}
-
-		if (get_right(a, node_a) && get_right(b, node_b)) {
-			stack_a[idx] = get_right(a, node_a);
-			stack_b[idx++] = get_right(b, node_b);
-			if (idx == STACK_SIZE)
-				return -1;
-		} else if (get_right(a, node_a) || get_right(b, node_b)) {
-			/* one right child is empty and other is not */
-			return 0;
-		}
-	}
-
-	/* NOTE: debug */
-	printf("maximum stack size = %ld\n", max_idx);
-	printf("total elements checked = %ld\n", n_checked);
-
-	return 1;
-}
-
 static void
 __main(struct tree_operations *ops_a, struct tree_operations *ops_b)
 {
@@ -135,15 +37,28 @@ __main(struct tree_operations *ops_a, struct tree_operations *ops_b)
 	struct tree_memory tree_memory_a;
 	struct tree_info tree_info_b;
 	struct tree_memory tree_memory_b;
+	struct tree_compare_stats stats;
 	unsigned long i;
 
-	/* set up tree a */
 	tree_info_setup(&tree_info_a, ops_a);
+	tree_info_setup(&tree_info_b, ops_b);
+	if (tree_info_a.key.type != TREE_KEY_ULONG ||
+	    tree_info_b.key.type != TREE_KEY_ULONG) {
+		printf("keys of the trees are not unsigned long\n");
+		return;
+	}
+
+	if (tree_has_capability(&tree_info_a, TREE_CAP_NON_BINARY) ||
+	    tree_has_capability(&tree_info_b, TREE_CAP_NON_BINARY)) {
+		printf("trees that are not binary can't be compared\n");
+		return;
+	}
+
+	/* set up tree a */
 	tree_memory_allocate(&tree_memory_a, &tree_info_a, N_ELEMENTS);
 	ops_a->init(tree_memory_a.root);
 
 	/* set up tree b */
-	tree_info_setup(&tree_info_b, ops_b);
 	tree_memory_allocate(&tree_memory_b, &tree_info_b, N_ELEMENTS);
 	ops_b->init(tree_memory_b.root);
 
@@ -159,15 +74,21 @@ __main(struct tree_operations *ops_a, struct tree_operations *ops_b)
 	}
 
 	switch (tree_is_identical(&tree_info_a, tree_memory_a.root,
-	                          &tree_info_b, tree_memory_b.root)) {
+	                          &tree_info_b, tree_memory_b.root, &stats)) {
 	case 0:
+		if (stats.key_a != stats.key_b)
+			printf("keys differ a=%ld b=%ld\n",
+			       stats.key_a, stats.key_b);
 		printf("not identical\n");
 		break;
 	case 1:
+		/* NOTE: debug */
+		printf("maximum level width = %ld\n", stats.max_frontier);
+		printf("total elements checked = %ld\n", stats.n_checked);
 		printf("identical\n");
 		break;
 	default: /* -1 */
-		printf("error. Probably going to stack overflow\n");
+		printf("error. Out of memory\n");
 	}
 
 	/* NOTE: deleting elements from trees is a waste of time */
@@ -0,0 +1,664 @@
+/*
+ * differential fuzzer for trees
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * 18/10/2026
+ *
+ * A seed makes a random sequence of inserts, deletes and
+ * searches that is applied to every tree. Every few operations
+ * the trees are checked:
+ *
+ * - tree_validate(): keys in order and, for AVL trees, the
+ *   balance factors.
+ * - the keys are the ones of a model (an array of flags).
+ * - tree_is_identical() with the first tree.
+ *
+ * Trees that are not binary (TREE_CAP_NON_BINARY) can't be
+ * walked: every key is searched and checked against the model.
+ * Trees that are not AVL (TREE_CAP_NON_AVL) have no balance
+ * factors, and their shape is not compared.
+ *
+ * Searches are checked against the model when they're done.
+ *
+ * Each sequence runs in a child process, so a tree that crashes
+ * is a failure like the others. A failing sequence is minimized
+ * (fewer trees and operations) and written as a trace that
+ * print_tree -t replays.
+ *
+ * Seeds are divided among worker processes (-j).
+ *
+ * With -R, the libraries are loaded again halfway through each
+ * sequence (tree_library_reload()) and the trees, still in use,
+ * are migrated to the new load.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc strtoul */
+#include <string.h>
+#include <sys/wait.h> /* waitpid */
+#include <unistd.h> /* fork getopt sysconf */
+
+#include "tree_manager.h"
+
+#define DEFAULT_SEEDS  1000
+#define DEFAULT_OPS  10000
+#define DEFAULT_KEYS  1024
+#define DEFAULT_INTERVAL  100
+
+/* at most this many sequences are tried in a minimization */
+#define MAX_TRIALS  4000
+
+/* a bit per tree in a mask */
+#define MAX_TREES  (8 * sizeof(unsigned long))
+
+enum {
+	OP_INSERT,
+	OP_DELETE,
+	OP_SEARCH,
+};
+
+/* as in the traces of print_tree */
+static const char op_chars[] = "ids";
+
+struct fuzz_op {
+	unsigned int type;
+	unsigned long key;
+};
+
+struct fuzz_tree {
+	struct tree_library *lib;
+	struct tree_info info;
+	struct tree_memory memory;
+	/* next element to insert */
+	unsigned long next;
+};
+
+static struct fuzz_tree trees[MAX_TREES];
+static unsigned int n_trees;
+
+/* options */
+static unsigned long n_ops = DEFAULT_OPS;
+static unsigned long n_keys = DEFAULT_KEYS;
+static unsigned long interval = DEFAULT_INTERVAL;
+static int check_shape = 1;
+static int reload;
+static int validate_flags = TREE_VALIDATE_BALANCE;
+
+/* seed being fuzzed, in the messages */
+static unsigned long current_seed;
+
+/* splitmix64: the sequence of a seed is the same everywhere */
+static unsigned long
+next_random(unsigned long *state)
+{
+	unsigned long z = (*state += 0x9e3779b97f4a7c15UL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+
+	return z ^ (z >> 31);
+}
+
+/* 50% inserts, 35% deletes and 15% searches */
+static void
+generate(struct fuzz_op *ops, unsigned long n, unsigned long seed)
+{
+	unsigned long state = seed, i, r;
+
+	for (i = 0; i < n; i++) {
+		r = next_random(&state) % 100;
+		ops[i].type = r < 50 ? OP_INSERT :
+		              r < 85 ? OP_DELETE : OP_SEARCH;
+		ops[i].key = next_random(&state) % n_keys;
+	}
+}
+
+/* the in-order keys of the tree are the ones of the model */
+static int
+check_keys(struct fuzz_tree *t, const char *model, unsigned long height)
+{
+	void **stack, *node;
+	unsigned long n = 0, key = 0;
+	int ret = 0;
+
+	stack = malloc((height + 1) * sizeof(*stack));
+	if (stack == NULL)
+		return -1;
+
+	node = tree_root_get_node(&t->info, t->memory.root);
+
+	while (n || node) {
+		if (node) {
+			stack[n++] = node;
+			node = tree_node_get_left(&t->info, node);
+			continue;
+		}
+
+		node = stack[--n];
+
+		while (key < n_keys && !model[key])
+			key++;
+		if (key++ != tree_node_get_key(&t->info, node)) {
+			ret = -1;
+			break;
+		}
+
+		node = tree_node_get_right(&t->info, node);
+	}
+
+	free(stack);
+
+	return ret;
+}
+
+/* trees that aren't binary: search every key of the model */
+static int
+check_search(struct fuzz_tree *t, const char *model)
+{
+	unsigned long key;
+	void *element;
+
+	for (key = 0; key < n_keys; key++) {
+		element = t->info.ops->search(t->memory.root, key);
+		if (!element != !model[key])
+			return -1;
+		if (element && tree_element_get_key(&t->info, element) != key)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* error of a binary tree, or NULL. first may be NULL */
+static const char*
+check_binary(struct fuzz_tree *t, struct fuzz_tree *first, const char *model,
+             unsigned long count)
+{
+	struct tree_validate_stats stats;
+	int ret;
+
+	ret = tree_validate(&t->info, t->memory.root, validate_flags,
+	                    count + 1, &stats);
+	if (ret != TREE_VALID)
+		return tree_validate_error(ret);
+	if (stats.n_nodes != count)
+		return "wrong number of keys";
+	if (check_keys(t, model, stats.height) == -1)
+		return "wrong keys";
+	if (first && check_shape &&
+	    tree_is_identical(&first->info, first->memory.root,
+	                      &t->info, t->memory.root, NULL) != 1)
+		return "shape differs from the first tree";
+
+	return NULL;
+}
+
+static int
+check_trees(unsigned long mask, const char *model, unsigned long count,
+            unsigned long op, int quiet)
+{
+	struct fuzz_tree *t, *first = NULL;
+	const char *error;
+	unsigned int i;
+
+	for (i = 0; i < n_trees; i++) {
+		if (!(mask & (1UL << i)))
+			continue;
+		t = &trees[i];
+
+		if (tree_has_capability(&t->info, TREE_CAP_NON_BINARY)) {
+			error = check_search(t, model) == -1 ? "wrong keys" :
+			                                       NULL;
+		} else if (tree_has_capability(&t->info, TREE_CAP_NON_AVL)) {
+			error = check_binary(t, NULL, model, count);
+		} else {
+			error = check_binary(t, first, model, count);
+			if (first == NULL)
+				first = t;
+		}
+
+		if (error) {
+			if (!quiet)
+				printf("seed %lu: %s: %s after operation %lu\n",
+				       current_seed, t->lib->name, error, op);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* reload the libraries of the trees of mask, which are in use */
+static int
+reload_trees(unsigned long mask, unsigned long op, int quiet)
+{
+	struct fuzz_tree *t;
+	unsigned int i;
+
+	for (i = 0; i < n_trees; i++) {
+		if (!(mask & (1UL << i)))
+			continue;
+		t = &trees[i];
+
+		if (tree_library_reload(t->lib) == -1) {
+			if (!quiet)
+				printf("seed %lu: %s: reload failed after "
+				       "operation %lu\n", current_seed,
+				       t->lib->name, op);
+			return -1;
+		}
+
+		/* the key info of the new load */
+		tree_info_setup(&t->info, &t->lib->ops);
+	}
+
+	return 0;
+}
+
+/*
+ * apply ops to the trees of mask, checking them every
+ * check_every operations and at the end. Return -1 at the
+ * first failure
+ */
+static int
+run(struct fuzz_op *ops, unsigned long n, unsigned long mask,
+    unsigned long check_every, int quiet)
+{
+	struct fuzz_tree *t;
+	unsigned long i, count = 0;
+	char *model;
+	void *element;
+	unsigned int j;
+	int ret = 0;
+
+	model = calloc(n_keys, 1);
+	if (model == NULL)
+		return -1;
+
+	for (j = 0; j < n_trees; j++) {
+		if (!(mask & (1UL << j)))
+			continue;
+		t = &trees[j];
+
+		/* an element per operation, at most */
+		tree_memory_allocate(&t->memory, &t->info, n + 1);
+		if (t->memory.addr == NULL) {
+			free(model);
+			return -1;
+		}
+		t->info.ops->init(t->memory.root);
+		t->next = 0;
+		tree_library_get(t->lib);
+	}
+
+	for (i = 0; i < n && ret == 0; i++) {
+		for (j = 0; j < n_trees && ret == 0; j++) {
+			if (!(mask & (1UL << j)))
+				continue;
+			t = &trees[j];
+
+			switch (ops[i].type) {
+			case OP_INSERT:
+				element = t->memory.array +
+				          t->next++ * t->info.element_size;
+				tree_element_set_key(&t->info, element,
+				                     ops[i].key);
+				t->info.ops->insert(t->memory.root, element);
+				break;
+			case OP_DELETE:
+				t->info.ops->delete(t->memory.root,
+				                    ops[i].key);
+				break;
+			case OP_SEARCH:
+				if (!t->info.ops->search)
+					break;
+				element = t->info.ops->search(t->memory.root,
+				                              ops[i].key);
+				if (!element == !model[ops[i].key] &&
+				    (!element ||
+				     tree_element_get_key(&t->info, element) ==
+				     ops[i].key))
+					break;
+				if (!quiet)
+					printf("seed %lu: %s: wrong search "
+					       "after operation %lu\n",
+					       current_seed, t->lib->name, i);
+				ret = -1;
+				break;
+			}
+		}
+
+		if (ops[i].type == OP_INSERT && !model[ops[i].key]) {
+			model[ops[i].key] = 1;
+			count++;
+		} else if (ops[i].type == OP_DELETE && model[ops[i].key]) {
+			model[ops[i].key] = 0;
+			count--;
+		}
+
+		if (ret == 0 && ((i + 1) % check_every == 0 || i + 1 == n))
+			ret = check_trees(mask, model, count, i, quiet);
+
+		if (ret == 0 && reload && i == n / 2)
+			ret = reload_trees(mask, i, quiet);
+	}
+
+	/* the old loads are closed, the trees use the new ones */
+	for (j = 0; j < n_trees; j++) {
+		if (mask & (1UL << j))
+			tree_library_put(trees[j].lib);
+	}
+
+	/* the process ends after a run, memory isn't freed */
+	free(model);
+
+	return ret;
+}
+
+/* run in a child process. Return -1 if it fails or crashes */
+static int
+run_child(struct fuzz_op *ops, unsigned long n, unsigned long mask,
+          unsigned long check_every, int quiet)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+
+	pid = fork();
+	if (pid == -1)
+		return 0;
+	if (pid == 0) {
+		status = run(ops, n, mask, check_every, quiet);
+		fflush(stdout);
+		_exit(status ? 1 : 0);
+	}
+
+	if (waitpid(pid, &status, 0) == -1)
+		return 0;
+
+	if (WIFSIGNALED(status)) {
+		if (!quiet)
+			printf("seed %lu: crashed (signal %d)\n",
+			       current_seed, WTERMSIG(status));
+		return -1;
+	}
+
+	return WEXITSTATUS(status) ? -1 : 0;
+}
+
+/*
+ * Minimize a failing sequence: drop trees that don't take part
+ * in the failure, cut the operations after it and then remove
+ * chunks of operations (halving the chunk size) while it still
+ * fails. Every operation is checked. Return the new length
+ */
+static unsigned long
+minimize(struct fuzz_op *ops, unsigned long n, unsigned long *mask)
+{
+	struct fuzz_op *tmp;
+	unsigned long lo, hi, mid, chunk, start;
+	unsigned int trials = 0, i;
+
+	for (i = 0; i < n_trees; i++) {
+		if (!(*mask & (1UL << i)) || *mask == 1UL << i)
+			continue;
+		if (run_child(ops, n, *mask & ~(1UL << i), 1, 1) == -1)
+			*mask &= ~(1UL << i);
+	}
+
+	/* shortest failing prefix */
+	lo = 1;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (run_child(ops, mid, *mask, 1, 1) == -1)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	n = hi;
+
+	tmp = malloc(n * sizeof(*tmp));
+	if (tmp == NULL)
+		return n;
+
+	for (chunk = n / 2; chunk >= 1; chunk /= 2) {
+		for (start = 0; start + chunk <= n &&
+		     trials < MAX_TRIALS; trials++) {
+			memcpy(tmp, ops, start * sizeof(*ops));
+			memcpy(tmp + start, ops + start + chunk,
+			       (n - start - chunk) * sizeof(*ops));
+
+			if (run_child(tmp, n - chunk, *mask, 1, 1) == -1) {
+				memcpy(ops, tmp, (n - chunk) * sizeof(*ops));
+				n -= chunk;
+			} else {
+				start += chunk;
+			}
+		}
+	}
+
+	free(tmp);
+
+	return n;
+}
+
+static int
+write_trace(unsigned long seed, struct fuzz_op *ops, unsigned long n,
+            unsigned long mask, char *path, size_t path_size)
+{
+	unsigned long i;
+	unsigned int j;
+	FILE *file;
+
+	snprintf(path, path_size, "fuzz_%lu.trace", seed);
+
+	file = fopen(path, "w");
+	if (file == NULL)
+		return -1;
+
+	fprintf(file, "# fuzz_trees seed %lu, trees:", seed);
+	for (j = 0; j < n_trees; j++) {
+		if (mask & (1UL << j))
+			fprintf(file, " %s", trees[j].lib->name);
+	}
+	fprintf(file, "\n");
+
+	for (i = 0; i < n; i++)
+		fprintf(file, "%c %lu\n", op_chars[ops[i].type], ops[i].key);
+
+	return fclose(file) ? -1 : 0;
+}
+
+/* return -1 if the sequence of seed fails */
+static int
+fuzz_seed(unsigned long seed, struct fuzz_op *ops)
+{
+	unsigned long mask = (n_trees == MAX_TREES) ? ~0UL :
+	                     (1UL << n_trees) - 1;
+	unsigned long n;
+	char path[64];
+
+	current_seed = seed;
+	generate(ops, n_ops, seed);
+
+	if (run_child(ops, n_ops, mask, interval, 1) == 0)
+		return 0;
+
+	printf("seed %lu: failed\n", seed);
+
+	n = minimize(ops, n_ops, &mask);
+	/* show the failure of the minimized sequence */
+	run_child(ops, n, mask, 1, 0);
+
+	if (write_trace(seed, ops, n, mask, path, sizeof(path)) == -1)
+		printf("seed %lu: couldn't write trace\n", seed);
+	else
+		printf("seed %lu: minimized to %lu operations in %s\n",
+		       seed, n, path);
+	fflush(stdout);
+
+	return -1;
+}
+
+static int
+worker(unsigned long first_seed, unsigned long n_seeds, unsigned int job,
+       unsigned int n_jobs)
+{
+	struct fuzz_op *ops;
+	unsigned long seed;
+	int failed = 0;
+
+	ops = malloc(n_ops * sizeof(*ops));
+	if (ops == NULL)
+		return 0;
+
+	for (seed = first_seed + job; seed < first_seed + n_seeds;
+	     seed += n_jobs) {
+		if (fuzz_seed(seed, ops) == -1)
+			failed++;
+	}
+
+	free(ops);
+
+	return failed;
+}
+
+static void
+usage(void)
+{
+	printf("usage: cmd [-s seeds] [-S first] [-n ops] [-k keys]\n"
+	       "           [-c interval] [-j jobs] [-a] [-B] [-R]\n"
+	       "           [library...]\n"
+	       "  -s: number of seeds (default %d)\n"
+	       "  -S: first seed (default 1)\n"
+	       "  -n: operations per seed (default %d)\n"
+	       "  -k: keys are 0 to keys - 1 (default %d)\n"
+	       "  -c: check the trees every interval operations\n"
+	       "      (default %d)\n"
+	       "  -j: worker processes (default: number of CPUs)\n"
+	       "  -a: don't compare the shapes of the trees\n"
+	       "  -B: don't check balance factors (not AVL trees)\n"
+	       "  -R: reload the libraries halfway through each seed\n"
+	       "Without libraries, every tree is fuzzed.\n",
+	       DEFAULT_SEEDS, DEFAULT_OPS, DEFAULT_KEYS, DEFAULT_INTERVAL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct list_head tree_list_head = LIST_HEAD_INIT;
+	struct list_node *current;
+	struct tree_library *lib;
+	unsigned long n_seeds = DEFAULT_SEEDS, first_seed = 1;
+	unsigned int n_jobs, job, failed = 0;
+	int opt, status, i;
+
+	n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "s:S:n:k:c:j:aBR")) != -1) {
+		switch (opt) {
+		case 's':
+			n_seeds = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			first_seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			n_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			n_keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			n_jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			check_shape = 0;
+			break;
+		case 'R':
+			reload = 1;
+			break;
+		case 'B':
+			validate_flags &= ~TREE_VALIDATE_BALANCE;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!n_ops || !n_keys || !interval || !n_jobs) {
+		usage();
+		return 1;
+	}
+
+	if (optind == argc)
+		tree_manager_load_trees(&tree_list_head);
+	for (i = optind; i < argc; i++) {
+		if (tree_library_load(argv[i], &tree_list_head) == NULL)
+			printf("couldn't load %s\n", argv[i]);
+	}
+
+	list_for_each (current, tree_list_head.first) {
+		lib = container_of(current, struct tree_library, list_node);
+
+		if (n_trees == MAX_TREES)
+			break;
+
+		tree_info_setup(&trees[n_trees].info, &lib->ops);
+		if (trees[n_trees].info.key.type != TREE_KEY_ULONG)
+			continue;
+		trees[n_trees++].lib = lib;
+
+		printf("tree %s\n", lib->name);
+	}
+
+	if (n_trees == 0) {
+		printf("no trees\n");
+		goto _go_unload_trees;
+	}
+
+	printf("%lu seeds, %lu operations, %lu keys, %u jobs\n",
+	       n_seeds, n_ops, n_keys, n_jobs);
+	fflush(stdout);
+
+	for (job = 0; job < n_jobs; job++) {
+		if (fork() == 0) {
+			status = worker(first_seed, n_seeds, job, n_jobs);
+			_exit(status > 255 ? 255 : status);
+		}
+	}
+
+	while (wait(&status) > 0) {
+		if (WIFEXITED(status))
+			failed += WEXITSTATUS(status);
+		else
+			failed++;
+	}
+
+	printf("%lu seeds, %u failed\n", n_seeds, failed);
+
+_go_unload_trees:
+	tree_manager_unload_trees(&tree_list_head);
+
+	return failed ? 1 : 0;
+}
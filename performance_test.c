@@ -23,27 +23,306 @@
  */
 
 #include <limits.h> /* UINT_MAX */
+#include <math.h> /* sqrt, pow */
+#include <pthread.h>
 #include <stdio.h> /* fflush() */
 #include <stddef.h>
+#include <stdint.h> /* uint64_t */
 #include <stdlib.h> /* random() */
 #include <string.h> /* memset */
+#include <sys/utsname.h> /* uname */
 #include <time.h>
+#include <unistd.h> /* getopt */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> /* _mm_clflush */
+#endif
 
 #include "tree_manager.h"
+#include "tree_trace.h"
 
 /* a million operations is the default */
 #define N_OPS  1000000
 
+/* times all trees are loaded in the load test */
+#define N_LOADS  100
+
 enum {
 	INORDER_TEST,
 	RANDOM_TEST,
+	/* order statistics (trees with TREE_CAP_ORDER) */
+	SELECT_TEST,
+	RANK_TEST,
+	/* searches before and after tree_relayout() */
+	LOOKUP_TEST,
+	RELAYOUT_TEST,
+	/*
+	 * deletes by key, and by element (trees with
+	 * TREE_CAP_DELETE_ELEMENT), in key order or random order
+	 */
+	DELETE_INORDER_TEST,
+	DELETE_RANDOM_TEST,
+	ELEMENT_INORDER_TEST,
+	ELEMENT_RANDOM_TEST,
+	/*
+	 * inserts in key order and in nearly sorted order, plain and
+	 * with the previous element as hint (trees with
+	 * TREE_CAP_INSERT_HINT)
+	 */
+	INSERT_INORDER_TEST,
+	INSERT_NEAR_SORTED_TEST,
+	HINT_INORDER_TEST,
+	HINT_NEAR_SORTED_TEST,
+	/*
+	 * expiry of the oldest keys of a sliding window, by key and
+	 * with delete_range (trees with TREE_CAP_DELETE_RANGE)
+	 */
+	WINDOW_DELETE_TEST,
+	WINDOW_RANGE_TEST,
+	/* merge two trees with inserts (every tree) */
+	MERGE_TEST,
+	/* set operations (trees with TREE_CAP_SET) */
+	UNION_TEST,
+	INTERSECTION_TEST,
+	DIFFERENCE_TEST,
+	/*
+	 * threads doing operations on a tree behind a mutex, a
+	 * spinlock, a readers-writer lock, with flat combining
+	 * (batches in arrival and in key order), and on a sharded
+	 * tree (ulong keys)
+	 */
+	MUTEX_TEST,
+	SPINLOCK_TEST,
+	RWLOCK_TEST,
+	COMBINING_TEST,
+	COMBINING_SORTED_TEST,
+	SHARDED_TEST,
+	/*
+	 * the random test taking a snapshot every SNAPSHOT_STEP
+	 * changes (TREE_CAP_SNAPSHOT), in place in other trees
+	 */
+	SNAPSHOT_TEST,
+	/*
+	 * tree_search() of every key and tree_validate() with the
+	 * walks compiled for the layout of the tree, and generic
+	 */
+	WALK_TEST,
+	WALK_GENERIC_TEST,
 	TEST_LAST,
 };
 
+static const char *test_names[] = {
+	[INORDER_TEST] = "in-order",
+	[RANDOM_TEST] = "random",
+	[SELECT_TEST] = "select",
+	[RANK_TEST] = "rank",
+	[LOOKUP_TEST] = "lookup",
+	[RELAYOUT_TEST] = "relayout",
+	[DELETE_INORDER_TEST] = "delete-in-order",
+	[DELETE_RANDOM_TEST] = "delete-random",
+	[ELEMENT_INORDER_TEST] = "delete-element-in-order",
+	[ELEMENT_RANDOM_TEST] = "delete-element-random",
+	[INSERT_INORDER_TEST] = "insert-in-order",
+	[INSERT_NEAR_SORTED_TEST] = "insert-near-sorted",
+	[HINT_INORDER_TEST] = "hint-in-order",
+	[HINT_NEAR_SORTED_TEST] = "hint-near-sorted",
+	[WINDOW_DELETE_TEST] = "window-delete",
+	[WINDOW_RANGE_TEST] = "window-range",
+	[MERGE_TEST] = "merge",
+	[UNION_TEST] = "union",
+	[INTERSECTION_TEST] = "intersection",
+	[DIFFERENCE_TEST] = "difference",
+	[MUTEX_TEST] = "mutex",
+	[SPINLOCK_TEST] = "spinlock",
+	[RWLOCK_TEST] = "rwlock",
+	[COMBINING_TEST] = "combining",
+	[COMBINING_SORTED_TEST] = "combining-sorted",
+	[SHARDED_TEST] = "sharded",
+	[SNAPSHOT_TEST] = "snapshot",
+	[WALK_TEST] = "walk",
+	[WALK_GENERIC_TEST] = "walk-generic",
+};
+
+#define ORDER_TESTS  ((1 << SELECT_TEST) | (1 << RANK_TEST))
+#define LOOKUP_TESTS  ((1 << LOOKUP_TEST) | (1 << RELAYOUT_TEST))
+#define DELETE_TESTS  ((1 << DELETE_INORDER_TEST) | \
+                       (1 << DELETE_RANDOM_TEST) | \
+                       (1 << ELEMENT_INORDER_TEST) | \
+                       (1 << ELEMENT_RANDOM_TEST))
+#define SET_TESTS    ((1 << UNION_TEST) | (1 << INTERSECTION_TEST) | \
+                      (1 << DIFFERENCE_TEST))
+#define THREAD_TESTS  ((1 << MUTEX_TEST) | (1 << SPINLOCK_TEST) | \
+                       (1 << RWLOCK_TEST) | (1 << COMBINING_TEST) | \
+                       (1 << COMBINING_SORTED_TEST) | (1 << SHARDED_TEST))
+#define WALK_TESTS   ((1 << WALK_TEST) | (1 << WALK_GENERIC_TEST))
+
+/* without -w: the in-order and random tests */
+#define DEFAULT_TESTS  ((1 << INORDER_TEST) | (1 << RANDOM_TEST))
+
+/* tests to run (workload), a bit per test */
+static unsigned int test_mask = DEFAULT_TESTS;
+
+/*
+ * Key workloads. Key k (0 to N_OPS - 1) is mapped to a key of
+ * the workload type keeping the order, so in-order is in-order
+ * for every key type. Trees run only workloads of their key type
+ */
+enum {
+	ULONG_KEYS,
+	/* strings different in the first bytes: "0000002a/object" */
+	STRING_KEYS,
+	/* strings with a long common start: "tenant-0042/object/..." */
+	SHARED_STRING_KEYS,
+	/* (tenant, timestamp) tuples */
+	PAIR_KEYS,
+	KEYS_LAST,
+};
+
+static const char *key_names[] = {
+	[ULONG_KEYS] = "ulong",
+	[STRING_KEYS] = "string",
+	[SHARED_STRING_KEYS] = "string-shared",
+	[PAIR_KEYS] = "pair",
+};
+
+static int key_workload = ULONG_KEYS;
+
+/* bytes reserved for each string key */
+#define STRING_KEY_SIZE  32
+
+/* string of key k is at string_keys + k * STRING_KEY_SIZE */
+static char *string_keys;
+static unsigned char *string_key_len;
+
 struct test_result {
 	struct timespec elapsed_time[TEST_LAST];
+	/* tests that were run, a bit per test */
+	unsigned int done;
+	/* bytes allocated by the changes of the snapshot test */
+	unsigned long allocated;
+};
+
+/*
+ * Cache state at the start of each measured phase (-c):
+ *
+ * - warm: the memory of the tree was just written, as if the
+ *   tree had been in use (default)
+ * - cold: the memory of the tree (and the string keys) is
+ *   flushed from the caches
+ * - corun: warm, with a thread writing a buffer (-C) during the
+ *   tests, as other data competing for the cache
+ */
+enum {
+	CACHE_WARM,
+	CACHE_COLD,
+	CACHE_CORUN,
+	CACHE_LAST,
+};
+
+static const char *cache_names[] = {
+	[CACHE_WARM] = "warm",
+	[CACHE_COLD] = "cold",
+	[CACHE_CORUN] = "corun",
+};
+
+static int cache_mode = CACHE_WARM;
+
+#define CACHE_LINE_SIZE  64
+
+/* when the size of the last level cache isn't known */
+#define DEFAULT_LLC_SIZE  (32 << 20)
+
+/* buffer of the co-runner (default: twice the LLC) */
+static size_t corun_size;
+
+/* placement of the elements in the tree memory (-L) */
+static const char *placement_names[] = {
+	[TREE_PLACE_SEQUENTIAL] = "sequential",
+	[TREE_PLACE_SHUFFLED] = "shuffled",
+	[TREE_PLACE_FRAGMENTED] = "fragmented",
+};
+
+static enum tree_placement placement = TREE_PLACE_SEQUENTIAL;
+
+/*
+ * Distribution of the unsigned long keys (-d):
+ *
+ * - dense: keys 0 to N_OPS - 1 (default)
+ * - sparse: N_OPS random 64-bit keys. Key k is the k-th smallest
+ *   of them, so the order is kept
+ * - zipf: dense keys, but the lookup tests search them with a
+ *   Zipfian popularity (ZIPF_THETA), the most popular ones
+ *   anywhere in the tree
+ *
+ * The window and merge tests have their own keys
+ */
+enum {
+	DIST_DENSE,
+	DIST_SPARSE,
+	DIST_ZIPF,
+	DIST_LAST,
+};
+
+static const char *distribution_names[] = {
+	[DIST_DENSE] = "dense",
+	[DIST_SPARSE] = "sparse",
+	[DIST_ZIPF] = "zipf",
+};
+
+static int distribution = DIST_DENSE;
+
+#define ZIPF_THETA  0.99
+
+/* key k of the sparse distribution, NULL if not sparse */
+static unsigned long *sparse_keys;
+
+/* keys searched by the lookup tests */
+static unsigned long lookup_key_array[N_OPS];
+
+/* threads of the threaded tests (-j) */
+#define MAX_THREADS  64
+
+static unsigned int n_threads = 4;
+
+/* routing of the keys to the shards (-S) */
+static const char *route_names[] = {
+	[TREE_SHARD_RANGE] = "range",
+	[TREE_SHARD_HASH] = "hash",
+};
+
+static enum tree_shard_route shard_route = TREE_SHARD_RANGE;
+
+/* order of the elements in the relayout test (-R) */
+static const char *layout_names[] = {
+	[TREE_LAYOUT_INORDER] = "in-order",
+	[TREE_LAYOUT_PREORDER] = "pre-order",
+	[TREE_LAYOUT_BFS] = "bfs",
+	[TREE_LAYOUT_VEB] = "veb",
 };
 
+static enum tree_layout layout = TREE_LAYOUT_VEB;
+
+/* times each tree is tested (-n) */
+#define MAX_TRIALS  1000
+
+static unsigned int n_trials = 1;
+
+/* random() seed (-s), in the results to repeat a run */
+static unsigned int seed;
+
+/* format of the results (-o) */
+enum {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_CSV,
+};
+
+static int output = OUTPUT_TEXT;
+
+/* machine, in the JSON and CSV results */
+static char cpu_model[128] = "unknown";
+static char kernel[128] = "unknown";
+
 /* stop - start */
 static void
 time_diff(struct timespec *diff, struct timespec *stop, struct timespec *start)
@@ -58,6 +337,126 @@ time_diff(struct timespec *diff, struct timespec *stop, struct timespec *start)
 	}
 }
 
+/* sum += t */
+static void
+time_add(struct timespec *sum, struct timespec *t)
+{
+	sum->tv_sec += t->tv_sec;
+	sum->tv_nsec += t->tv_nsec;
+	if (sum->tv_nsec >= 1000000000) {
+		sum->tv_sec++;
+		sum->tv_nsec -= 1000000000;
+	}
+}
+
+static size_t
+get_llc_size(void)
+{
+	long size = -1;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+	size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (size <= 0)
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+
+	return size > 0 ? size : DEFAULT_LLC_SIZE;
+}
+
+/*
+ * evict a range from the caches. Without clflush, a buffer
+ * larger than the last level cache is written instead
+ */
+static void
+flush_range(void *addr, size_t size)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	char *p = (char*) ((uintptr_t) addr & ~(CACHE_LINE_SIZE - 1));
+	char *end = (char*) addr + size;
+
+	for (; p < end; p += CACHE_LINE_SIZE)
+		_mm_clflush(p);
+	_mm_mfence();
+#else
+	static volatile char *scratch;
+	static size_t scratch_size;
+	size_t i;
+
+	if (scratch == NULL) {
+		scratch_size = 2 * get_llc_size();
+		scratch = malloc(scratch_size);
+		if (scratch == NULL)
+			return;
+	}
+
+	for (i = 0; i < scratch_size; i += CACHE_LINE_SIZE)
+		scratch[i]++;
+#endif
+}
+
+/* bring the caches to the state of cache_mode before a phase */
+static void
+prepare_cache(struct tree_memory *m, struct tree_info *i, unsigned long n)
+{
+	if (cache_mode != CACHE_COLD)
+		return;
+
+	flush_range(m->root, i->root_size);
+	flush_range(m->array, i->element_size * n);
+	if (string_keys) {
+		flush_range(string_keys, (size_t) N_OPS * STRING_KEY_SIZE);
+		flush_range(string_key_len, N_OPS);
+	}
+}
+
+struct corun {
+	pthread_t thread;
+	volatile char *buffer;
+	size_t size;
+	int stop;
+};
+
+/* write a line of the buffer at a time until stopped */
+static void*
+corun_thread(void *arg)
+{
+	struct corun *c = arg;
+	size_t i;
+
+	while (!__atomic_load_n(&c->stop, __ATOMIC_RELAXED)) {
+		for (i = 0; i < c->size; i += CACHE_LINE_SIZE)
+			c->buffer[i]++;
+	}
+
+	return NULL;
+}
+
+static int
+corun_start(struct corun *c)
+{
+	c->size = corun_size ? corun_size : 2 * get_llc_size();
+	c->stop = 0;
+
+	c->buffer = malloc(c->size);
+	if (c->buffer == NULL)
+		return -1;
+
+	if (pthread_create(&c->thread, NULL, corun_thread, c) != 0) {
+		free((void*) c->buffer);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+corun_stop(struct corun *c)
+{
+	__atomic_store_n(&c->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(c->thread, NULL);
+	free((void*) c->buffer);
+}
+
 static void
 fill_in_order(unsigned long *array, unsigned long current)
 {
@@ -97,111 +496,2036 @@ prepare_random_key_array(unsigned long *random_key_array, unsigned long size)
 	randomize(random_key_array, size);
 }
 
+/* unsigned long key k of the distribution (-d) */
+static inline unsigned long
+ulong_key(unsigned long k)
+{
+	return sparse_keys ? sparse_keys[k] : k;
+}
+
+static int
+compare_ulong(const void *_a, const void *_b)
+{
+	const unsigned long *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
 /*
- * This is the function where the test happens.
- *
- * random_key_array is initialized in main() and is used
- * to keep the same random keys during multiple tests.
+ * random 64-bit keys, sorted. The splitmix64 finalizer is a
+ * bijection, so the keys of different k are different
+ */
+static int
+prepare_sparse_keys(unsigned long size)
+{
+	unsigned long k, z;
+
+	sparse_keys = malloc(size * sizeof(*sparse_keys));
+	if (sparse_keys == NULL)
+		return -1;
+
+	for (k = 0; k < size; k++) {
+		z = (k + seed) * 0x9e3779b97f4a7c15UL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+		sparse_keys[k] = z ^ (z >> 31);
+	}
+
+	qsort(sparse_keys, size, sizeof(*sparse_keys), compare_ulong);
+
+	return 0;
+}
+
+/*
+ * rank (0 is the most popular) drawn with a Zipfian distribution,
+ * as the generator of Gray et al. ("Quickly generating
+ * billion-record synthetic databases"). zeta is the sum of
+ * 1 / i^theta for i from 1 to size
+ */
+static unsigned long
+zipf_rank(unsigned long size, double zeta)
+{
+	double alpha = 1 / (1 - ZIPF_THETA);
+	double eta = (1 - pow(2.0 / size, 1 - ZIPF_THETA)) /
+	             (1 - (1 + pow(0.5, ZIPF_THETA)) / zeta);
+	double u = (double) random() / RAND_MAX;
+	double uz = u * zeta;
+	unsigned long rank;
+
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, ZIPF_THETA))
+		return 1;
+
+	rank = size * pow(eta * u - eta + 1, alpha);
+
+	return rank < size ? rank : size - 1;
+}
+
+/*
+ * the keys of random_key_array in that order or, with zipf, the
+ * key of popularity rank r is random_key_array[r]
  */
 static void
-do_test(struct tree_operations *ops, struct test_result *result,
-        unsigned long *random_key_array)
+prepare_lookup_key_array(unsigned long *random_key_array,
+                         unsigned long size)
 {
-	struct tree_info tree_info;
-	struct tree_memory tree_memory;
-	struct timespec start_time, stop_time;
 	unsigned long i;
+	double zeta = 0;
 
-	tree_info_setup(&tree_info, ops);
-	tree_memory_allocate(&tree_memory, &tree_info, N_OPS);
-	/* write in the memory so it will be in cache */
-	memset(tree_memory.addr, 0,
-	       tree_info.root_size + tree_info.element_size * N_OPS);
-	ops->init(tree_memory.root);
+	if (distribution == DIST_ZIPF) {
+		for (i = 1; i <= size; i++)
+			zeta += 1 / pow(i, ZIPF_THETA);
+	}
 
-	/*
-	 * in-order test
-	 */
+	for (i = 0; i < size; i++) {
+		if (distribution == DIST_ZIPF)
+			lookup_key_array[i] = random_key_array[zipf_rank(size,
+			                                                 zeta)];
+		else
+			lookup_key_array[i] = ulong_key(random_key_array[i]);
+	}
+}
 
-	tree_fill_in_order(&tree_memory, &tree_info, N_OPS);
+/* keys in order, each swapped with one of the next NEAR_WINDOW keys */
+#define NEAR_WINDOW  16
 
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
+static unsigned long near_sorted_key_array[N_OPS];
 
-	for (i = 0; i < N_OPS; i++)
-		tree_insert(&tree_memory, &tree_info, i);
+static void
+prepare_near_sorted_key_array(unsigned long *array, unsigned long size)
+{
+	unsigned long current, idx, tmp_value;
 
-	for (i = 0; i < N_OPS; i++)
-		tree_delete(&tree_memory, &tree_info, i);
+	fill_in_order(array, size);
 
-	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+	for (current = 0; current < size; current++) {
+		idx = current + random() % NEAR_WINDOW;
+		if (idx >= size)
+			continue;
 
-	/* store 'in-order test' running time in test result */
-	time_diff(&result->elapsed_time[INORDER_TEST],
-	          &stop_time, &start_time);
+		tmp_value = array[current];
+		array[current] = array[idx];
+		array[idx] = tmp_value;
+	}
+}
 
-	/*
-	 * random test
-	 */
+static int
+prepare_string_keys(void)
+{
+	unsigned long k;
+	int len;
 
-	/*
-	 * we do this way to keep the same
-	 * random keys during multiple tests
-	 */
-	tree_assign_keys(&tree_memory, &tree_info, random_key_array, N_OPS);
+	string_keys = malloc(N_OPS * STRING_KEY_SIZE);
+	string_key_len = malloc(N_OPS);
+	if (!string_keys || !string_key_len)
+		return -1;
 
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	for (k = 0; k < N_OPS; k++) {
+		if (key_workload == STRING_KEYS)
+			len = snprintf(string_keys + k * STRING_KEY_SIZE,
+			               STRING_KEY_SIZE, "%08lx/object", k);
+		else
+			len = snprintf(string_keys + k * STRING_KEY_SIZE,
+			               STRING_KEY_SIZE,
+			               "tenant-0042/object/%08lx", k);
+		string_key_len[k] = len;
+	}
 
-	for (i = 0; i < N_OPS; i++)
-		tree_insert(&tree_memory, &tree_info, i);
+	return 0;
+}
 
-	for (i = 0; i < N_OPS; i++)
-		tree_delete(&tree_memory, &tree_info, i);
+static int
+key_workload_supported(struct tree_info *tree_info)
+{
+	switch (key_workload) {
+	case STRING_KEYS:
+	case SHARED_STRING_KEYS:
+		return tree_info->key.type == TREE_KEY_VAR;
+	case PAIR_KEYS:
+		return tree_info->key.type == TREE_KEY_BYTES &&
+		       tree_info->key.size == 2 * sizeof(uint64_t);
+	default:
+		return tree_info->key.type == TREE_KEY_ULONG;
+	}
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+static void
+put_be64(unsigned char *dst, uint64_t value)
+{
+	int i;
 
-	/* store 'random test' running time in test result */
-	time_diff(&result->elapsed_time[RANDOM_TEST],
-	          &stop_time, &start_time);
+	for (i = 7; i >= 0; i--, value >>= 8)
+		dst[i] = value & 0xff;
+}
 
-	tree_memory_free(&tree_memory);
+/*
+ * set keys of the elements to the workload keys of
+ * key_array, or in-order (key k for element k) if it's NULL
+ */
+static void
+set_keys(struct tree_memory *m, struct tree_info *i,
+         unsigned long *key_array)
+{
+	unsigned long idx, k;
+	void *key;
+
+	if (key_workload == ULONG_KEYS && sparse_keys) {
+		for (idx = 0; idx < N_OPS; idx++) {
+			k = key_array ? key_array[idx] : idx;
+			tree_element_set_key(i, tree_memory_element(m, i, idx),
+			                     sparse_keys[k]);
+		}
+		return;
+	}
+
+	if (key_workload == ULONG_KEYS) {
+		if (key_array)
+			tree_assign_keys(m, i, key_array, N_OPS);
+		else
+			tree_fill_in_order(m, i, N_OPS);
+		return;
+	}
+
+	for (idx = 0; idx < N_OPS; idx++) {
+		k = key_array ? key_array[idx] : idx;
+		key = tree_memory_element(m, i, idx) +
+		      i->key_offset_in_element;
+
+		if (key_workload == PAIR_KEYS) {
+			/* a tenant for every 16384 timestamps */
+			put_be64(key, k >> 14);
+			put_be64(key + 8, k);
+		} else {
+			tree_var_key_set(i, key,
+			                 string_keys + k * STRING_KEY_SIZE,
+			                 string_key_len[k]);
+		}
+	}
 }
 
-int
-main(void)
+/* the elements of m in the slots of the placement (-L) */
+static void
+place_elements(struct tree_memory *m, struct tree_info *i)
 {
-	struct test_result result;
-	struct timespec time_seed;
-	struct list_head tree_list_head = LIST_HEAD_INIT;
-	struct list_node *current;
+	if (tree_memory_place(m, i, placement) == -1)
+		fprintf(stderr, "couldn't place elements, they are "
+		        "sequential\n");
+}
 
-	unsigned long random_key_array[N_OPS];
+/* search with the tree, or walking it if it can't search */
+static void*
+lookup(struct tree_info *i, void *root, unsigned long key)
+{
+	if (i->ops->search)
+		return i->ops->search(root, key);
 
-	tree_manager_load_trees(&tree_list_head);
+	return tree_search(i, root, key);
+}
 
-	/* set random() seed */
-	clock_gettime(CLOCK_REALTIME, &time_seed);
-	srandom(time_seed.tv_nsec % UINT_MAX);
+static void
+build_tree(struct tree_memory *m, struct tree_info *i, unsigned long n)
+{
+	unsigned long idx;
 
-	prepare_random_key_array(random_key_array, N_OPS);
+	i->ops->init(m->root);
+	for (idx = 0; idx < n; idx++)
+		tree_insert(m, i, idx);
+}
 
-	list_for_each (current, tree_list_head.first) {
-		struct tree_library *tmp;
+/*
+ * delete the keys of the elements of m from root (the root of m
+ * or of another tree with them). Trees that allocate their nodes
+ * (e.g. cow_avl and art) free them only on delete
+ */
+static void
+empty_tree(void *root, struct tree_memory *m, struct tree_info *i,
+           unsigned long n)
+{
+	unsigned long idx;
 
-		tmp = container_of(current, struct tree_library, list_node);
+	for (idx = 0; idx < n; idx++)
+		i->ops->delete(root, tree_element_get_key(i,
+		               tree_memory_element(m, i, idx)));
+}
 
-		do_test(&tmp->ops, &result, random_key_array);
+/*
+ * Sliding window tests: the tree has the last N_OPS / 2 keys of
+ * a stream of increasing keys (e.g. timestamps). Every step the
+ * oldest WINDOW_STEP keys expire and their elements take the
+ * next keys, N_OPS keys in all. Only the expiry is measured: a
+ * delete per key, or a delete_range whose list of elements is
+ * then inserted again.
+ */
 
-		printf("Tree %s\n", tmp->name);
-		printf("  in-order: %ld.%09ld\n",
-	               result.elapsed_time[INORDER_TEST].tv_sec,
-	               result.elapsed_time[INORDER_TEST].tv_nsec);
-		printf("  random: %ld.%09ld\n",
-	               result.elapsed_time[RANDOM_TEST].tv_sec,
-	               result.elapsed_time[RANDOM_TEST].tv_nsec);
+#define WINDOW_STEP  1024
 
-		fflush(stdout);
+static void
+do_window_test(struct tree_info *tree_info, struct test_result *result)
+{
+	struct tree_operations *ops = tree_info->ops;
+	struct tree_memory m;
+	struct timespec start_time, stop_time, diff;
+	unsigned long i, k, lo, n = N_OPS / 2;
+	void *element, *next;
+	int test;
+
+	if (key_workload != ULONG_KEYS)
+		return;
+
+	for (test = WINDOW_DELETE_TEST; test <= WINDOW_RANGE_TEST; test++) {
+		if (!(test_mask & (1 << test)))
+			continue;
+		if (test == WINDOW_RANGE_TEST &&
+		    !tree_has_capability(tree_info, TREE_CAP_DELETE_RANGE))
+			continue;
+
+		tree_memory_allocate(&m, tree_info, n);
+		place_elements(&m, tree_info);
+		tree_fill_in_order(&m, tree_info, n);
+		ops->init(m.root);
+		for (i = 0; i < n; i++)
+			tree_insert(&m, tree_info, i);
+
+		prepare_cache(&m, tree_info, n);
+
+		result->elapsed_time[test].tv_sec = 0;
+		result->elapsed_time[test].tv_nsec = 0;
+
+		for (lo = 0; lo < N_OPS; lo += WINDOW_STEP) {
+			if (test == WINDOW_RANGE_TEST) {
+				clock_gettime(CLOCK_MONOTONIC, &start_time);
+				element = ops->delete_range(m.root, lo,
+				                            lo + WINDOW_STEP - 1);
+				clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+				/* the elements in the list are reused */
+				for (; element; element = next) {
+					next = tree_list_next(tree_info,
+					                      element);
+					k = tree_element_get_key(tree_info,
+					                         element);
+					tree_element_set_key(tree_info,
+					                     element, k + n);
+					ops->insert(m.root, element);
+				}
+			} else {
+				clock_gettime(CLOCK_MONOTONIC, &start_time);
+				for (k = lo; k < lo + WINDOW_STEP; k++)
+					ops->delete(m.root, k);
+				clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+				/* the element of key k is k % n */
+				for (k = lo; k < lo + WINDOW_STEP; k++) {
+					element = tree_memory_element(&m,
+					          tree_info, k % n);
+					tree_element_set_key(tree_info,
+					                     element, k + n);
+					ops->insert(m.root, element);
+				}
+			}
+
+			time_diff(&diff, &stop_time, &start_time);
+			time_add(&result->elapsed_time[test], &diff);
+		}
+
+		result->done |= 1 << test;
+
+		empty_tree(m.root, &m, tree_info, n);
+		tree_memory_free(&m);
 	}
+}
+
+/*
+ * Merge tests: tree a has the keys of the first half of
+ * random_key_array and tree b of the half in the middle, so
+ * half of the keys of b are in a.
+ *
+ * The merge test inserts the elements of b in a, one by one.
+ * The set tests build both trees (not measured) and do the
+ * union, intersection and difference of them into a.
+ */
+static void
+do_merge_test(struct tree_info *tree_info, struct test_result *result,
+              unsigned long *random_key_array)
+{
+	struct tree_operations *ops = tree_info->ops;
+	struct tree_memory a, b;
+	struct timespec start_time, stop_time;
+	unsigned long i, n = N_OPS / 2;
+	int test;
+
+	if (!(test_mask & ((1 << MERGE_TEST) | SET_TESTS)) ||
+	    key_workload != ULONG_KEYS)
+		return;
+
+	tree_memory_allocate(&a, tree_info, n);
+	tree_memory_allocate(&b, tree_info, n);
+	place_elements(&a, tree_info);
+	place_elements(&b, tree_info);
+	tree_assign_keys(&a, tree_info, random_key_array, n);
+	tree_assign_keys(&b, tree_info, random_key_array + n / 2, n);
+	/* a is emptied at the end, even if no test builds it */
+	ops->init(a.root);
+
+	if (test_mask & (1 << MERGE_TEST)) {
+		build_tree(&a, tree_info, n);
+		prepare_cache(&a, tree_info, n);
+		prepare_cache(&b, tree_info, n);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < n; i++)
+			ops->insert(a.root, tree_memory_element(&b, tree_info,
+			                                        i));
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[MERGE_TEST],
+		          &stop_time, &start_time);
+		result->done |= 1 << MERGE_TEST;
+	}
+
+	if (!tree_has_capability(tree_info, TREE_CAP_SET))
+		goto _go_free_memory;
+
+	for (test = UNION_TEST; test <= DIFFERENCE_TEST; test++) {
+		if (!(test_mask & (1 << test)))
+			continue;
+
+		build_tree(&a, tree_info, n);
+		build_tree(&b, tree_info, n);
+		prepare_cache(&a, tree_info, n);
+		prepare_cache(&b, tree_info, n);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		if (test == UNION_TEST)
+			ops->set_union(a.root, a.root, b.root);
+		else if (test == INTERSECTION_TEST)
+			ops->set_intersection(a.root, a.root, b.root);
+		else
+			ops->set_difference(a.root, a.root, b.root);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[test],
+		          &stop_time, &start_time);
+		result->done |= 1 << test;
+	}
+
+_go_free_memory:
+	/* a has the elements of both (b is left in no tree) */
+	empty_tree(a.root, &a, tree_info, n);
+	empty_tree(a.root, &b, tree_info, n);
+	tree_memory_free(&b);
+	tree_memory_free(&a);
+}
+
+/*
+ * Threaded tests: -j threads insert, search and delete the
+ * random keys, each thread the elements i with i % threads equal
+ * to its number. The lock tests share a single tree with
+ * tree_sync_op(), of the type in sync_types. The sharded test has
+ * a shard per thread (-S), each with an owner thread the
+ * operations are delegated to. The time is from the start of the
+ * threads until every operation is done
+ */
+static const enum tree_sync_type sync_types[] = {
+	[MUTEX_TEST] = TREE_SYNC_MUTEX,
+	[SPINLOCK_TEST] = TREE_SYNC_SPINLOCK,
+	[RWLOCK_TEST] = TREE_SYNC_RWLOCK,
+	[COMBINING_TEST] = TREE_SYNC_COMBINING,
+	[COMBINING_SORTED_TEST] = TREE_SYNC_COMBINING,
+};
+
+struct thread_test {
+	struct tree_info *t;
+	struct tree_memory *m;
+	int test;
+	struct tree_sync sync;
+	struct tree_shards shards;
+};
+
+struct thread_worker {
+	struct thread_test *tt;
+	unsigned int idx;
+	pthread_t thread;
+};
+
+static void*
+thread_worker_run(void *arg)
+{
+	struct thread_worker *w = arg;
+	struct thread_test *tt = w->tt;
+	struct tree_info *t = tt->t;
+	static const enum tree_op phases[] = {
+		TREE_OP_INSERT, TREE_OP_SEARCH, TREE_OP_DELETE,
+	};
+	enum tree_op op;
+	unsigned long i, key;
+	void *element;
+	int phase;
+
+	/* the owners of the shards are on the first CPUs */
+	tree_pin_thread(tt->test == SHARDED_TEST ? n_threads + w->idx :
+	                                           w->idx);
+
+	for (phase = 0; phase < 3; phase++) {
+		op = phases[phase];
+		for (i = w->idx; i < N_OPS; i += n_threads) {
+			element = tree_memory_element(tt->m, t, i);
+			key = tree_element_get_key(t, element);
+
+			if (tt->test == SHARDED_TEST) {
+				tree_shards_submit(&tt->shards, w->idx, op,
+				                   key, element);
+				continue;
+			}
+
+			tree_sync_op(&tt->sync, w->idx, op, key, element);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+do_thread_test(struct tree_info *tree_info, struct test_result *result,
+               unsigned long *random_key_array)
+{
+	struct thread_worker workers[MAX_THREADS];
+	struct thread_test tt = { .t = tree_info };
+	struct tree_memory m;
+	struct timespec start_time, stop_time;
+	unsigned int i, n;
+	int test;
+
+	if (!(test_mask & THREAD_TESTS) || key_workload != ULONG_KEYS)
+		return;
+
+	tree_memory_allocate(&m, tree_info, N_OPS);
+	place_elements(&m, tree_info);
+	set_keys(&m, tree_info, random_key_array);
+	tt.m = &m;
+
+	for (test = MUTEX_TEST; test <= SHARDED_TEST; test++) {
+		if (!(test_mask & (1 << test)))
+			continue;
+
+		tt.test = test;
+		if (test != SHARDED_TEST) {
+			tree_info->ops->init(m.root);
+			if (tree_sync_init(&tt.sync, tree_info, m.root,
+			                   sync_types[test], n_threads,
+			                   test == COMBINING_SORTED_TEST ?
+			                   TREE_SYNC_SORT : 0) == -1)
+				continue;
+		} else if (tree_shards_init(&tt.shards, tree_info, n_threads,
+		                            shard_route,
+		                            ulong_key(N_OPS - 1)) == -1) {
+			continue;
+		} else if (tree_shards_start(&tt.shards, n_threads) == -1) {
+			tree_shards_free(&tt.shards);
+			continue;
+		}
+
+		prepare_cache(&m, tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (n = 0; n < n_threads; n++) {
+			workers[n].tt = &tt;
+			workers[n].idx = n;
+			if (pthread_create(&workers[n].thread, NULL,
+			                   thread_worker_run, &workers[n]))
+				break;
+		}
+		for (i = 0; i < n; i++)
+			pthread_join(workers[i].thread, NULL);
+
+		if (test == SHARDED_TEST)
+			tree_shards_stop(&tt.shards);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		if (test == SHARDED_TEST)
+			tree_shards_free(&tt.shards);
+		else
+			tree_sync_free(&tt.sync);
+
+		/* every thread must have run */
+		if (n < n_threads)
+			continue;
+
+		time_diff(&result->elapsed_time[test],
+		          &stop_time, &start_time);
+		result->done |= 1 << test;
+	}
+
+	tree_memory_free(&m);
+}
+
+/*
+ * Snapshot test
+ * =============
+ *
+ * The random test (inserts, then deletes) where the writer takes
+ * a snapshot every SNAPSHOT_STEP changes and keeps the newest
+ * SNAPSHOT_KEEP, as if readers were still using them. Each change
+ * copies the nodes of its path shared with a snapshot. Trees
+ * without TREE_CAP_SNAPSHOT change in place, run with -b to
+ * compare to them.
+ */
+
+#define SNAPSHOT_STEP  1024
+#define SNAPSHOT_KEEP  4
+
+static void
+do_snapshot_test(struct tree_info *tree_info, struct test_result *result,
+                 unsigned long *random_key_array)
+{
+	struct tree_operations *ops = tree_info->ops;
+	struct tree_versions v;
+	struct tree_memory m;
+	struct timespec start_time, stop_time;
+	unsigned long i;
+	int snapshots;
+
+	if (!(test_mask & (1 << SNAPSHOT_TEST)) || key_workload != ULONG_KEYS)
+		return;
+
+	snapshots = tree_has_capability(tree_info, TREE_CAP_SNAPSHOT);
+
+	tree_memory_allocate(&m, tree_info, N_OPS);
+	place_elements(&m, tree_info);
+	set_keys(&m, tree_info, random_key_array);
+	ops->init(m.root);
+	tree_versions_init(&v, tree_info, m.root);
+
+	prepare_cache(&m, tree_info, N_OPS);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	for (i = 0; i < 2 * N_OPS; i++) {
+		if (i < N_OPS)
+			tree_insert(&m, tree_info, i);
+		else
+			tree_delete(&m, tree_info, i - N_OPS);
+
+		if (!snapshots || (i + 1) % SNAPSHOT_STEP)
+			continue;
+		tree_snapshot_take(&v);
+		tree_versions_trim(&v, SNAPSHOT_KEEP);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+	time_diff(&result->elapsed_time[SNAPSHOT_TEST],
+	          &stop_time, &start_time);
+	result->done |= 1 << SNAPSHOT_TEST;
+
+	if (snapshots) {
+		tree_versions_trim(&v, 0);
+		result->allocated = ops->get_allocated(m.root);
+	}
+
+	tree_memory_free(&m);
+}
+
+/*
+ * Walk tests
+ * ==========
+ *
+ * The walks of the tree manager (tree_search() of every key, in
+ * random order, and a tree_validate()) in a tree built with the
+ * random keys. Each runs with the walks compiled for the layout
+ * of the tree, and with the generic ones, which read the offsets
+ * from struct tree_info.
+ */
+
+static void
+do_walk_test(struct tree_info *tree_info, struct test_result *result,
+             unsigned long *random_key_array)
+{
+	struct tree_info generic = *tree_info;
+	struct tree_memory m;
+	struct timespec start_time, stop_time;
+	struct tree_info *t;
+	unsigned long i;
+	int test;
+
+	if (!(test_mask & WALK_TESTS) || key_workload != ULONG_KEYS ||
+	    tree_has_capability(tree_info, TREE_CAP_NON_BINARY))
+		return;
+
+	tree_info_use_generic_walk(&generic);
+
+	tree_memory_allocate(&m, tree_info, N_OPS);
+	place_elements(&m, tree_info);
+	set_keys(&m, tree_info, random_key_array);
+	tree_info->ops->init(m.root);
+	for (i = 0; i < N_OPS; i++)
+		tree_insert(&m, tree_info, i);
+
+	for (test = WALK_TEST; test <= WALK_GENERIC_TEST; test++) {
+		if (!(test_mask & (1 << test)))
+			continue;
+
+		t = test == WALK_TEST ? tree_info : &generic;
+		prepare_cache(&m, tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < N_OPS; i++)
+			tree_search(t, m.root, lookup_key_array[i]);
+		tree_validate(t, m.root, 0, 0, NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[test],
+		          &stop_time, &start_time);
+		result->done |= 1 << test;
+	}
+
+	for (i = 0; i < N_OPS; i++)
+		tree_delete(&m, tree_info, i);
+
+	tree_memory_free(&m);
+}
+
+/*
+ * This is the function where the test happens.
+ *
+ * random_key_array is initialized in main() and is used
+ * to keep the same random keys during multiple tests.
+ *
+ * Return -1 if the tree doesn't have the key type of the
+ * key workload.
+ */
+static int
+do_test(struct tree_operations *ops, struct test_result *result,
+        unsigned long *random_key_array)
+{
+	struct tree_info tree_info;
+	struct tree_memory tree_memory;
+	struct timespec start_time, stop_time;
+	unsigned long i;
+	int test;
+
+	tree_info_setup(&tree_info, ops);
+	if (!key_workload_supported(&tree_info))
+		return -1;
+
+	result->done = 0;
+	result->allocated = 0;
+
+	tree_memory_allocate(&tree_memory, &tree_info, N_OPS);
+	/* write in the memory so it will be in cache */
+	memset(tree_memory.addr, 0,
+	       tree_info.root_size + tree_info.element_size * N_OPS);
+	place_elements(&tree_memory, &tree_info);
+	ops->init(tree_memory.root);
+
+	/*
+	 * in-order test
+	 */
+
+	if (!(test_mask & (1 << INORDER_TEST)))
+		goto _go_random_test;
+
+	set_keys(&tree_memory, &tree_info, NULL);
+	prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	for (i = 0; i < N_OPS; i++)
+		tree_insert(&tree_memory, &tree_info, i);
+
+	for (i = 0; i < N_OPS; i++)
+		tree_delete(&tree_memory, &tree_info, i);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+	/* store 'in-order test' running time in test result */
+	time_diff(&result->elapsed_time[INORDER_TEST],
+	          &stop_time, &start_time);
+	result->done |= 1 << INORDER_TEST;
+
+	/*
+	 * random test
+	 */
+
+_go_random_test:
+	if (!(test_mask & (1 << RANDOM_TEST)))
+		goto _go_order_test;
+
+	/*
+	 * we do this way to keep the same
+	 * random keys during multiple tests
+	 */
+	set_keys(&tree_memory, &tree_info, random_key_array);
+	prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	for (i = 0; i < N_OPS; i++)
+		tree_insert(&tree_memory, &tree_info, i);
+
+	for (i = 0; i < N_OPS; i++)
+		tree_delete(&tree_memory, &tree_info, i);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+	/* store 'random test' running time in test result */
+	time_diff(&result->elapsed_time[RANDOM_TEST],
+	          &stop_time, &start_time);
+	result->done |= 1 << RANDOM_TEST;
+
+	/*
+	 * order statistics tests: queries on a tree with all the
+	 * keys, built (and emptied) out of the measured time
+	 */
+
+_go_order_test:
+	if (!(test_mask & ORDER_TESTS) ||
+	    !tree_has_capability(&tree_info, TREE_CAP_ORDER))
+		goto _go_lookup_test;
+
+	set_keys(&tree_memory, &tree_info, random_key_array);
+	for (i = 0; i < N_OPS; i++)
+		tree_insert(&tree_memory, &tree_info, i);
+
+	if (test_mask & (1 << SELECT_TEST)) {
+		prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < N_OPS; i++)
+			ops->select(tree_memory.root, random_key_array[i]);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[SELECT_TEST],
+		          &stop_time, &start_time);
+		result->done |= 1 << SELECT_TEST;
+	}
+
+	if (test_mask & (1 << RANK_TEST)) {
+		prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < N_OPS; i++)
+			ops->rank(tree_memory.root,
+			          ulong_key(random_key_array[i]));
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[RANK_TEST],
+		          &stop_time, &start_time);
+		result->done |= 1 << RANK_TEST;
+	}
+
+	for (i = 0; i < N_OPS; i++)
+		tree_delete(&tree_memory, &tree_info, i);
+
+	/*
+	 * lookup tests: search every key, in random order, in a
+	 * tree built with the random keys. The relayout test moves
+	 * the elements to the order of the tree (-R, not measured)
+	 * and searches again
+	 */
+
+_go_lookup_test:
+	if (!(test_mask & LOOKUP_TESTS) || key_workload != ULONG_KEYS)
+		goto _go_delete_test;
+
+	set_keys(&tree_memory, &tree_info, random_key_array);
+	for (i = 0; i < N_OPS; i++)
+		tree_insert(&tree_memory, &tree_info, i);
+
+	if (test_mask & (1 << LOOKUP_TEST)) {
+		prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < N_OPS; i++)
+			lookup(&tree_info, tree_memory.root,
+			       lookup_key_array[i]);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[LOOKUP_TEST],
+		          &stop_time, &start_time);
+		result->done |= 1 << LOOKUP_TEST;
+	}
+
+	if ((test_mask & (1 << RELAYOUT_TEST)) &&
+	    tree_relayout(&tree_memory, &tree_info, layout) == 0) {
+		prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < N_OPS; i++)
+			lookup(&tree_info, tree_memory.root,
+			       lookup_key_array[i]);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[RELAYOUT_TEST],
+		          &stop_time, &start_time);
+		result->done |= 1 << RELAYOUT_TEST;
+	}
+
+	for (i = 0; i < N_OPS; i++)
+		tree_delete(&tree_memory, &tree_info, i);
+
+	/*
+	 * delete tests: a tree with all the keys (built out of the
+	 * measured time) is emptied by key, or by element, which
+	 * doesn't search the key
+	 */
+
+_go_delete_test:
+	for (test = DELETE_INORDER_TEST; test <= ELEMENT_RANDOM_TEST; test++) {
+		if (!(test_mask & (1 << test)))
+			continue;
+		if (test >= ELEMENT_INORDER_TEST &&
+		    !tree_has_capability(&tree_info, TREE_CAP_DELETE_ELEMENT))
+			continue;
+
+		/* elements are deleted from 0, in the order of the keys */
+		if (test == DELETE_INORDER_TEST || test == ELEMENT_INORDER_TEST)
+			set_keys(&tree_memory, &tree_info, NULL);
+		else
+			set_keys(&tree_memory, &tree_info, random_key_array);
+		for (i = 0; i < N_OPS; i++)
+			tree_insert(&tree_memory, &tree_info, i);
+
+		prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		if (test >= ELEMENT_INORDER_TEST) {
+			for (i = 0; i < N_OPS; i++)
+				tree_delete_element(&tree_memory, &tree_info,
+				                    i);
+		} else {
+			for (i = 0; i < N_OPS; i++)
+				tree_delete(&tree_memory, &tree_info, i);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[test],
+		          &stop_time, &start_time);
+		result->done |= 1 << test;
+	}
+
+	/*
+	 * insert tests: an empty tree is filled in key order or in
+	 * nearly sorted order. The hint of each insert is the element
+	 * inserted before it, which has a close key. The tree is
+	 * emptied out of the measured time
+	 */
+
+	for (test = INSERT_INORDER_TEST; test <= HINT_NEAR_SORTED_TEST;
+	     test++) {
+		if (!(test_mask & (1 << test)))
+			continue;
+		if (test >= HINT_INORDER_TEST &&
+		    !tree_has_capability(&tree_info, TREE_CAP_INSERT_HINT))
+			continue;
+
+		if (test == INSERT_INORDER_TEST || test == HINT_INORDER_TEST)
+			set_keys(&tree_memory, &tree_info, NULL);
+		else
+			set_keys(&tree_memory, &tree_info,
+			         near_sorted_key_array);
+
+		prepare_cache(&tree_memory, &tree_info, N_OPS);
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		if (test >= HINT_INORDER_TEST) {
+			tree_insert(&tree_memory, &tree_info, 0);
+			for (i = 1; i < N_OPS; i++)
+				tree_insert_hint(&tree_memory, &tree_info,
+				                 i, i - 1);
+		} else {
+			for (i = 0; i < N_OPS; i++)
+				tree_insert(&tree_memory, &tree_info, i);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&result->elapsed_time[test],
+		          &stop_time, &start_time);
+		result->done |= 1 << test;
+
+		for (i = 0; i < N_OPS; i++)
+			tree_delete(&tree_memory, &tree_info, i);
+	}
+
+	tree_memory_free(&tree_memory);
+
+	do_window_test(&tree_info, result);
+	do_merge_test(&tree_info, result, random_key_array);
+	do_thread_test(&tree_info, result, random_key_array);
+	do_snapshot_test(&tree_info, result, random_key_array);
+	do_walk_test(&tree_info, result, random_key_array);
+
+	return 0;
+}
+
+static double
+timespec_to_double(struct timespec *t)
+{
+	return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+/* time of test before over time of test after, if both ran */
+static void
+print_speedup(struct test_result *result, int before, int after,
+              const char *name)
+{
+	if (!(result->done & (1 << before)) || !(result->done & (1 << after)))
+		return;
+
+	printf("  %s speedup: %.2fx\n", name,
+	       timespec_to_double(&result->elapsed_time[before]) /
+	       timespec_to_double(&result->elapsed_time[after]));
+}
+
+/*
+ * print the times of a tree. If base isn't NULL, each time is
+ * also relative to the time of the base tree (see -b)
+ */
+static void
+print_result(struct tree_library *lib, struct test_result *result,
+             struct test_result *base)
+{
+	double t, t_base;
+	char name[64];
+	int test;
+
+	printf("Tree %s\n", lib->name);
+	printf("  isa: %s\n", lib->isa);
+	printf("  keys: %s\n", key_names[key_workload]);
+	printf("  cache: %s\n", cache_names[cache_mode]);
+	printf("  placement: %s\n", placement_names[placement]);
+	if (key_workload == ULONG_KEYS)
+		printf("  distribution: %s\n",
+		       distribution_names[distribution]);
+	if (n_trials > 1)
+		printf("  trials: %u (median time)\n", n_trials);
+
+	for (test = 0; test < TEST_LAST; test++) {
+		if (!(result->done & (1 << test)))
+			continue;
+		printf("  %s: %ld.%09ld", test_names[test],
+		       result->elapsed_time[test].tv_sec,
+		       result->elapsed_time[test].tv_nsec);
+
+		if (base && (base->done & (1 << test))) {
+			t = timespec_to_double(&result->elapsed_time[test]);
+			t_base = timespec_to_double(&base->elapsed_time[test]);
+			printf(" (%+.2f%%)", (t - t_base) / t_base * 100);
+		}
+
+		printf("\n");
+	}
+
+	/* lookups after the relayout, compared to before */
+	snprintf(name, sizeof(name), "%s relayout", layout_names[layout]);
+	print_speedup(result, LOOKUP_TEST, RELAYOUT_TEST, name);
+
+	/* deletes by element, compared to by key */
+	print_speedup(result, DELETE_INORDER_TEST, ELEMENT_INORDER_TEST,
+	              "delete-element in-order");
+	print_speedup(result, DELETE_RANDOM_TEST, ELEMENT_RANDOM_TEST,
+	              "delete-element random");
+
+	/* inserts with hint, compared to without */
+	print_speedup(result, INSERT_INORDER_TEST, HINT_INORDER_TEST,
+	              "hint in-order");
+	print_speedup(result, INSERT_NEAR_SORTED_TEST, HINT_NEAR_SORTED_TEST,
+	              "hint near-sorted");
+
+	/* expiry with delete_range, compared to by key */
+	print_speedup(result, WINDOW_DELETE_TEST, WINDOW_RANGE_TEST,
+	              "window delete-range");
+
+	/* flat combining and shards, compared to a mutex */
+	print_speedup(result, MUTEX_TEST, COMBINING_TEST, "combining");
+	print_speedup(result, MUTEX_TEST, COMBINING_SORTED_TEST,
+	              "combining-sorted");
+	snprintf(name, sizeof(name), "%u threads sharded (%s)", n_threads,
+	         route_names[shard_route]);
+	print_speedup(result, MUTEX_TEST, SHARDED_TEST, name);
+
+	/* walks compiled for the layout, compared to generic */
+	print_speedup(result, WALK_GENERIC_TEST, WALK_TEST, "walk");
+
+	/* nodes copied for the snapshots */
+	if (result->allocated) {
+		t = timespec_to_double(&result->elapsed_time[SNAPSHOT_TEST]);
+		printf("  snapshot allocated: %.1f bytes/change, %.1f MB/s\n",
+		       (double) result->allocated / (2 * N_OPS),
+		       result->allocated / t / (1 << 20));
+	}
+}
+
+struct test_stats {
+	double min;
+	double median;
+	double mean;
+	double stddev;
+};
+
+static int
+compare_double(const void *_a, const void *_b)
+{
+	const double *a = _a, *b = _b;
+
+	return (*a > *b) - (*a < *b);
+}
+
+/* statistics of the times of a test in the trials */
+static void
+get_stats(struct test_result *trials, int test, struct test_stats *stats)
+{
+	double times[MAX_TRIALS], sum = 0, squares = 0;
+	unsigned int i;
+
+	for (i = 0; i < n_trials; i++) {
+		times[i] = timespec_to_double(&trials[i].elapsed_time[test]);
+		sum += times[i];
+	}
+
+	qsort(times, n_trials, sizeof(*times), compare_double);
+
+	stats->min = times[0];
+	stats->mean = sum / n_trials;
+	stats->median = (n_trials & 1) ? times[n_trials / 2] :
+	                (times[n_trials / 2 - 1] + times[n_trials / 2]) / 2;
+
+	for (i = 0; i < n_trials; i++)
+		squares += (times[i] - stats->mean) * (times[i] - stats->mean);
+	stats->stddev = n_trials > 1 ? sqrt(squares / (n_trials - 1)) : 0;
+}
+
+static void
+double_to_timespec(struct timespec *t, double seconds)
+{
+	t->tv_sec = seconds;
+	t->tv_nsec = (seconds - t->tv_sec) * 1e9 + 0.5;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * run do_test() n_trials times, keeping the result of each
+ * trial in trials. The median time of each test is stored in
+ * median
+ */
+static int
+run_trials(struct tree_operations *ops, struct test_result *trials,
+           struct test_result *median, unsigned long *random_key_array)
+{
+	struct test_stats stats;
+	unsigned int trial;
+	int test;
+
+	for (trial = 0; trial < n_trials; trial++) {
+		if (do_test(ops, &trials[trial], random_key_array) == -1)
+			return -1;
+	}
+
+	median->done = trials[0].done;
+	median->allocated = trials[0].allocated;
+
+	for (test = 0; test < TEST_LAST; test++) {
+		if (!(median->done & (1 << test)))
+			continue;
+		get_stats(trials, test, &stats);
+		double_to_timespec(&median->elapsed_time[test], stats.median);
+	}
+
+	return 0;
+}
+
+/*
+ * Machine-readable results
+ * ========================
+ *
+ * JSON: a document with the machine and the run, and an object
+ * per tree with the statistics and times of each test.
+ *
+ * CSV: a row per tree, test and trial, with the machine and the
+ * run in every row (bench_compare reads it).
+ */
+
+static void
+get_machine_info(void)
+{
+	struct utsname u;
+	char line[256], *p;
+	FILE *file;
+
+	if (uname(&u) == 0)
+		snprintf(kernel, sizeof(kernel), "%.40s %.40s %.40s",
+		         u.sysname, u.release, u.machine);
+
+	file = fopen("/proc/cpuinfo", "r");
+	if (file == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, "model name", 10) != 0)
+			continue;
+
+		p = strchr(line, ':');
+		if (p) {
+			p += 1 + (p[1] == ' ');
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(cpu_model, sizeof(cpu_model), "%s", p);
+		}
+		break;
+	}
+
+	fclose(file);
+}
+
+static void
+print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* strings are quoted, with quotes doubled */
+static void
+print_csv_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+/* before the results */
+static void
+print_output_start(void)
+{
+	if (output == OUTPUT_CSV) {
+		printf("module,isa,keys,cache,placement,distribution,root_size,"
+		       "element_size,n_ops,seed,cpu,kernel,test,trial,"
+		       "seconds\n");
+		return;
+	}
+
+	if (output != OUTPUT_JSON)
+		return;
+
+	printf("{\n  \"cpu\": ");
+	print_json_string(cpu_model);
+	printf(",\n  \"kernel\": ");
+	print_json_string(kernel);
+	printf(",\n  \"keys\": \"%s\",\n", key_names[key_workload]);
+	printf("  \"cache\": \"%s\",\n", cache_names[cache_mode]);
+	printf("  \"placement\": \"%s\",\n", placement_names[placement]);
+	printf("  \"distribution\": \"%s\",\n",
+	       distribution_names[distribution]);
+	printf("  \"layout\": \"%s\",\n", layout_names[layout]);
+	printf("  \"threads\": %u,\n", n_threads);
+	printf("  \"shard_route\": \"%s\",\n", route_names[shard_route]);
+	if (cache_mode == CACHE_CORUN)
+		printf("  \"corun_size\": %zu,\n",
+		       corun_size ? corun_size : 2 * get_llc_size());
+	printf("  \"n_ops\": %d,\n", N_OPS);
+	printf("  \"seed\": %u,\n", seed);
+	printf("  \"trials\": %u,\n", n_trials);
+	printf("  \"results\": [");
+}
+
+/* after the results */
+static void
+print_output_end(void)
+{
+	if (output == OUTPUT_JSON)
+		printf("\n  ]\n}\n");
+}
+
+static void
+print_json_result(struct tree_library *lib, struct tree_info *info,
+                  struct test_result *trials)
+{
+	static int n_printed;
+	struct test_stats stats;
+	const char *separator = "";
+	unsigned int trial;
+	int test;
+
+	printf("%s\n    {\n      \"module\": ", n_printed++ ? "," : "");
+	print_json_string(lib->name);
+	printf(",\n      \"isa\": ");
+	print_json_string(lib->isa);
+	printf(",\n      \"root_size\": %u,\n", info->root_size);
+	printf("      \"element_size\": %u,\n", info->element_size);
+	if (trials[0].allocated)
+		printf("      \"snapshot_allocated\": %lu,\n",
+		       trials[0].allocated);
+	printf("      \"tests\": {");
+
+	for (test = 0; test < TEST_LAST; test++) {
+		if (!(trials[0].done & (1 << test)))
+			continue;
+
+		get_stats(trials, test, &stats);
+
+		printf("%s\n        \"%s\": {\"min\": %.9f, "
+		       "\"median\": %.9f, \"mean\": %.9f, "
+		       "\"stddev\": %.9f, \"times\": [",
+		       separator, test_names[test], stats.min,
+		       stats.median, stats.mean, stats.stddev);
+		for (trial = 0; trial < n_trials; trial++) {
+			printf("%s%.9f", trial ? ", " : "", timespec_to_double(
+			       &trials[trial].elapsed_time[test]));
+		}
+		printf("]}");
+
+		separator = ",";
+	}
+
+	printf("\n      }\n    }");
+}
+
+static void
+print_csv_result(struct tree_library *lib, struct tree_info *info,
+                 struct test_result *trials)
+{
+	unsigned int trial;
+	int test;
+
+	for (test = 0; test < TEST_LAST; test++) {
+		if (!(trials[0].done & (1 << test)))
+			continue;
+
+		for (trial = 0; trial < n_trials; trial++) {
+			print_csv_string(lib->name);
+			putchar(',');
+			print_csv_string(lib->isa);
+			printf(",%s,%s,%s,%s,%u,%u,%d,%u,",
+			       key_names[key_workload],
+			       cache_names[cache_mode],
+			       placement_names[placement],
+			       distribution_names[distribution],
+			       info->root_size,
+			       info->element_size, N_OPS, seed);
+			print_csv_string(cpu_model);
+			putchar(',');
+			print_csv_string(kernel);
+			printf(",%s,%u,%.9f\n", test_names[test], trial,
+			       timespec_to_double(
+			       &trials[trial].elapsed_time[test]));
+		}
+	}
+}
+
+/* print the results of a tree in the output format */
+static void
+output_result(struct tree_library *lib, struct test_result *trials,
+              struct test_result *median, struct test_result *base)
+{
+	struct tree_info info;
+
+	tree_info_setup(&info, &lib->ops);
+
+	switch (output) {
+	case OUTPUT_TEXT:
+		print_result(lib, median, base);
+		break;
+	case OUTPUT_JSON:
+		print_json_result(lib, &info, trials);
+		break;
+	case OUTPUT_CSV:
+		print_csv_result(lib, &info, trials);
+		break;
+	}
+}
+
+/*
+ * run the trials with the tree built without and with
+ * profile-guided optimization (see tree_interfaces/README), and
+ * show the change of the median times
+ */
+static void
+compare_pgo(struct tree_library *lib, struct test_result *trials,
+            unsigned long *random_key_array)
+{
+	struct list_head pgo_list_head = LIST_HEAD_INIT;
+	struct tree_library *before, *after;
+	struct test_result result_before, result_after;
+	double t_before, t_after;
+	int test;
+
+	before = tree_library_load_isa(lib->name, "baseline", &pgo_list_head);
+	after = tree_library_load_isa(lib->name, "pgo", &pgo_list_head);
+
+	printf("Tree %s\n", lib->name);
+
+	if (!before || !after) {
+		printf("  no %s build\n", before ? "pgo" : "baseline");
+		goto _go_unload_trees;
+	}
+
+	if (run_trials(&before->ops, trials, &result_before,
+	               random_key_array) == -1 ||
+	    run_trials(&after->ops, trials, &result_after,
+	               random_key_array) == -1) {
+		printf("  key type not supported\n");
+		goto _go_unload_trees;
+	}
+
+	if (n_trials > 1)
+		printf("  trials: %u (median time)\n", n_trials);
+
+	for (test = 0; test < TEST_LAST; test++) {
+		if (!(result_before.done & result_after.done & (1 << test)))
+			continue;
+
+		t_before = timespec_to_double(&result_before.elapsed_time[test]);
+		t_after = timespec_to_double(&result_after.elapsed_time[test]);
+
+		printf("  %s: baseline %.9f pgo %.9f (%+.2f%%)\n",
+		       test_names[test], t_before, t_after,
+		       (t_after - t_before) / t_before * 100);
+	}
+
+_go_unload_trees:
+	tree_manager_unload_trees(&pgo_list_head);
+}
+
+/*
+ * write the operations of the in-order and random tests (the
+ * keys inserted and deleted) to a binary trace (see
+ * tree_trace.h). Keys of the random test are the ones of this
+ * run
+ */
+static int
+record_trace(const char *path, unsigned long *random_key_array)
+{
+	struct tree_trace_writer w;
+	unsigned long i;
+
+	if (tree_trace_create(&w, path, TREE_KEY_ULONG) == -1)
+		return -1;
+
+	if (test_mask & (1 << INORDER_TEST)) {
+		for (i = 0; i < N_OPS; i++)
+			tree_trace_write(&w, TREE_TRACE_INSERT, i);
+		for (i = 0; i < N_OPS; i++)
+			tree_trace_write(&w, TREE_TRACE_DELETE, i);
+	}
+
+	if (test_mask & (1 << RANDOM_TEST)) {
+		for (i = 0; i < N_OPS; i++)
+			tree_trace_write(&w, TREE_TRACE_INSERT,
+			                 random_key_array[i]);
+		for (i = 0; i < N_OPS; i++)
+			tree_trace_write(&w, TREE_TRACE_DELETE,
+			                 random_key_array[i]);
+	}
+
+	return tree_trace_finish(&w);
+}
+
+/*
+ * Replay a binary trace in a tree. The trace is decoded by
+ * another thread (see tree_trace.h) and only the tree
+ * operations of each batch are timed: elements of the inserts
+ * are set up before.
+ */
+static void
+replay_trace(struct tree_library *lib, const char *path)
+{
+	struct tree_trace_reader *r;
+	struct tree_trace_batch *batch;
+	struct tree_trace_op *op;
+	struct tree_info tree_info;
+	struct tree_memory tree_memory;
+	struct timespec start_time, stop_time, diff;
+	unsigned long element[TREE_TRACE_BATCH_SIZE];
+	unsigned long n_ops[TREE_TRACE_ESCAPE] = { 0, };
+	unsigned long i, next = 0, n_skipped = 0;
+	double total = 0;
+	void *root;
+
+	tree_info_setup(&tree_info, &lib->ops);
+
+	r = tree_trace_open(path);
+	if (r == NULL) {
+		printf("couldn't open trace %s\n", path);
+		return;
+	}
+
+	/* trees of other key types are not shown */
+	if (r->header.key_type != tree_info.key.type ||
+	    tree_info.key.type != TREE_KEY_ULONG)
+		goto _go_close;
+
+	printf("Tree %s\n", lib->name);
+
+	tree_memory_allocate(&tree_memory, &tree_info, r->header.n_inserts);
+	if (tree_memory.addr == NULL) {
+		printf("  couldn't allocate %lu elements\n",
+		       r->header.n_inserts);
+		goto _go_close;
+	}
+	root = tree_memory.root;
+	lib->ops.init(root);
+
+	while ((batch = tree_trace_next(r)) != NULL) {
+		for (i = 0; i < batch->n_ops; i++) {
+			op = &batch->ops[i];
+			if (op->op != TREE_TRACE_INSERT)
+				continue;
+			/* more inserts than in the header are skipped */
+			if (next == r->header.n_inserts) {
+				op->op = TREE_TRACE_ESCAPE;
+				continue;
+			}
+			element[i] = next++;
+			tree_element_set_key(&tree_info, tree_memory.array +
+			                     element[i] * tree_info.element_size,
+			                     op->key);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		for (i = 0; i < batch->n_ops; i++) {
+			op = &batch->ops[i];
+
+			switch (op->op) {
+			case TREE_TRACE_INSERT:
+				tree_insert(&tree_memory, &tree_info,
+				            element[i]);
+				break;
+			case TREE_TRACE_DELETE:
+				lib->ops.delete(root, op->key);
+				break;
+			case TREE_TRACE_SEARCH:
+				if (lib->ops.search)
+					lib->ops.search(root, op->key);
+				break;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+
+		time_diff(&diff, &stop_time, &start_time);
+		total += diff.tv_sec + diff.tv_nsec / 1e9;
+
+		for (i = 0; i < batch->n_ops; i++) {
+			if (batch->ops[i].op < TREE_TRACE_ESCAPE)
+				n_ops[batch->ops[i].op]++;
+			if (batch->ops[i].op == TREE_TRACE_SEARCH &&
+			    !lib->ops.search)
+				n_skipped++;
+		}
+
+		tree_trace_release(r);
+	}
+
+	printf("  trace: %.9f (%lu inserts, %lu deletes, %lu searches)\n",
+	       total, n_ops[TREE_TRACE_INSERT], n_ops[TREE_TRACE_DELETE],
+	       n_ops[TREE_TRACE_SEARCH]);
+	if (total > 0)
+		printf("  throughput: %.0f ops/s\n",
+		       (n_ops[TREE_TRACE_INSERT] + n_ops[TREE_TRACE_DELETE] +
+		        n_ops[TREE_TRACE_SEARCH] - n_skipped) / total);
+	if (n_skipped)
+		printf("  %lu searches skipped (no TREE_CAP_SEARCH)\n",
+		       n_skipped);
+
+	tree_memory_free(&tree_memory);
+
+_go_close:
+	if (tree_trace_close(r) == -1)
+		printf("  trace %s is truncated or invalid\n", path);
+}
+
+/* how trees are found and loaded */
+static struct tree_load_options load_options;
+
+/*
+ * time to load (and validate) all trees, as done at the
+ * start of the programs
+ */
+static void
+load_test(void)
+{
+	struct list_head tree_list_head = LIST_HEAD_INIT;
+	struct tree_load_stats stats, sum = { 0, };
+	int i;
+
+	for (i = 0; i < N_LOADS; i++) {
+		tree_manager_load_trees_with(&tree_list_head, &load_options,
+		                             &stats);
+
+		sum.total += stats.total;
+		sum.scan += stats.scan;
+		sum.manifest += stats.manifest;
+		sum.open += stats.open;
+		sum.validate += stats.validate;
+
+		tree_manager_unload_trees(&tree_list_head);
+		tree_list_head.first = NULL;
+	}
+
+	printf("Load %u trees (%u files, %u known invalid)\n",
+	       stats.n_loaded, stats.n_files, stats.n_cached);
+	printf("  total: %.9f\n", sum.total / N_LOADS);
+	printf("  scan: %.9f\n", sum.scan / N_LOADS);
+	printf("  manifest: %.9f\n", sum.manifest / N_LOADS);
+	printf("  dlopen: %.9f\n", sum.open / N_LOADS);
+	printf("  validate: %.9f\n", sum.validate / N_LOADS);
+	if (stats.n_loaded)
+		printf("  per tree: %.9f\n",
+		       sum.total / N_LOADS / stats.n_loaded);
+}
+
+static int
+set_key_workload(const char *name)
+{
+	int keys;
+
+	for (keys = 0; keys < KEYS_LAST; keys++) {
+		if (strcmp(name, key_names[keys]) == 0) {
+			key_workload = keys;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* workload is "all" or the name of a test */
+static int
+set_workload(const char *workload)
+{
+	int test;
+
+	if (strcmp(workload, "all") == 0) {
+		test_mask = (1 << TEST_LAST) - 1;
+		return 0;
+	}
+
+	for (test = 0; test < TEST_LAST; test++) {
+		if (strcmp(workload, test_names[test]) == 0) {
+			test_mask = 1 << test;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* index of name in names, or -1 */
+static int
+find_name(const char **names, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static int
+set_cache_mode(const char *name)
+{
+	int mode;
+
+	for (mode = 0; mode < CACHE_LAST; mode++) {
+		if (strcmp(name, cache_names[mode]) == 0) {
+			cache_mode = mode;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* bytes, with an optional K, M or G suffix */
+static size_t
+parse_size(const char *s)
+{
+	char *end;
+	size_t size = strtoul(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+static int
+set_output(const char *name)
+{
+	if (strcmp(name, "text") == 0)
+		output = OUTPUT_TEXT;
+	else if (strcmp(name, "json") == 0)
+		output = OUTPUT_JSON;
+	else if (strcmp(name, "csv") == 0)
+		output = OUTPUT_CSV;
+	else
+		return -1;
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("usage: cmd [-w all|<test>] [-p] [-l]\n"
+	       "           [-P path] [-f filter] [-z] [-m manifest]\n"
+	       "           [-k ulong|string|string-shared|pair] [-b tree]\n"
+	       "           [-r trace] [-T trace]\n"
+	       "           [-n trials] [-s seed] [-o text|json|csv]\n"
+	       "           [-c warm|cold|corun] [-C size]\n"
+	       "           [-L sequential|shuffled|fragmented]\n"
+	       "           [-d dense|sparse|zipf]\n"
+	       "           [-R in-order|pre-order|bfs|veb]\n"
+	       "           [-j threads] [-S range|hash]\n"
+	       "  -w: workload (tests to run): all, in-order, random,\n"
+	       "      select, rank, lookup, relayout, delete-in-order,\n"
+	       "      delete-random, delete-element-in-order,\n"
+	       "      delete-element-random, insert-in-order,\n"
+	       "      insert-near-sorted, hint-in-order, hint-near-sorted,\n"
+	       "      window-delete, window-range, merge, union,\n"
+	       "      intersection, difference, mutex, spinlock, rwlock,\n"
+	       "      combining, combining-sorted, sharded, snapshot,\n"
+	       "      walk or walk-generic (default: in-order and\n"
+	       "      random)\n"
+	       "  -k: key workload (only trees with its key type run)\n"
+	       "  -r: record the operations in a binary trace\n"
+	       "  -T: replay a binary trace in every tree\n"
+	       "  -n: run the tests of each tree trials times (the text\n"
+	       "      shows the median time)\n"
+	       "  -s: random() seed (default: from the clock)\n"
+	       "  -o: format of the results (default: text)\n"
+	       "  -c: cache state at the start of each test (default:\n"
+	       "      warm). cold flushes the tree, corun runs a thread\n"
+	       "      writing a buffer during the tests\n"
+	       "  -L: placement of the elements in memory (default:\n"
+	       "      sequential)\n"
+	       "  -d: distribution of the ulong keys (default: dense).\n"
+	       "      zipf searches dense keys with a Zipfian popularity\n"
+	       "  -R: order of the elements in the relayout test\n"
+	       "      (default: veb)\n"
+	       "  -j: threads of the threaded tests (default: 4)\n"
+	       "  -S: routing of the keys to the shards (default: range)\n"
+	       "  -C: buffer of the co-runner, e.g. 64M (default: twice\n"
+	       "      the last level cache)\n"
+	       "  -b: show times relative to tree (e.g. pasquali_avl_tree.so)\n"
+	       "  -p: compare baseline and pgo build of each tree\n"
+	       "      (median times of the -n trials)\n"
+	       "  -l: time to load the trees\n"
+	       "  -P: directories with trees, separated by ':'\n"
+	       "      (default: $TREE_PATH or .)\n"
+	       "  -f: load only trees whose file name matches filter\n"
+	       "  -z: lazy binding of symbols (RTLD_LAZY)\n"
+	       "  -m: skip unchanged files listed in manifest\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct test_result result, base_result, *base = NULL, *trials;
+	struct tree_library *base_lib = NULL;
+	const char *base_name = NULL, *trace = NULL, *replay = NULL;
+	struct timespec time_seed;
+	struct list_head tree_list_head = LIST_HEAD_INIT;
+	struct list_node *current;
+	int opt, pgo = 0, load = 0, seeded = 0;
+	/* messages out of the results */
+	FILE *messages;
+	struct corun corun;
+
+	unsigned long random_key_array[N_OPS];
+
+	load_options.path = getenv("TREE_PATH");
+
+	while ((opt = getopt(argc, argv, "w:k:b:r:T:n:s:o:c:C:L:d:R:j:S:plP:f:zm:")) != -1) {
+		switch (opt) {
+		case 'w':
+			if (set_workload(optarg) == -1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'k':
+			if (set_key_workload(optarg) == -1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'b':
+			base_name = optarg;
+			break;
+		case 'r':
+			trace = optarg;
+			break;
+		case 'T':
+			replay = optarg;
+			break;
+		case 'n':
+			n_trials = strtoul(optarg, NULL, 0);
+			if (n_trials == 0 || n_trials > MAX_TRIALS) {
+				usage();
+				return 1;
+			}
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			seeded = 1;
+			break;
+		case 'o':
+			if (set_output(optarg) == -1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'c':
+			if (set_cache_mode(optarg) == -1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'C':
+			corun_size = parse_size(optarg);
+			if (corun_size < CACHE_LINE_SIZE) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'L':
+			opt = find_name(placement_names, TREE_PLACE_LAST,
+			                optarg);
+			if (opt == -1) {
+				usage();
+				return 1;
+			}
+			placement = opt;
+			break;
+		case 'd':
+			opt = find_name(distribution_names, DIST_LAST, optarg);
+			if (opt == -1) {
+				usage();
+				return 1;
+			}
+			distribution = opt;
+			break;
+		case 'R':
+			opt = find_name(layout_names, TREE_LAYOUT_LAST, optarg);
+			if (opt == -1) {
+				usage();
+				return 1;
+			}
+			layout = opt;
+			break;
+		case 'j':
+			n_threads = strtoul(optarg, NULL, 0);
+			if (n_threads == 0 || n_threads > MAX_THREADS) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'S':
+			opt = find_name(route_names, TREE_SHARD_ROUTE_LAST,
+			                optarg);
+			if (opt == -1) {
+				usage();
+				return 1;
+			}
+			shard_route = opt;
+			break;
+		case 'p':
+			pgo = 1;
+			break;
+		case 'l':
+			load = 1;
+			break;
+		case 'P':
+			load_options.path = optarg;
+			break;
+		case 'f':
+			load_options.filter = optarg;
+			break;
+		case 'z':
+			load_options.lazy = 1;
+			break;
+		case 'm':
+			load_options.manifest = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (load) {
+		load_test();
+		return 0;
+	}
+
+	tree_manager_load_trees_with(&tree_list_head, &load_options, NULL);
+
+	if (replay) {
+		list_for_each (current, tree_list_head.first) {
+			replay_trace(container_of(current, struct tree_library,
+			                          list_node), replay);
+			fflush(stdout);
+		}
+		goto _go_unload_trees;
+	}
+
+	/* set random() seed */
+	if (!seeded) {
+		clock_gettime(CLOCK_REALTIME, &time_seed);
+		seed = time_seed.tv_nsec % UINT_MAX;
+	}
+	srandom(seed);
+
+	prepare_random_key_array(random_key_array, N_OPS);
+	prepare_near_sorted_key_array(near_sorted_key_array, N_OPS);
+	if (distribution == DIST_SPARSE &&
+	    prepare_sparse_keys(N_OPS) == -1) {
+		fprintf(stderr, "couldn't allocate the sparse keys\n");
+		return 1;
+	}
+	prepare_lookup_key_array(random_key_array, N_OPS);
+
+	/* -p prints text */
+	if (pgo)
+		output = OUTPUT_TEXT;
+	messages = output == OUTPUT_TEXT ? stdout : stderr;
+
+	if (trace && record_trace(trace, random_key_array) == -1)
+		fprintf(messages, "couldn't write trace %s\n", trace);
+
+	if ((key_workload == STRING_KEYS ||
+	     key_workload == SHARED_STRING_KEYS) &&
+	    prepare_string_keys() == -1) {
+		fprintf(messages, "couldn't allocate string keys\n");
+		goto _go_unload_trees;
+	}
+
+	trials = malloc(n_trials * sizeof(*trials));
+	if (trials == NULL) {
+		fprintf(messages, "couldn't allocate %u trials\n", n_trials);
+		goto _go_free_keys;
+	}
+
+	if (cache_mode == CACHE_CORUN) {
+		if (corun_start(&corun) == -1) {
+			fprintf(messages, "couldn't start the co-runner\n");
+			goto _go_free_trials;
+		}
+		if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+			fprintf(messages, "the co-runner shares the only CPU "
+			        "with the tests\n");
+	}
+
+	get_machine_info();
+	print_output_start();
+
+	/* the base tree is run first */
+	if (base_name && !pgo) {
+		list_for_each (current, tree_list_head.first) {
+			base_lib = container_of(current, struct tree_library,
+			                        list_node);
+			if (strcmp(base_lib->name, base_name) == 0)
+				break;
+			base_lib = NULL;
+		}
+
+		if (base_lib == NULL) {
+			fprintf(messages, "tree %s not loaded\n", base_name);
+		} else if (run_trials(&base_lib->ops, trials, &base_result,
+		                      random_key_array) == -1) {
+			fprintf(messages, "tree %s: key type not supported\n",
+			        base_name);
+		} else {
+			output_result(base_lib, trials, &base_result, NULL);
+			base = &base_result;
+		}
+
+		fflush(stdout);
+	}
+
+	list_for_each (current, tree_list_head.first) {
+		struct tree_library *tmp;
+
+		tmp = container_of(current, struct tree_library, list_node);
+
+		/* already printed */
+		if (base && tmp == base_lib)
+			continue;
+
+		if (pgo) {
+			compare_pgo(tmp, trials, random_key_array);
+		} else if (run_trials(&tmp->ops, trials, &result,
+		                      random_key_array) == -1) {
+			/* the tree is for other key workloads */
+			continue;
+		} else {
+			output_result(tmp, trials, &result, base);
+		}
+
+		fflush(stdout);
+	}
+
+	print_output_end();
+
+	if (cache_mode == CACHE_CORUN)
+		corun_stop(&corun);
+_go_free_trials:
+	free(trials);
+
+_go_free_keys:
+	free(string_keys);
+	free(sparse_keys);
+	free(string_key_len);
 
+_go_unload_trees:
 	tree_manager_unload_trees(&tree_list_head);
 
 	return 0;
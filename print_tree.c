@@ -20,30 +20,49 @@
  * 13/01/2018
  *
  * interactive program to insert, delete and print a tree
+ *
+ * 18/10/2026: stream trees of any size as Graphviz DOT or as
+ *   a line per node (see render_tree()).
+ * 18/10/2026: replay traces of operations (see "Traces").
  */
 
 #include <alloca.h>
+#include <fcntl.h> /* open */
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h> /* malloc free */
 #include <string.h>
-#include <unistd.h> /* read */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* write getopt */
 
 #include "tree_manager.h"
+#include "tree_trace.h"
 
-#define MAX_STACK_SIZE  64
 #define PRINT_HEIGHT  8
 #define PRINT_WIDTH  80
 #define PRINT_KEY_LEN  2
 
+/* output of render_tree() is written in blocks of this size */
+#define RENDER_BUFFER_SIZE  (1 << 16)
+/* longest string written by render_printf() */
+#define RENDER_LINE_MAX  256
+/* first size of the stack of render_tree(), it grows with the depth */
+#define RENDER_STACK_SIZE  64
+
 /*
- * return the next in-order node
+ * return the next in-order node, or NULL after the last one
  *
  * it updates the stack of nodes that is used to keep
- * track of the parent ones
+ * track of the parent ones. The stack has room for max
+ * nodes: if the next node is deeper, NULL is returned
+ * with *height greater than max
  */
 static void*
-next_node(struct tree_info *t, void *node, void **stack, unsigned int *height)
+next_node(struct tree_info *t, void *node, void **stack, unsigned int *height,
+          unsigned int max)
 {
 	void *next;
 
@@ -51,13 +70,19 @@ next_node(struct tree_info *t, void *node, void **stack, unsigned int *height)
 
 		/* get the leftmost node from right */
 
-		stack[(*height)++] = node;
 		next = tree_node_get_right(t, node);
 
-		while (tree_node_get_left(t, next)) {
-			stack[(*height)++] = next;
-			next = tree_node_get_left(t, next);
-		}
+		do {
+			if (*height == max) {
+				*height = max + 1;
+				return NULL;
+			}
+			stack[(*height)++] = node;
+			node = next;
+			next = tree_node_get_left(t, node);
+		} while (next);
+
+		next = node;
 	} else {
 
 		/* get the next parent */
@@ -81,6 +106,10 @@ next_node(struct tree_info *t, void *node, void **stack, unsigned int *height)
 static inline const char*
 get_balance(struct tree_info *t, void *node)
 {
+	/* a priority or a level doesn't fit in the picture */
+	if (tree_has_capability(t, TREE_CAP_NON_AVL))
+		return "  ";
+
 	switch (t->ops->get_balance(node)) {
 	case  0: return "  ";
 	case  1: return "+ ";
@@ -146,8 +175,11 @@ print_tree(struct tree_info *t, void *root)
 	char *array = alloca(array_size);
 	char *node_string = alloca(node_string_len + /* '\0' */ 1);
 
-	/* stack of nodes is used to traverse the tree */
-	void *stack[MAX_STACK_SIZE];
+	/*
+	 * stack of nodes is used to traverse the tree, a deeper
+	 * node wouldn't fit in the picture anyway
+	 */
+	void *stack[PRINT_HEIGHT];
 
 	unsigned int current_height = 0;
 	unsigned int current_node = 0;
@@ -168,6 +200,8 @@ print_tree(struct tree_info *t, void *root)
 
 	/* go to the leftmost node (the first one) */
 	while (tree_node_get_left(t, current)) {
+		if (current_height == array_height - 1)
+			return -1;
 		stack[current_height++] = current;
 		current = tree_node_get_left(t, current);
 	}
@@ -199,10 +233,14 @@ print_tree(struct tree_info *t, void *root)
 			      (line_offset + i)] = node_string[i];
 
 		/* make current the next node */
-		current = next_node(t, current, stack, &current_height);
+		current = next_node(t, current, stack, &current_height,
+		                    array_height - 1);
 
-		if (current == NULL)
+		if (current == NULL) {
+			if (current_height > array_height - 1)
+				return -1;
 			break;
+		}
 
 		current_node++;
 	}
@@ -218,65 +256,888 @@ print_tree(struct tree_info *t, void *root)
 	return 0;
 }
 
+/*
+ * Streaming renderer
+ * ==================
+ *
+ * print_tree() needs the whole picture in memory and is limited
+ * to small trees. render_tree() writes a node at a time, in
+ * pre-order, to a buffer that is written to fd when full. The
+ * memory used is the buffer and a stack as deep as the tree.
+ *
+ * Formats:
+ *
+ * - RENDER_DOT: Graphviz DOT. Subtrees cut by the depth limit
+ *   are a "..." node.
+ * - RENDER_LINES: a line per node, "depth key balance left
+ *   right". left and right are the keys of the children or "-".
+ *   Children beyond the depth limit have no line.
+ */
+
+enum {
+	RENDER_DOT,
+	RENDER_LINES,
+};
+
+struct render {
+	int format;
+	/* levels to render, 0 for all */
+	unsigned int max_depth;
+	/* render only the subtree of the node with key */
+	int has_key;
+	unsigned long key;
+
+	int fd;
+	size_t len;
+	char buffer[RENDER_BUFFER_SIZE];
+};
+
+/* a node and its depth, in the stack of render_tree() */
+struct render_item {
+	void *node;
+	unsigned int depth;
+};
+
+static int
+render_flush(struct render *r)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < r->len) {
+		ret = write(r->fd, r->buffer + done, r->len - done);
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+
+	r->len = 0;
+
+	return 0;
+}
+
+static int
+render_printf(struct render *r, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = vsnprintf(r->buffer + r->len, RENDER_LINE_MAX, format, ap);
+	va_end(ap);
+
+	if (ret < 0)
+		return -1;
+	r->len += ret < RENDER_LINE_MAX ? ret : RENDER_LINE_MAX - 1;
+
+	if (r->len > RENDER_BUFFER_SIZE - RENDER_LINE_MAX)
+		return render_flush(r);
+
+	return 0;
+}
+
+/* buf is for the number of trees that aren't AVL (a priority...) */
+static inline const char*
+get_balance_sign(struct tree_info *t, void *node, char *buf, size_t size)
+{
+	if (tree_has_capability(t, TREE_CAP_NON_AVL)) {
+		snprintf(buf, size, "%u", t->ops->get_balance(node));
+		return buf;
+	}
+
+	switch (t->ops->get_balance(node)) {
+	case  0: return "0";
+	case  1: return "+";
+	case -1: return "-";
+	case  2: return "++";
+	case -2: return "--";
+	}
+
+	return "?"; /* error */
+}
+
+static int
+render_node(struct render *r, struct tree_info *t, void *node,
+            unsigned int depth, int cut)
+{
+	void *child[2] = {
+		tree_node_get_left(t, node),
+		tree_node_get_right(t, node),
+	};
+	unsigned long key = tree_node_get_key(t, node);
+	char child_key[2][24], balance[16];
+	int i, ret;
+
+	if (r->format == RENDER_LINES) {
+		for (i = 0; i < 2; i++) {
+			if (child[i])
+				snprintf(child_key[i], sizeof(child_key[i]),
+				         "%lu", tree_node_get_key(t, child[i]));
+			else
+				strcpy(child_key[i], "-");
+		}
+
+		return render_printf(r, "%u %lu %s %s %s\n", depth, key,
+		                     get_balance_sign(t, node, balance,
+		                                      sizeof(balance)),
+		                     child_key[0], child_key[1]);
+	}
+
+	ret = render_printf(r, "\tn%lu [label=\"%lu %s\"];\n", key, key,
+	                    get_balance_sign(t, node, balance,
+	                                     sizeof(balance)));
+
+	for (i = 0; i < 2 && ret == 0; i++) {
+		if (child[i] == NULL)
+			continue;
+
+		if (!cut) {
+			ret = render_printf(r, "\tn%lu -> n%lu;\n", key,
+			                    tree_node_get_key(t, child[i]));
+			continue;
+		}
+
+		/* the subtree of child is not rendered */
+		ret = render_printf(r, "\tc%lu_%d [label=\"...\", "
+		                    "shape=none];\n"
+		                    "\tn%lu -> c%lu_%d;\n",
+		                    key, i, key, key, i);
+	}
+
+	return ret;
+}
+
+/* node with key in the subtree of node, or NULL */
+static void*
+find_node(struct tree_info *t, void *node, unsigned long key)
+{
+	while (node) {
+		if (key < tree_node_get_key(t, node))
+			node = tree_node_get_left(t, node);
+		else if (key > tree_node_get_key(t, node))
+			node = tree_node_get_right(t, node);
+		else
+			break;
+	}
+
+	return node;
+}
+
+/*
+ * render the tree in r->fd (see the "Streaming renderer"
+ * section above). Return -1 on error or if there's no node
+ * with r->key
+ */
+static int
+render_tree(struct tree_info *t, void *root, struct render *r)
+{
+	struct render_item *stack, *tmp;
+	struct render_item item;
+	size_t stack_size = RENDER_STACK_SIZE, height = 0;
+	void *node = tree_root_get_node(t, root);
+	void *left, *right;
+	int cut, ret = 0;
+
+	if (r->has_key) {
+		node = find_node(t, node, r->key);
+		if (node == NULL)
+			return -1;
+	}
+
+	stack = malloc(stack_size * sizeof(*stack));
+	if (stack == NULL)
+		return -1;
+
+	r->len = 0;
+	if (r->format == RENDER_DOT)
+		ret = render_printf(r, "digraph tree {\n"
+		                    "\tnode [shape=circle];\n");
+
+	if (node)
+		stack[height++] = (struct render_item) {node, 0};
+
+	while (height && ret == 0) {
+		item = stack[--height];
+		cut = r->max_depth && item.depth + 1 >= r->max_depth;
+
+		ret = render_node(r, t, item.node, item.depth, cut);
+		if (cut)
+			continue;
+
+		/* there's room for the two children */
+		if (height + 2 > stack_size) {
+			tmp = realloc(stack, 2 * stack_size * sizeof(*stack));
+			if (tmp == NULL) {
+				ret = -1;
+				break;
+			}
+			stack = tmp;
+			stack_size *= 2;
+		}
+
+		/* left is rendered first */
+		right = tree_node_get_right(t, item.node);
+		left = tree_node_get_left(t, item.node);
+		if (right)
+			stack[height++] = (struct render_item)
+			                  {right, item.depth + 1};
+		if (left)
+			stack[height++] = (struct render_item)
+			                  {left, item.depth + 1};
+	}
+
+	if (r->format == RENDER_DOT && ret == 0)
+		ret = render_printf(r, "}\n");
+	if (render_flush(r) == -1)
+		ret = -1;
+
+	free(stack);
+
+	return ret;
+}
+
+/* insert keys 0 to n - 1 in random order */
+static int
+fill_tree(struct tree_memory *m, struct tree_info *t, unsigned long n)
+{
+	unsigned long i;
+
+	tree_memory_allocate(m, t, n);
+	if (m->addr == NULL)
+		return -1;
+
+	t->ops->init(m->root);
+	tree_fill_in_order(m, t, n);
+	tree_randomize(m, t, n);
+
+	for (i = 0; i < n; i++)
+		tree_insert(m, t, i);
+
+	return 0;
+}
+
+/*
+ * Traces
+ * ======
+ *
+ * A trace is a text file with an operation per line:
+ *
+ *   i <key>  insert
+ *   d <key>  delete
+ *   s <key>  search (trees with TREE_CAP_SEARCH)
+ *   p        render the tree (see -f)
+ *
+ * Empty lines and lines starting with '#' are ignored. These
+ * are also the commands of the interactive mode. Binary traces
+ * (see tree_trace.h), like the ones recorded by
+ * performance_test -r, are replayed too.
+ *
+ * The trace file is mapped and parsed at once before the
+ * replay. Each insert has its own element, with the key set
+ * before the replay, so only the tree operations are timed.
+ */
+
+enum {
+	OP_INSERT,
+	OP_DELETE,
+	OP_SEARCH,
+	OP_PRINT,
+	OP_LAST,
+};
+
+/* character of each operation in the trace */
+static const char op_chars[] = "idsp";
+
+static const char *op_names[] = {
+	[OP_INSERT] = "insert",
+	[OP_DELETE] = "delete",
+	[OP_SEARCH] = "search",
+	[OP_PRINT] = "print",
+};
+
+struct trace_op {
+	unsigned int type;
+	/* key, or the element of an insert */
+	unsigned long arg;
+};
+
+struct trace {
+	struct trace_op *ops;
+	unsigned long n_ops;
+
+	/* key of the element of each insert */
+	unsigned long *keys;
+	unsigned long n_inserts;
+};
+
+/*
+ * parse the line at s: "<op> [key]". op is 0 if the line is
+ * empty or a comment. Return the start of the next line
+ */
+static const char*
+parse_line(const char *s, const char *end, int *op, unsigned long *key)
+{
+	*op = 0;
+	*key = 0;
+
+	while (s < end && (*s == ' ' || *s == '\t'))
+		s++;
+
+	if (s < end && *s != '\n' && *s != '#') {
+		*op = *s++;
+
+		while (s < end && (*s == ' ' || *s == '\t'))
+			s++;
+		while (s < end && *s >= '0' && *s <= '9')
+			*key = *key * 10 + (*s++ - '0');
+	}
+
+	/* skip the rest of the line */
+	while (s < end && *s++ != '\n')
+		;
+
+	return s;
+}
+
+/* decode a binary trace (see tree_trace.h) */
+static int
+load_binary_trace(const char *path, const void *data, const void *end,
+                  struct tree_trace_header *header, struct trace *trace)
+{
+	const unsigned char *p = data + TREE_TRACE_HEADER_SIZE;
+	struct tree_trace_op tmp;
+	unsigned long i, last_key = 0;
+	struct trace_op *op;
+
+	if (header->key_type != TREE_KEY_ULONG) {
+		printf("%s: keys are not unsigned long\n", path);
+		return -1;
+	}
+
+	trace->ops = malloc((header->n_ops + 1) * sizeof(*trace->ops));
+	trace->keys = malloc((header->n_inserts + 1) * sizeof(*trace->keys));
+	if (!trace->ops || !trace->keys) {
+		printf("couldn't allocate %lu operations\n", header->n_ops);
+		return -1;
+	}
+
+	for (i = 0; i < header->n_ops; i++) {
+		p = tree_trace_decode(p, end, &tmp, &last_key);
+		if (p == NULL) {
+			printf("%s: operation %lu is invalid\n", path, i);
+			return -1;
+		}
+
+		op = &trace->ops[trace->n_ops++];
+		/* the codes are in the order of OP_* */
+		op->type = tmp.op;
+		op->arg = tmp.key;
+
+		if (op->type == OP_INSERT) {
+			if (trace->n_inserts == header->n_inserts) {
+				printf("%s: more inserts than in the header\n",
+				       path);
+				return -1;
+			}
+			trace->keys[trace->n_inserts] = tmp.key;
+			op->arg = trace->n_inserts++;
+		}
+	}
+
+	return 0;
+}
+
+static int
+load_trace(const char *path, struct trace *trace)
+{
+	const char *data, *s, *end;
+	struct tree_trace_header header;
+	unsigned long lines = 1, line = 0, key;
+	struct trace_op *op;
+	struct stat st;
+	const char *c;
+	int fd, ret = -1;
+	int tmp;
+
+	memset(trace, 0, sizeof(*trace));
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		printf("couldn't open %s\n", path);
+		goto _go_close;
+	}
+
+	if (st.st_size == 0) {
+		ret = 0;
+		goto _go_close;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		printf("couldn't map %s\n", path);
+		goto _go_close;
+	}
+	madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+	end = data + st.st_size;
+
+	if (tree_trace_read_header(data, st.st_size, &header) == 0) {
+		ret = load_binary_trace(path, data, end, &header, trace);
+		goto _go_unmap;
+	}
+
+	/* a line has at most one operation */
+	for (s = data; (s = memchr(s, '\n', end - s)) != NULL; s++)
+		lines++;
+
+	trace->ops = malloc(lines * sizeof(*trace->ops));
+	trace->keys = malloc(lines * sizeof(*trace->keys));
+	if (!trace->ops || !trace->keys) {
+		printf("couldn't allocate %lu operations\n", lines);
+		goto _go_unmap;
+	}
+
+	for (s = data; s < end; ) {
+		s = parse_line(s, end, &tmp, &key);
+		line++;
+
+		if (tmp == 0)
+			continue;
+
+		c = strchr(op_chars, tmp);
+		if (c == NULL) {
+			printf("%s:%lu: unknown operation '%c'\n",
+			       path, line, tmp);
+			goto _go_unmap;
+		}
+
+		op = &trace->ops[trace->n_ops++];
+		op->type = c - op_chars;
+		op->arg = key;
+
+		if (op->type == OP_INSERT) {
+			trace->keys[trace->n_inserts] = key;
+			op->arg = trace->n_inserts++;
+		}
+	}
+
+	ret = 0;
+
+_go_unmap:
+	munmap((void*) data, st.st_size);
+_go_close:
+	if (fd != -1)
+		close(fd);
+	if (ret) {
+		free(trace->ops);
+		free(trace->keys);
+	}
+
+	return ret;
+}
+
+static int
+compare_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long*) a, y = *(unsigned long*) b;
+
+	return (x > y) - (x < y);
+}
+
+/* count, total and percentiles of the time of each operation */
+static void
+print_replay_stats(struct trace *trace, unsigned long *times,
+                   unsigned long n_skipped)
+{
+	unsigned long *op_times, n, i, total;
+	unsigned int type;
+
+	op_times = malloc(trace->n_ops * sizeof(*op_times));
+	if (op_times == NULL)
+		return;
+
+	for (type = 0; type < OP_PRINT; type++) {
+		/* searches are all skipped or not */
+		if (type == OP_SEARCH && n_skipped)
+			continue;
+
+		n = 0;
+		total = 0;
+		for (i = 0; i < trace->n_ops; i++) {
+			if (trace->ops[i].type != type)
+				continue;
+			op_times[n++] = times[i];
+			total += times[i];
+		}
+
+		if (n == 0)
+			continue;
+
+		qsort(op_times, n, sizeof(*op_times), compare_ulong);
+
+		printf("  %s: %lu ops, total %.9f s, mean %lu ns, "
+		       "p50 %lu ns, p99 %lu ns, max %lu ns\n",
+		       op_names[type], n, total / 1e9, total / n,
+		       op_times[n / 2], op_times[n * 99 / 100],
+		       op_times[n - 1]);
+	}
+
+	if (n_skipped)
+		printf("  %lu searches skipped (no TREE_CAP_SEARCH)\n",
+		       n_skipped);
+
+	free(op_times);
+}
+
+static int
+replay_trace(struct tree_info *t, struct trace *trace, struct render *r)
+{
+	struct tree_memory m;
+	struct timespec start, stop;
+	struct trace_op *op;
+	unsigned long *times, i, n_skipped = 0;
+
+	tree_memory_allocate(&m, t, trace->n_inserts);
+	times = malloc((trace->n_ops + 1) * sizeof(*times));
+	if (m.addr == NULL || times == NULL) {
+		printf("couldn't allocate %lu elements\n", trace->n_inserts);
+		free(times);
+		tree_memory_free(&m);
+		return -1;
+	}
+
+	t->ops->init(m.root);
+	tree_assign_keys(&m, t, trace->keys, trace->n_inserts);
+
+	for (i = 0; i < trace->n_ops; i++) {
+		op = &trace->ops[i];
+		times[i] = 0;
+
+		if (op->type == OP_PRINT) {
+			/* a tree that isn't binary isn't rendered */
+			if (tree_has_capability(t, TREE_CAP_NON_BINARY))
+				continue;
+			fflush(stdout);
+			render_tree(t, m.root, r);
+			continue;
+		}
+		if (op->type == OP_SEARCH && t->ops->search == NULL) {
+			n_skipped++;
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		switch (op->type) {
+		case OP_INSERT:
+			tree_insert(&m, t, op->arg);
+			break;
+		case OP_DELETE:
+			t->ops->delete(m.root, op->arg);
+			break;
+		case OP_SEARCH:
+			t->ops->search(m.root, op->arg);
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		times[i] = (stop.tv_sec - start.tv_sec) * 1000000000UL +
+		           stop.tv_nsec - start.tv_nsec;
+	}
+
+	print_replay_stats(trace, times, n_skipped);
+
+	free(times);
+	tree_memory_free(&m);
+
+	return 0;
+}
+
+/*
+ * Element pool
+ *
+ * Elements inserted in the interactive mode are taken from
+ * chunks that are freed at the end.
+ */
+
+#define POOL_CHUNK_SIZE  1024
+
+struct element_pool {
+	size_t element_size;
+	void **chunks;
+	unsigned long used;
+};
+
+static void*
+pool_get(struct element_pool *p)
+{
+	unsigned long chunk = p->used / POOL_CHUNK_SIZE;
+	void **tmp;
+
+	if (p->used % POOL_CHUNK_SIZE == 0) {
+		tmp = realloc(p->chunks, (chunk + 1) * sizeof(*tmp));
+		if (tmp == NULL)
+			return NULL;
+		p->chunks = tmp;
+
+		p->chunks[chunk] = malloc(POOL_CHUNK_SIZE * p->element_size);
+		if (p->chunks[chunk] == NULL)
+			return NULL;
+	}
+
+	return p->chunks[chunk] +
+	       (p->used++ % POOL_CHUNK_SIZE) * p->element_size;
+}
+
+static void
+pool_free(struct element_pool *p)
+{
+	unsigned long chunk;
+
+	for (chunk = 0; chunk * POOL_CHUNK_SIZE < p->used; chunk++)
+		free(p->chunks[chunk]);
+	free(p->chunks);
+}
+
+/* replay the trace in each library, or in every tree if none */
+static int
+replay(const char *path, char **libraries, int n_libraries,
+       struct render *r)
+{
+	struct list_head tree_list_head = LIST_HEAD_INIT;
+	struct list_node *current;
+	struct tree_library *lib;
+	struct tree_info tree;
+	struct trace trace;
+	int i;
+
+	if (load_trace(path, &trace) == -1)
+		return -1;
+
+	if (n_libraries == 0)
+		tree_manager_load_trees(&tree_list_head);
+	for (i = 0; i < n_libraries; i++) {
+		if (tree_library_load(libraries[i], &tree_list_head) == NULL)
+			printf("couldn't load %s\n", libraries[i]);
+	}
+
+	printf("Trace %s: %lu operations\n", path, trace.n_ops);
+
+	list_for_each (current, tree_list_head.first) {
+		lib = container_of(current, struct tree_library, list_node);
+
+		tree_info_setup(&tree, &lib->ops);
+		if (tree.key.type != TREE_KEY_ULONG)
+			continue;
+
+		printf("Tree %s\n", lib->name);
+		replay_trace(&tree, &trace, r);
+		fflush(stdout);
+	}
+
+	tree_manager_unload_trees(&tree_list_head);
+	free(trace.ops);
+	free(trace.keys);
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("usage: cmd [-n count] [-f dot|lines] [-d depth] [-k key]\n"
+	       "           [-o file] <library>\n"
+	       "       cmd -t trace [-f dot|lines] [-d depth] [-k key]\n"
+	       "           [-o file] [library...]\n"
+	       "  -n: insert keys 0 to count - 1 in random order first\n"
+	       "  -f: render the tree in a format and quit\n"
+	       "  -d: render only the first depth levels\n"
+	       "  -k: render only the subtree of key\n"
+	       "  -o: render to file instead of stdout\n"
+	       "  -t: replay trace in each library (or every tree)\n");
+}
+
 int
 main(int argc, char **argv)
 {
-	struct list_head tree_list_head;
+	struct list_head tree_list_head = LIST_HEAD_INIT;
 	struct tree_library *lib;
 	struct tree_info tree;
-	char input[8];
+	struct tree_memory memory = { NULL, };
+	struct element_pool pool = { 0, };
+	struct render *render;
+	const char *output = NULL, *trace = NULL;
+	unsigned long count = 0, key;
+	int opt, interactive = 1, ret = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
 	void *root;
 	void *tmp;
 
-	if (argc < 2) {
-		printf("usage: cmd <library>\n");
+	render = calloc(1, sizeof(*render));
+	if (render == NULL)
 		return 1;
+	render->format = RENDER_LINES;
+
+	while ((opt = getopt(argc, argv, "n:f:d:k:o:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			interactive = 0;
+			if (strcmp(optarg, "dot") == 0) {
+				render->format = RENDER_DOT;
+			} else if (strcmp(optarg, "lines") == 0) {
+				render->format = RENDER_LINES;
+			} else {
+				usage();
+				return 1;
+			}
+			break;
+		case 'd':
+			render->max_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			render->has_key = 1;
+			render->key = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc && trace == NULL) {
+		usage();
+		return 1;
+	}
+
+	render->fd = 1;
+	if (output) {
+		render->fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (render->fd == -1) {
+			printf("couldn't open %s\n", output);
+			return 1;
+		}
+	}
+
+	if (trace) {
+		ret = replay(trace, argv + optind, argc - optind, render) ?
+		      1 : 0;
+		goto _go_free_render;
 	}
 
-	lib = tree_library_load(argv[1], &tree_list_head);
+	lib = tree_library_load(argv[optind], &tree_list_head);
 	if (!lib) {
 		printf("couldn't load library\n");
 		return 1;
 	}
 
 	tree_info_setup(&tree, &lib->ops);
+	if (tree.key.type != TREE_KEY_ULONG) {
+		printf("keys of the tree are not unsigned long\n");
+		return 1;
+	}
+
+	if (tree_has_capability(&tree, TREE_CAP_NON_BINARY)) {
+		printf("%s is not a binary tree\n", lib->name);
+		return 1;
+	}
+
+	if (count) {
+		if (fill_tree(&memory, &tree, count) == -1) {
+			printf("couldn't allocate %lu elements\n", count);
+			goto _go_unload_trees;
+		}
+		root = memory.root;
+	} else {
+		root = malloc(tree.root_size);
+		tree.ops->init(root);
+	}
 
-	root = malloc(tree.root_size);
+	if (!interactive) {
+		ret = render_tree(&tree, root, render) ? 1 : 0;
+		if (ret)
+			printf("error\n");
+		goto _go_free_root;
+	}
 
 	printf("insert: i<value>\n"
 	       "delete: d<value>\n"
+	       "search: s<value>\n"
 	       "print: p\n"
+	       "render (DOT): g\n"
+	       "render (lines): l\n"
 	       "quit: q or empty\n");
 
-	for (;;) {
-		if (read(1, input, sizeof(input)) <= 0)
-			break;
-		input[sizeof(input) - 1] = '\0';
+	pool.element_size = tree.element_size;
+
+	while ((len = getline(&line, &line_size, stdin)) > 0) {
+		int op;
+
+		parse_line(line, line + len, &op, &key);
 
-		switch (input[0]) {
+		switch (op) {
 		case 'i':
-			/* WARNING: we do not free memory of the elements */
-			tmp = malloc(tree.element_size);
-			tree_element_set_key(&tree, tmp, atoi(input + 1));
+			tmp = pool_get(&pool);
+			if (tmp == NULL) {
+				printf("out of memory\n");
+				break;
+			}
+			tree_element_set_key(&tree, tmp, key);
 			tree.ops->insert(root, tmp);
 			break;
 		case 'd':
-			tree.ops->delete(root, atoi(input + 1));
+			tree.ops->delete(root, key);
+			break;
+		case 's':
+			if (!tree_has_capability(&tree, TREE_CAP_SEARCH))
+				printf("search not supported\n");
+			else if (tree.ops->search(root, key))
+				printf("found\n");
+			else
+				printf("not found\n");
 			break;
 		case 'p':
 			printf("%s\n", print_tree(&tree, root)
-			       ? "error" : "success");
+			       ? "error (too large, use g or l)" : "success");
+			break;
+		case 'g':
+		case 'l':
+			render->format = op == 'g' ? RENDER_DOT : RENDER_LINES;
+			fflush(stdout);
+			if (render_tree(&tree, root, render))
+				printf("error\n");
 			break;
 		case 'q':
 		default:
 			goto _go_free_root;
 		}
+
+		fflush(stdout);
 	}
 
 _go_free_root:
-	free(root);
+	free(line);
+	pool_free(&pool);
+	if (count)
+		tree_memory_free(&memory);
+	else
+		free(root);
 _go_unload_trees:
 	tree_manager_unload_trees(&tree_list_head);
+_go_free_render:
+	if (output)
+		close(render->fd);
+	free(render);
 
-	return 0;
+	return ret;
 }
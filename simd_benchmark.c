@@ -0,0 +1,257 @@
+/*
+ * throughput of the tree kernels at each SIMD level
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * 18/10/2026
+ *
+ * It doesn't load any tree library. A layout similar to the
+ * ones of the modules is described in a 'struct tree_info' and
+ * the trees are built here, so the kernels are measured alone.
+ */
+
+#include <stddef.h> /* offsetof */
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* malloc random */
+#include <time.h> /* clock_gettime */
+
+#include "tree_manager.h"
+
+/* number of elements (keys) */
+#define N_ELEMENTS  (1 << 22)
+
+/* each kernel runs this many times and the best time is taken */
+#define N_RUNS  5
+
+/* an element like the ones of the AVL modules */
+struct element {
+	void *left;
+	void *right;
+	unsigned long balance;
+	unsigned long key;
+};
+
+enum {
+	FILL_KERNEL,
+	ASSIGN_KERNEL,
+	COPY_KERNEL,
+	COMPARE_KERNEL,
+	KERNEL_LAST,
+};
+
+static const char *kernel_names[] = {
+	[FILL_KERNEL] = "fill_in_order",
+	[ASSIGN_KERNEL] = "assign_keys",
+	[COPY_KERNEL] = "copy_keys",
+	[COMPARE_KERNEL] = "is_identical",
+};
+
+static double
+elapsed(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) +
+	       (stop->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(void*);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct element);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return 0;
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct element, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct element, right);
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return 0;
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct element, key);
+}
+
+/* only the layout: the trees are built and walked here */
+static struct tree_operations element_ops = {
+	.capabilities = 0,
+	.get_root_size = get_root_size,
+	.get_element_size = get_element_size,
+	.get_root_node_offset = get_root_node_offset,
+	.get_left_offset = get_left_offset,
+	.get_right_offset = get_right_offset,
+	.get_node_offset_in_element = get_node_offset_in_element,
+	.get_key_offset_in_element = get_key_offset_in_element,
+};
+
+static void
+setup_info(struct tree_info *info)
+{
+	tree_info_setup(info, &element_ops);
+}
+
+/*
+ * build a perfectly balanced tree where key k is at slot
+ * slot[k], so nodes of a level are scattered in memory like
+ * in a tree built with random inserts
+ */
+static struct element*
+build(struct element *array, unsigned long *slot, long lo, long hi)
+{
+	struct element *node;
+	long mid;
+
+	if (lo > hi)
+		return NULL;
+
+	mid = lo + (hi - lo) / 2;
+	node = array + slot[mid];
+	node->key = mid;
+	node->left = build(array, slot, lo, mid - 1);
+	node->right = build(array, slot, mid + 1, hi);
+
+	return node;
+}
+
+static double
+run_kernel(int kernel, struct tree_info *info, struct tree_memory *a,
+           struct tree_memory *b, unsigned long *keys)
+{
+	struct timespec start, stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	switch (kernel) {
+	case FILL_KERNEL:
+		tree_fill_in_order(a, info, N_ELEMENTS);
+		break;
+	case ASSIGN_KERNEL:
+		tree_assign_keys(a, info, keys, N_ELEMENTS);
+		break;
+	case COPY_KERNEL:
+		tree_copy_keys(b, info, a, info, N_ELEMENTS);
+		break;
+	case COMPARE_KERNEL:
+		if (tree_is_identical(info, a->root, info, b->root,
+		                      NULL) != 1)
+			printf("  error: trees differ\n");
+		break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	return elapsed(&start, &stop);
+}
+
+int
+main(void)
+{
+	struct tree_info info;
+	struct tree_memory a, b;
+	unsigned long *keys, *slot;
+	unsigned long i, j, tmp;
+	double best, t;
+	int level, kernel, run, ret = 1;
+
+	setup_info(&info);
+	tree_memory_allocate(&a, &info, N_ELEMENTS);
+	tree_memory_allocate(&b, &info, N_ELEMENTS);
+	keys = malloc(N_ELEMENTS * sizeof(*keys));
+	slot = malloc(N_ELEMENTS * sizeof(*slot));
+	if (a.addr == NULL || b.addr == NULL || keys == NULL ||
+	    slot == NULL) {
+		fprintf(stderr, "couldn't allocate %d elements\n",
+		        N_ELEMENTS);
+		goto _go_free;
+	}
+
+	/* random keys and random placement of the tree nodes */
+	for (i = 0; i < N_ELEMENTS; i++)
+		keys[i] = slot[i] = i;
+	for (i = N_ELEMENTS; i-- > 1; ) {
+		j = random() % (i + 1);
+		tmp = slot[i], slot[i] = slot[j], slot[j] = tmp;
+		j = random() % (i + 1);
+		tmp = keys[i], keys[i] = keys[j], keys[j] = tmp;
+	}
+
+	printf("%d elements of %u bytes, best of %d runs\n",
+	       N_ELEMENTS, info.element_size, N_RUNS);
+
+	for (level = 0; level < TREE_SIMD_LAST; level++) {
+		if (tree_simd_set_level(level) == -1) {
+			printf("%s: not supported by this CPU\n",
+			       tree_simd_level_name(level));
+			continue;
+		}
+
+		printf("%s\n", tree_simd_level_name(level));
+
+		for (kernel = 0; kernel < KERNEL_LAST; kernel++) {
+			/* trees are overwritten by the key kernels */
+			if (kernel == COMPARE_KERNEL) {
+				*(void**) a.root = build(a.array, slot, 0,
+				                         N_ELEMENTS - 1);
+				*(void**) b.root = build(b.array, slot, 0,
+				                         N_ELEMENTS - 1);
+			}
+
+			best = 0;
+			for (run = 0; run < N_RUNS; run++) {
+				t = run_kernel(kernel, &info, &a, &b, keys);
+				if (run == 0 || t < best)
+					best = t;
+			}
+
+			printf("  %-14s %9.3f ms %8.1f Mkeys/s\n",
+			       kernel_names[kernel], best * 1e3,
+			       N_ELEMENTS / best / 1e6);
+		}
+	}
+
+	ret = 0;
+
+_go_free:
+	free(slot);
+	free(keys);
+	tree_memory_free(&b);
+	tree_memory_free(&a);
+
+	return ret;
+}
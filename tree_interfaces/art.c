@@ -0,0 +1,707 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, no parent, radix (no balance), intrusive leaves
+ *
+ * Adaptive radix tree (ART) of unsigned long keys, as described
+ * by Leis, Kemper and Neumann. Keys are taken a byte at a time,
+ * the most significant first, so the tree is never deeper than
+ * the 8 bytes of a key. An inner node has the smallest of four
+ * sizes holding its children:
+ *
+ * - node4 and node16: sorted array of bytes and children. node16
+ *   is searched with SSE2 (a comparison of the 16 bytes at once).
+ * - node48: an index of 256 bytes into 48 children.
+ * - node256: a child for every byte.
+ *
+ * A node keeps the bytes all of its keys share (path compression)
+ * and a leaf is put where its key differs from the others (lazy
+ * expansion). Leaves are the elements, tagged in the lowest bit
+ * of the child pointer; inner nodes are allocated by the tree.
+ *
+ * It's not a binary tree (TREE_CAP_NON_BINARY): the left and
+ * right offsets mean nothing, and the tree must be searched with
+ * the search operation. Inner nodes are freed when the tree is
+ * emptied.
+ *
+ * An insert that can't allocate an inner node leaves the tree as
+ * it was, without the element, and is counted in n_failed of the
+ * root (the insert operation can't return an error).
+ *
+ * It's the tree itself, not an interface to another
+ * implementation.
+ */
+
+#include <stddef.h> /* offsetof */
+#include <stdint.h> /* uintptr_t, uint8_t */
+#include <stdlib.h> /* calloc(), free() */
+#include <string.h> /* memcpy(), memmove() */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tree_operations.h"
+
+#define KEY_BYTES  sizeof(unsigned long)
+
+enum {
+	NODE4,
+	NODE16,
+	NODE48,
+	NODE256,
+};
+
+struct art_node {
+	uint8_t type;
+	/* bytes of prefix (all the keys below have them) */
+	uint8_t prefix_len;
+	uint16_t n_children;
+	uint8_t prefix[KEY_BYTES];
+};
+
+struct node4 {
+	struct art_node n;
+	uint8_t keys[4];
+	void *children[4];
+};
+
+struct node16 {
+	struct art_node n;
+	uint8_t keys[16];
+	void *children[16];
+};
+
+/* index has the child + 1 of each byte, 0 if none */
+struct node48 {
+	struct art_node n;
+	uint8_t index[256];
+	void *children[48];
+};
+
+struct node256 {
+	struct art_node n;
+	void *children[256];
+};
+
+struct art_root {
+	void *node;
+	/* inserts that couldn't allocate a node */
+	unsigned long n_failed;
+};
+
+#define ART_ROOT  (struct art_root) {NULL, 0}
+
+struct foo {
+	unsigned long key;
+};
+
+/* a child is an inner node or a leaf (element) with bit 0 set */
+#define IS_LEAF(ptr)    ((uintptr_t) (ptr) & 1)
+#define TO_LEAF(ptr)    ((void*) ((uintptr_t) (ptr) | 1))
+#define LEAF_OF(ptr)    ((struct foo*) ((uintptr_t) (ptr) & ~1UL))
+
+/* byte of key at depth (0 is the most significant) */
+static inline uint8_t
+key_byte(unsigned long key, int depth)
+{
+	return key >> ((KEY_BYTES - 1 - depth) * 8);
+}
+
+static void*
+new_node(int type)
+{
+	static const size_t sizes[] = {
+		[NODE4] = sizeof(struct node4),
+		[NODE16] = sizeof(struct node16),
+		[NODE48] = sizeof(struct node48),
+		[NODE256] = sizeof(struct node256),
+	};
+	struct art_node *n = calloc(1, sizes[type]);
+
+	if (n)
+		n->type = type;
+
+	return n;
+}
+
+/* copy the header (prefix) of src to dst, keeping its type */
+static void
+copy_header(struct art_node *dst, struct art_node *src)
+{
+	dst->prefix_len = src->prefix_len;
+	dst->n_children = src->n_children;
+	memcpy(dst->prefix, src->prefix, src->prefix_len);
+}
+
+/*
+ * Search
+ * ======
+ */
+
+/* the link to the child of byte, or NULL */
+static void**
+find_child(struct art_node *n, uint8_t byte)
+{
+	int i;
+
+	switch (n->type) {
+	case NODE4: {
+		struct node4 *n4 = (struct node4*) n;
+
+		for (i = 0; i < n->n_children; i++) {
+			if (n4->keys[i] == byte)
+				return &n4->children[i];
+		}
+		return NULL;
+	}
+	case NODE16: {
+		struct node16 *n16 = (struct node16*) n;
+#ifdef __SSE2__
+		__m128i cmp;
+		unsigned int mask;
+
+		cmp = _mm_cmpeq_epi8(_mm_set1_epi8(byte),
+		                     _mm_loadu_si128((__m128i*) n16->keys));
+		mask = _mm_movemask_epi8(cmp) & ((1U << n->n_children) - 1);
+		if (mask)
+			return &n16->children[__builtin_ctz(mask)];
+#else
+		for (i = 0; i < n->n_children; i++) {
+			if (n16->keys[i] == byte)
+				return &n16->children[i];
+		}
+#endif
+		return NULL;
+	}
+	case NODE48: {
+		struct node48 *n48 = (struct node48*) n;
+
+		if (n48->index[byte])
+			return &n48->children[n48->index[byte] - 1];
+		return NULL;
+	}
+	case NODE256: {
+		struct node256 *n256 = (struct node256*) n;
+
+		if (n256->children[byte])
+			return &n256->children[byte];
+		return NULL;
+	}
+	}
+
+	return NULL;
+}
+
+/* number of bytes of prefix of n equal to those of key at depth */
+static int
+prefix_match(struct art_node *n, unsigned long key, int depth)
+{
+	int i;
+
+	for (i = 0; i < n->prefix_len; i++) {
+		if (n->prefix[i] != key_byte(key, depth + i))
+			break;
+	}
+
+	return i;
+}
+
+static struct foo*
+art_search(struct art_root *root, unsigned long key)
+{
+	void *node = root->node, **child;
+	struct art_node *n;
+	int depth = 0;
+
+	while (node) {
+		if (IS_LEAF(node))
+			return LEAF_OF(node)->key == key ? LEAF_OF(node) : NULL;
+
+		n = node;
+		if (prefix_match(n, key, depth) != n->prefix_len)
+			return NULL;
+		depth += n->prefix_len;
+
+		child = find_child(n, key_byte(key, depth));
+		if (child == NULL)
+			return NULL;
+		node = *child;
+		depth++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Insert
+ * ======
+ *
+ * A full node is replaced (in *ref) by one of the next size,
+ * allocated before anything is changed. If it can't be, the
+ * element isn't inserted and -1 is returned.
+ */
+
+static int add_child(void **ref, struct art_node *n, uint8_t byte,
+                     void *child);
+
+static int
+add_child4(void **ref, struct node4 *n4, uint8_t byte, void *child)
+{
+	struct node16 *n16;
+	int i;
+
+	if (n4->n.n_children < 4) {
+		for (i = 0; i < n4->n.n_children && n4->keys[i] < byte; i++)
+			;
+		memmove(n4->keys + i + 1, n4->keys + i,
+		        n4->n.n_children - i);
+		memmove(n4->children + i + 1, n4->children + i,
+		        (n4->n.n_children - i) * sizeof(void*));
+		n4->keys[i] = byte;
+		n4->children[i] = child;
+		n4->n.n_children++;
+		return 0;
+	}
+
+	n16 = new_node(NODE16);
+	if (n16 == NULL)
+		return -1;
+	copy_header(&n16->n, &n4->n);
+	memcpy(n16->keys, n4->keys, 4);
+	memcpy(n16->children, n4->children, 4 * sizeof(void*));
+	*ref = n16;
+	free(n4);
+
+	return add_child(ref, &n16->n, byte, child);
+}
+
+static int
+add_child16(void **ref, struct node16 *n16, uint8_t byte, void *child)
+{
+	struct node48 *n48;
+	int i;
+
+	if (n16->n.n_children < 16) {
+		for (i = 0; i < n16->n.n_children && n16->keys[i] < byte; i++)
+			;
+		memmove(n16->keys + i + 1, n16->keys + i,
+		        n16->n.n_children - i);
+		memmove(n16->children + i + 1, n16->children + i,
+		        (n16->n.n_children - i) * sizeof(void*));
+		n16->keys[i] = byte;
+		n16->children[i] = child;
+		n16->n.n_children++;
+		return 0;
+	}
+
+	n48 = new_node(NODE48);
+	if (n48 == NULL)
+		return -1;
+	copy_header(&n48->n, &n16->n);
+	for (i = 0; i < 16; i++) {
+		n48->index[n16->keys[i]] = i + 1;
+		n48->children[i] = n16->children[i];
+	}
+	*ref = n48;
+	free(n16);
+
+	return add_child(ref, &n48->n, byte, child);
+}
+
+static int
+add_child48(void **ref, struct node48 *n48, uint8_t byte, void *child)
+{
+	struct node256 *n256;
+	int i;
+
+	if (n48->n.n_children < 48) {
+		/* children removed leave holes */
+		for (i = 0; n48->children[i]; i++)
+			;
+		n48->children[i] = child;
+		n48->index[byte] = i + 1;
+		n48->n.n_children++;
+		return 0;
+	}
+
+	n256 = new_node(NODE256);
+	if (n256 == NULL)
+		return -1;
+	copy_header(&n256->n, &n48->n);
+	for (i = 0; i < 256; i++) {
+		if (n48->index[i])
+			n256->children[i] = n48->children[n48->index[i] - 1];
+	}
+	*ref = n256;
+	free(n48);
+
+	return add_child(ref, &n256->n, byte, child);
+}
+
+static int
+add_child(void **ref, struct art_node *n, uint8_t byte, void *child)
+{
+	switch (n->type) {
+	case NODE4:
+		return add_child4(ref, (struct node4*) n, byte, child);
+	case NODE16:
+		return add_child16(ref, (struct node16*) n, byte, child);
+	case NODE48:
+		return add_child48(ref, (struct node48*) n, byte, child);
+	case NODE256:
+		((struct node256*) n)->children[byte] = child;
+		n->n_children++;
+		break;
+	}
+
+	return 0;
+}
+
+static int
+art_insert(struct art_root *root, struct foo *new)
+{
+	void **ref = &root->node, **child;
+	unsigned long key = new->key, other;
+	struct art_node *n;
+	struct node4 *n4;
+	int depth = 0, i;
+
+	while (*ref) {
+		if (IS_LEAF(*ref)) {
+			/* a node4 with the leaf and the new one */
+			other = LEAF_OF(*ref)->key;
+			if (other == key)
+				return -1;
+
+			n4 = new_node(NODE4);
+			if (n4 == NULL)
+				goto _go_failed;
+			for (i = depth; key_byte(key, i) == key_byte(other, i);
+			     i++)
+				n4->n.prefix[i - depth] = key_byte(key, i);
+			n4->n.prefix_len = i - depth;
+
+			add_child4(NULL, n4, key_byte(other, i), *ref);
+			add_child4(NULL, n4, key_byte(key, i), TO_LEAF(new));
+			*ref = n4;
+			return 0;
+		}
+
+		n = *ref;
+		i = prefix_match(n, key, depth);
+		if (i != n->prefix_len) {
+			/* a node4 with the shared prefix above n */
+			n4 = new_node(NODE4);
+			if (n4 == NULL)
+				goto _go_failed;
+			memcpy(n4->n.prefix, n->prefix, i);
+			n4->n.prefix_len = i;
+
+			add_child4(NULL, n4, n->prefix[i], n);
+			add_child4(NULL, n4, key_byte(key, depth + i),
+			           TO_LEAF(new));
+
+			n->prefix_len -= i + 1;
+			memmove(n->prefix, n->prefix + i + 1, n->prefix_len);
+			*ref = n4;
+			return 0;
+		}
+		depth += n->prefix_len;
+
+		child = find_child(n, key_byte(key, depth));
+		if (child == NULL) {
+			if (add_child(ref, n, key_byte(key, depth),
+			              TO_LEAF(new)) == -1)
+				goto _go_failed;
+			return 0;
+		}
+		ref = child;
+		depth++;
+	}
+
+	*ref = TO_LEAF(new);
+
+	return 0;
+
+_go_failed:
+	root->n_failed++;
+	return -1;
+}
+
+/*
+ * Delete
+ * ======
+ *
+ * A node with few children is replaced by one of the previous
+ * size (with some slack so it doesn't happen back and forth). A
+ * node4 with a single child is replaced by the child, which takes
+ * its prefix.
+ */
+
+static void
+remove_child4(void **ref, struct node4 *n4, void **child)
+{
+	struct art_node *only;
+	int i = child - n4->children;
+
+	memmove(n4->keys + i, n4->keys + i + 1, n4->n.n_children - i - 1);
+	memmove(n4->children + i, n4->children + i + 1,
+	        (n4->n.n_children - i - 1) * sizeof(void*));
+	n4->n.n_children--;
+
+	if (n4->n.n_children > 1)
+		return;
+
+	only = n4->children[0];
+	if (!IS_LEAF(only)) {
+		/* prefix of n4, the byte of the child, its prefix */
+		memmove(only->prefix + n4->n.prefix_len + 1, only->prefix,
+		        only->prefix_len);
+		memcpy(only->prefix, n4->n.prefix, n4->n.prefix_len);
+		only->prefix[n4->n.prefix_len] = n4->keys[0];
+		only->prefix_len += n4->n.prefix_len + 1;
+	}
+	*ref = only;
+	free(n4);
+}
+
+static void
+remove_child16(void **ref, struct node16 *n16, void **child)
+{
+	struct node4 *n4;
+	int i = child - n16->children;
+
+	memmove(n16->keys + i, n16->keys + i + 1, n16->n.n_children - i - 1);
+	memmove(n16->children + i, n16->children + i + 1,
+	        (n16->n.n_children - i - 1) * sizeof(void*));
+	n16->n.n_children--;
+
+	if (n16->n.n_children > 3)
+		return;
+
+	n4 = new_node(NODE4);
+	if (n4 == NULL)
+		return;
+	copy_header(&n4->n, &n16->n);
+	memcpy(n4->keys, n16->keys, 3);
+	memcpy(n4->children, n16->children, 3 * sizeof(void*));
+	*ref = n4;
+	free(n16);
+}
+
+static void
+remove_child48(void **ref, struct node48 *n48, uint8_t byte)
+{
+	struct node16 *n16;
+	int i, j;
+
+	n48->children[n48->index[byte] - 1] = NULL;
+	n48->index[byte] = 0;
+	n48->n.n_children--;
+
+	if (n48->n.n_children > 12)
+		return;
+
+	n16 = new_node(NODE16);
+	if (n16 == NULL)
+		return;
+	copy_header(&n16->n, &n48->n);
+	for (i = 0, j = 0; i < 256; i++) {
+		if (n48->index[i]) {
+			n16->keys[j] = i;
+			n16->children[j++] = n48->children[n48->index[i] - 1];
+		}
+	}
+	*ref = n16;
+	free(n48);
+}
+
+static void
+remove_child256(void **ref, struct node256 *n256, uint8_t byte)
+{
+	struct node48 *n48;
+	int i, j;
+
+	n256->children[byte] = NULL;
+	n256->n.n_children--;
+
+	if (n256->n.n_children > 37)
+		return;
+
+	n48 = new_node(NODE48);
+	if (n48 == NULL)
+		return;
+	copy_header(&n48->n, &n256->n);
+	for (i = 0, j = 0; i < 256; i++) {
+		if (n256->children[i]) {
+			n48->children[j] = n256->children[i];
+			n48->index[i] = ++j;
+		}
+	}
+	*ref = n48;
+	free(n256);
+}
+
+static void
+remove_child(void **ref, struct art_node *n, uint8_t byte, void **child)
+{
+	switch (n->type) {
+	case NODE4:
+		remove_child4(ref, (struct node4*) n, child);
+		break;
+	case NODE16:
+		remove_child16(ref, (struct node16*) n, child);
+		break;
+	case NODE48:
+		remove_child48(ref, (struct node48*) n, byte);
+		break;
+	case NODE256:
+		remove_child256(ref, (struct node256*) n, byte);
+		break;
+	}
+}
+
+static int
+art_delete(struct art_root *root, unsigned long key)
+{
+	void **ref = &root->node, **child;
+	struct art_node *n;
+	int depth = 0;
+
+	if (*ref == NULL)
+		return -1;
+
+	if (IS_LEAF(*ref)) {
+		if (LEAF_OF(*ref)->key != key)
+			return -1;
+		*ref = NULL;
+		return 0;
+	}
+
+	for (;;) {
+		n = *ref;
+		if (prefix_match(n, key, depth) != n->prefix_len)
+			return -1;
+		depth += n->prefix_len;
+
+		child = find_child(n, key_byte(key, depth));
+		if (child == NULL)
+			return -1;
+
+		if (IS_LEAF(*child)) {
+			if (LEAF_OF(*child)->key != key)
+				return -1;
+			remove_child(ref, n, key_byte(key, depth), child);
+			return 0;
+		}
+
+		ref = child;
+		depth++;
+	}
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct art_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct art_root, node);
+}
+
+/* there are no left and right children (TREE_CAP_NON_BINARY) */
+
+static size_t
+get_left_offset(void)
+{
+	return 0;
+}
+
+static size_t
+get_right_offset(void)
+{
+	return 0;
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return 0;
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+static unsigned int
+get_balance(void *node)
+{
+	(void) node;
+
+	return 0;
+}
+
+static void
+insert(void *root, void *pos)
+{
+	art_insert(root, pos);
+}
+
+static void
+delete(void *root, unsigned long key)
+{
+	art_delete(root, key);
+}
+
+static void*
+search(void *root, unsigned long key)
+{
+	return art_search(root, key);
+}
+
+static void
+init(void *_root)
+{
+	struct art_root *root = _root;
+
+	*root = ART_ROOT;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		/*
+		 * an insert failing to allocate a node drops the
+		 * element (see n_failed in struct art_root)
+		 */
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_NON_BINARY,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = search,
+	},
+};
@@ -0,0 +1,471 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, no parent, store height, not intrusive
+ *
+ * Persistent AVL tree (path copying). A snapshot is a reference
+ * to the root node, taken in O(1). A change copies the nodes on
+ * its path that are shared with a snapshot (or with a previous
+ * version in use) and changes the copies, so the nodes of a
+ * snapshot never rotate under its readers. Nodes used only by
+ * the tree are changed in place: without snapshots, nothing is
+ * copied. Each node counts the nodes and roots pointing to it
+ * and is freed when none do.
+ *
+ * Nodes are allocated by the tree and point to the elements, as
+ * an element can be in many versions, with different children.
+ * The key is copied to the node, at the offset it has in the
+ * element, so to the tree manager a node is an element with its
+ * key: it can be walked, but tree_search() returns the node.
+ *
+ * The tree is changed by a single writer, which also takes the
+ * snapshots. Readers of snapshots run in other threads and
+ * release them from there (the reference counts are atomic).
+ *
+ * It's the tree itself, not an interface to another
+ * implementation.
+ */
+
+#include <stddef.h> /* offsetof */
+#include <stdlib.h> /* malloc free */
+
+#include "tree_operations.h"
+
+/* enough for the height of an AVL tree of 2^64 nodes */
+#define MAX_HEIGHT  96
+
+struct cow_node {
+	/* at the offset of key in struct foo */
+	unsigned long key;
+	struct cow_node *left;
+	struct cow_node *right;
+	void *element;
+	/* nodes and roots pointing to the node */
+	unsigned int refcount;
+	int height;
+};
+
+struct cow_root {
+	struct cow_node *node;
+	/* changes since init */
+	unsigned long version;
+	/* bytes of the nodes allocated by the changes */
+	unsigned long allocated;
+};
+
+#define COW_ROOT  (struct cow_root) {NULL, 0, 0}
+
+struct foo {
+	unsigned long key;
+};
+
+static inline int
+node_height(struct cow_node *node)
+{
+	return node ? node->height : 0;
+}
+
+static inline void
+update_height(struct cow_node *node)
+{
+	int left = node_height(node->left);
+	int right = node_height(node->right);
+
+	node->height = 1 + (left > right ? left : right);
+}
+
+static inline int
+node_balance(struct cow_node *node)
+{
+	return node_height(node->right) - node_height(node->left);
+}
+
+static inline void
+node_get(struct cow_node *node)
+{
+	if (node)
+		__atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* drop a reference to node, freeing the nodes no longer used */
+static void
+node_put(struct cow_node *node)
+{
+	struct cow_node *stack[2 * MAX_HEIGHT];
+	unsigned int n = 0;
+
+	if (node)
+		stack[n++] = node;
+
+	while (n) {
+		node = stack[--n];
+		if (__atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL))
+			continue;
+
+		if (node->left)
+			stack[n++] = node->left;
+		if (node->right)
+			stack[n++] = node->right;
+		free(node);
+	}
+}
+
+/*
+ * return the node at *link, copied to *link if it's shared with
+ * another version. The node with link (or the root) is only in
+ * the tree, so a node with a single reference is too. Return
+ * NULL if out of memory
+ */
+static struct cow_node*
+own(struct cow_root *root, struct cow_node **link)
+{
+	struct cow_node *node = *link, *copy;
+
+	if (__atomic_load_n(&node->refcount, __ATOMIC_ACQUIRE) == 1)
+		return node;
+
+	copy = malloc(sizeof(*copy));
+	if (copy == NULL)
+		return NULL;
+	root->allocated += sizeof(*copy);
+
+	*copy = *node;
+	copy->refcount = 1;
+	node_get(copy->left);
+	node_get(copy->right);
+
+	/* still used by the other versions */
+	node_put(node);
+	*link = copy;
+
+	return copy;
+}
+
+/*
+ * rotations of the node at *link, which is in the tree only.
+ * Return -1 if out of memory (the tree is as it was)
+ */
+
+static int
+rotate_right(struct cow_root *root, struct cow_node **link)
+{
+	struct cow_node *node = *link, *left;
+
+	left = own(root, &node->left);
+	if (left == NULL)
+		return -1;
+
+	node->left = left->right;
+	left->right = node;
+	*link = left;
+
+	update_height(node);
+	update_height(left);
+
+	return 0;
+}
+
+static int
+rotate_left(struct cow_root *root, struct cow_node **link)
+{
+	struct cow_node *node = *link, *right;
+
+	right = own(root, &node->right);
+	if (right == NULL)
+		return -1;
+
+	node->right = right->left;
+	right->left = node;
+	*link = right;
+
+	update_height(node);
+	update_height(right);
+
+	return 0;
+}
+
+static int
+balance(struct cow_root *root, struct cow_node **link)
+{
+	struct cow_node *node = *link;
+	int b = node_balance(node);
+
+	if (b < -1) {
+		if (node_balance(node->left) > 0 &&
+		    (own(root, &node->left) == NULL ||
+		     rotate_left(root, &node->left) == -1))
+			return -1;
+		return rotate_right(root, link);
+	}
+
+	if (b > 1) {
+		if (node_balance(node->right) < 0 &&
+		    (own(root, &node->right) == NULL ||
+		     rotate_right(root, &node->right) == -1))
+			return -1;
+		return rotate_left(root, link);
+	}
+
+	update_height(node);
+
+	return 0;
+}
+
+/*
+ * rebalance the nodes of path (links, from the root) bottom-up,
+ * until the height of a subtree doesn't change. Out of memory
+ * leaves the tree unbalanced, but in order
+ */
+static void
+rebalance(struct cow_root *root, struct cow_node ***path, int n)
+{
+	int height;
+
+	while (n--) {
+		height = (*path[n])->height;
+		if (balance(root, path[n]) == -1)
+			return;
+		if ((*path[n])->height == height)
+			return;
+	}
+}
+
+static struct cow_node*
+cow_search(struct cow_node *node, unsigned long key)
+{
+	while (node) {
+		if (key == node->key)
+			return node;
+		node = key < node->key ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+static int
+cow_insert(struct cow_root *root, struct foo *element)
+{
+	struct cow_node **path[MAX_HEIGHT], **link = &root->node;
+	struct cow_node *node;
+	unsigned long key = element->key;
+	int n = 0;
+
+	/* nothing is copied for a key in the tree */
+	if (cow_search(root->node, key))
+		return -1;
+
+	while (*link) {
+		node = own(root, link);
+		if (node == NULL)
+			return -1;
+		path[n++] = link;
+		link = key < node->key ? &node->left : &node->right;
+	}
+
+	node = malloc(sizeof(*node));
+	if (node == NULL)
+		return -1;
+	root->allocated += sizeof(*node);
+
+	*node = (struct cow_node) {key, NULL, NULL, element, 1, 1};
+	*link = node;
+	root->version++;
+
+	rebalance(root, path, n);
+
+	return 0;
+}
+
+static int
+cow_delete(struct cow_root *root, unsigned long key)
+{
+	struct cow_node **path[MAX_HEIGHT], **link = &root->node;
+	struct cow_node *node, *next;
+	int n = 0, found;
+
+	if (cow_search(root->node, key) == NULL)
+		return -1;
+
+	for (;;) {
+		node = own(root, link);
+		if (node == NULL)
+			return -1;
+		path[n++] = link;
+		if (key == node->key)
+			break;
+		link = key < node->key ? &node->left : &node->right;
+	}
+
+	/* the node is replaced by the next one (in-order) */
+	if (node->left && node->right) {
+		found = n - 1;
+
+		link = &node->right;
+		for (;;) {
+			next = own(root, link);
+			if (next == NULL)
+				return -1;
+			path[n++] = link;
+			if (next->left == NULL)
+				break;
+			link = &next->left;
+		}
+
+		/* unlink next, it takes the place of node */
+		*link = next->right;
+		n--;
+		next->left = node->left;
+		next->right = node->right;
+		next->height = node->height;
+		*path[found] = next;
+		if (n > found + 1)
+			path[found + 1] = &next->right;
+	} else {
+		*link = node->left ? node->left : node->right;
+		n--;
+	}
+
+	/* only in the tree, and its children are moved */
+	free(node);
+	root->version++;
+
+	rebalance(root, path, n);
+
+	return 0;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct cow_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct cow_root, node);
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct cow_node, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct cow_node, right);
+}
+
+/* the key of a node is where it's in the element */
+static size_t
+get_node_offset_in_element(void)
+{
+	return offsetof(struct cow_node, key) - offsetof(struct foo, key);
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+static unsigned int
+get_balance(void *node)
+{
+	return node_balance(node);
+}
+
+static void
+insert(void *root, void *pos)
+{
+	cow_insert(root, pos);
+}
+
+static void
+delete(void *root, unsigned long key)
+{
+	cow_delete(root, key);
+}
+
+static void*
+search(void *_root, unsigned long key)
+{
+	struct cow_root *root = _root;
+	struct cow_node *node = cow_search(root->node, key);
+
+	return node ? node->element : NULL;
+}
+
+static unsigned long
+snapshot(void *_snapshot, void *_root)
+{
+	struct cow_root *snapshot = _snapshot, *root = _root;
+
+	node_get(root->node);
+	snapshot->node = root->node;
+	snapshot->version = root->version;
+	snapshot->allocated = 0;
+
+	return root->version;
+}
+
+static void
+release(void *_snapshot)
+{
+	struct cow_root *snapshot = _snapshot;
+
+	node_put(snapshot->node);
+	snapshot->node = NULL;
+}
+
+static unsigned long
+get_allocated(void *_root)
+{
+	struct cow_root *root = _root;
+
+	return root->allocated;
+}
+
+static void
+init(void *_root)
+{
+	struct cow_root *root = _root;
+
+	*root = COW_ROOT;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_SNAPSHOT,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = search,
+
+		.snapshot = snapshot,
+		.release = release,
+		.get_allocated = get_allocated,
+	},
+};
@@ -11,7 +11,7 @@
 
 #include "avl_tree.h"
 
-const char *magic_string = "binary_tree_module";
+#include "tree_operations.h"
 
 #ifndef container_of
 #define container_of(ptr, type, member) ({                      \
@@ -65,6 +65,8 @@ search(struct avl_tree_link *link, struct avl_tree_root *root,
 /*
  * TODO: the use of link in deletion might have some performance
  * penalty. It was done this way to allow reusing search()
+ *
+ * delete_element() doesn't search, when the element is known
  */
 static int
 avl_delete(struct avl_tree_root *root, unsigned long key)
@@ -94,55 +96,134 @@ avl_insert(struct avl_tree_root *root, struct foo *new)
 	return 0;
 }
 
-size_t
+/*
+ * Finger search: keys of the subtree of hint are between the
+ * keys of its nearest ancestors of which it's in the right and
+ * the left subtree. While key is out of that range, hint becomes
+ * that ancestor. The new element is then inserted below hint, so
+ * a key close to hint doesn't search from the root
+ */
+static int
+avl_insert_hint(struct avl_tree_root *root, struct foo *new,
+                struct foo *hint)
+{
+	struct avl_tree_node *node, *parent, **child;
+	unsigned long key = new->key;
+	struct foo *tmp;
+
+	if (hint == NULL || root->avl_tree_node == NULL)
+		return avl_insert(root, new);
+
+	node = &hint->node;
+
+	for (;;) {
+		if (key == hint->key)
+			return -1;
+
+		/* the ancestor with the bound on the side of key */
+		parent = avl_get_parent(node);
+		if (key > hint->key) {
+			while (parent && node == parent->right) {
+				node = parent;
+				parent = avl_get_parent(node);
+			}
+		} else {
+			while (parent && node == parent->left) {
+				node = parent;
+				parent = avl_get_parent(node);
+			}
+		}
+
+		if (parent == NULL)
+			break;
+
+		tmp = container_of(parent, struct foo, node);
+		if (key > hint->key ? key < tmp->key : key > tmp->key)
+			break;
+
+		hint = tmp;
+		node = parent;
+	}
+
+	/* search below hint */
+	node = &hint->node;
+	for (;;) {
+		tmp = container_of(node, struct foo, node);
+		if (key == tmp->key)
+			return -1;
+
+		child = key < tmp->key ? &node->left : &node->right;
+		if (*child == NULL)
+			break;
+		node = *child;
+	}
+
+	*child = &new->node;
+	new->node.parent_balance = (uintptr_t)node | 1;
+	avl_tree_rebalance_after_insert(&root->avl_tree_node, &new->node);
+
+	return 0;
+}
+
+static size_t
 get_root_size(void)
 {
 	return sizeof(struct avl_tree_root);
 }
 
-size_t
+static size_t
 get_element_size(void)
 {
 	return sizeof(struct foo);
 }
 
-size_t
+static size_t
 get_root_node_offset(void)
 {
 	return offsetof(struct avl_tree_root, avl_tree_node);
 }
 
-size_t
+static size_t
 get_left_offset(void)
 {
 	return offsetof(struct avl_tree_node, left);
 }
 
-size_t
+static size_t
 get_right_offset(void)
 {
 	return offsetof(struct avl_tree_node, right);
 }
 
-size_t
+static size_t
 get_node_offset_in_element(void)
 {
 	return offsetof(struct foo, node);
 }
 
-size_t
+static size_t
 get_key_offset_in_element(void)
 {
 	return offsetof(struct foo, key);
 }
 
-unsigned int
+static unsigned int
 get_balance(void *node)
 {
 	return (((struct avl_tree_node*) node)->parent_balance & 3) - 1;
 }
 
-void
+/* the node was moved (tree_relayout()), the balance is kept */
+static void
+set_parent(void *_node, void *parent)
+{
+	struct avl_tree_node *node = _node;
+
+	node->parent_balance = (uintptr_t) parent |
+	                       (node->parent_balance & 3);
+}
+
+static void
 insert(void *root, void *pos)
 {
 	struct foo *new = pos;
@@ -150,16 +231,69 @@ insert(void *root, void *pos)
 	avl_insert(root, new);
 }
 
-void
+static void
+insert_hint(void *root, void *pos, void *hint)
+{
+	avl_insert_hint(root, pos, hint);
+}
+
+static void
 delete(void *root, unsigned long key)
 {
 	avl_delete(root, key);
 }
 
-void
+/* the element is in the tree, its node is unlinked with the parent */
+static void
+delete_element(void *_root, void *element)
+{
+	struct avl_tree_root *root = _root;
+	struct foo *e = element;
+
+	avl_tree_remove(&root->avl_tree_node, &e->node);
+}
+
+static void*
+lookup(void *root, unsigned long key)
+{
+	struct avl_tree_link link;
+
+	return search(&link, root, key);
+}
+
+static void
 init(void *_root)
 {
 	struct avl_tree_root *root = _root;
 
 	*root = AVL_ROOT;
 }
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_RELAYOUT |
+		                TREE_CAP_DELETE_ELEMENT | TREE_CAP_INSERT_HINT,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = lookup,
+
+		.set_parent = set_parent,
+		.delete_element = delete_element,
+		.insert_hint = insert_hint,
+	},
+};
@@ -0,0 +1,285 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, has parent, uses balance factor, intrusive
+ *
+ * Interface to Eric Biggers' AVL tree implementation (see
+ * README) with keys other than unsigned long. It's built as:
+ *
+ * - variable-length keys with an 8-byte prefix in the element
+ * - variable-length keys without prefix (-DKEY_PREFIX_LEN=0)
+ * - (tenant, timestamp) keys (-DKEY_PAIR)
+ */
+
+#include <stddef.h> /* offsetof */
+#include <string.h> /* memcmp */
+
+#include "avl_tree.h"
+
+#include "tree_operations.h"
+
+#ifndef container_of
+#define container_of(ptr, type, member) ({                      \
+        const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+#endif
+
+#ifdef KEY_PAIR
+#undef KEY_PREFIX_LEN
+#define KEY_PREFIX_LEN  0
+#elif !defined(KEY_PREFIX_LEN)
+#define KEY_PREFIX_LEN  8
+#endif
+
+struct avl_tree_root {
+	struct avl_tree_node *avl_tree_node;
+};
+
+#define AVL_ROOT  (struct avl_tree_root) {NULL, }
+
+struct avl_tree_link {
+	struct avl_tree_node *parent;
+	struct avl_tree_node **node;
+};
+
+struct foo {
+	struct avl_tree_node node;
+#ifdef KEY_PAIR
+	/* two big-endian 64-bit integers */
+	unsigned char key[16];
+#else
+	struct tree_var_key key;
+#endif
+};
+
+#ifdef KEY_PAIR
+
+/* memcmp() of big-endian integers is the order of the tuple */
+static int
+compare(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(((struct foo*) 0)->key));
+}
+
+#else
+
+static int
+compare(const void *_a, const void *_b)
+{
+	const struct tree_var_key *a = _a, *b = _b;
+	size_t len = a->len < b->len ? a->len : b->len;
+	int ret;
+
+#if KEY_PREFIX_LEN
+	/* most comparisons end here, without reading data */
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+#endif
+
+	ret = memcmp(a->data, b->data, len);
+	if (ret)
+		return ret;
+
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+#endif /* KEY_PAIR */
+
+#define tree_search_for_each(l, current) \
+	for ((l)->parent = NULL, (l)->node = current; \
+	     *current; \
+	     (l)->parent = *(l)->node, (l)->node = current)
+
+static struct foo*
+search(struct avl_tree_link *link, struct avl_tree_root *root,
+       const void *key)
+{
+	struct avl_tree_node **current = &root->avl_tree_node;
+	int ret;
+
+	tree_search_for_each (link, current) {
+		struct foo *tmp;
+
+		tmp = container_of(*current, struct foo, node);
+
+		ret = compare(key, &tmp->key);
+		if (ret < 0)
+			current = &(*current)->left;
+		else if (ret > 0)
+			current = &(*current)->right;
+		else
+			return tmp;
+	}
+
+	return NULL;
+}
+
+static int
+avl_delete(struct avl_tree_root *root, const void *key)
+{
+	struct avl_tree_link link;
+
+	if (search(&link, root, key) == NULL)
+		return -1;
+
+	avl_tree_remove(&root->avl_tree_node, *link.node);
+
+	return 0;
+}
+
+static int
+avl_insert(struct avl_tree_root *root, struct foo *new)
+{
+	struct avl_tree_link link;
+
+	if (search(&link, root, &new->key) != NULL)
+		return -1;
+
+	*link.node = &new->node;
+	(*link.node)->parent_balance = (uintptr_t)link.parent | 1;
+	avl_tree_rebalance_after_insert(&root->avl_tree_node, *link.node);
+
+	return 0;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct avl_tree_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct avl_tree_root, avl_tree_node);
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct avl_tree_node, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct avl_tree_node, right);
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return offsetof(struct foo, node);
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+static unsigned int
+get_balance(void *node)
+{
+	return (((struct avl_tree_node*) node)->parent_balance & 3) - 1;
+}
+
+/* the node was moved (tree_relayout()), the balance is kept */
+static void
+set_parent(void *_node, void *parent)
+{
+	struct avl_tree_node *node = _node;
+
+	node->parent_balance = (uintptr_t) parent |
+	                       (node->parent_balance & 3);
+}
+
+static void
+get_key_info(struct tree_key_info *key)
+{
+#ifdef KEY_PAIR
+	key->type = TREE_KEY_BYTES;
+#else
+	key->type = TREE_KEY_VAR;
+#endif
+	key->size = sizeof(((struct foo*) 0)->key);
+	key->prefix_len = KEY_PREFIX_LEN;
+	key->compare = compare;
+}
+
+static void
+insert(void *root, void *pos)
+{
+	struct foo *new = pos;
+
+	avl_insert(root, new);
+}
+
+static void
+delete_key(void *root, const void *key)
+{
+	avl_delete(root, key);
+}
+
+/* the element is in the tree, its node is unlinked with the parent */
+static void
+delete_element(void *_root, void *element)
+{
+	struct avl_tree_root *root = _root;
+	struct foo *e = element;
+
+	avl_tree_remove(&root->avl_tree_node, &e->node);
+}
+
+static void*
+search_key(void *root, const void *key)
+{
+	struct avl_tree_link link;
+
+	return search(&link, root, key);
+}
+
+static void
+init(void *_root)
+{
+	struct avl_tree_root *root = _root;
+
+	*root = AVL_ROOT;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_KEY_TYPE |
+		                TREE_CAP_RELAYOUT | TREE_CAP_DELETE_ELEMENT,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		/* keys are not unsigned long */
+		.delete = NULL,
+		.insert = insert,
+		.init = init,
+
+		.get_key_info = get_key_info,
+		.delete_key = delete_key,
+		.search_key = search_key,
+
+		.set_parent = set_parent,
+		.delete_element = delete_element,
+	},
+};
@@ -0,0 +1,718 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, no parent, stores height, intrusive
+ *
+ * AVL tree where each node also stores the number of nodes in
+ * its subtree (size), so the k-th smallest key (select) and the
+ * position of a key (rank) are found in O(log n). The size is
+ * kept through rotations, and every insert or delete updates the
+ * whole path up to the root.
+ *
+ * Trees are split and joined in O(log n), and union,
+ * intersection and difference are built on them. Built with
+ * -DPARALLEL_DEPTH=<n>, the set operations run the subtrees of
+ * the first n levels in parallel (up to 2^n threads).
+ *
+ * It's the tree itself, not an interface to another
+ * implementation.
+ */
+
+#include <stddef.h> /* offsetof */
+#if PARALLEL_DEPTH
+#include <pthread.h>
+#endif
+
+#include "tree_operations.h"
+
+#ifndef container_of
+#define container_of(ptr, type, member) ({                      \
+        const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+#endif
+
+/* an AVL tree of 2^64 nodes is less than 1.45 * 64 high */
+#define MAX_HEIGHT  96
+
+struct order_avl_node {
+	struct order_avl_node *left;
+	struct order_avl_node *right;
+	/* nodes in this subtree, including this node */
+	unsigned long size;
+	int height;
+};
+
+struct order_avl_root {
+	struct order_avl_node *node;
+};
+
+#define ORDER_AVL_ROOT  (struct order_avl_root) {NULL, }
+
+struct foo {
+	struct order_avl_node node;
+	unsigned long key;
+};
+
+static inline unsigned long
+node_size(struct order_avl_node *node)
+{
+	return node ? node->size : 0;
+}
+
+static inline int
+node_height(struct order_avl_node *node)
+{
+	return node ? node->height : 0;
+}
+
+static inline unsigned long
+node_key(struct order_avl_node *node)
+{
+	return container_of(node, struct foo, node)->key;
+}
+
+static inline void
+update(struct order_avl_node *node)
+{
+	int left = node_height(node->left);
+	int right = node_height(node->right);
+
+	node->height = (left > right ? left : right) + 1;
+	node->size = node_size(node->left) + node_size(node->right) + 1;
+}
+
+static struct order_avl_node*
+rotate_left(struct order_avl_node *node)
+{
+	struct order_avl_node *right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+	update(node);
+	update(right);
+
+	return right;
+}
+
+static struct order_avl_node*
+rotate_right(struct order_avl_node *node)
+{
+	struct order_avl_node *left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+	update(node);
+	update(left);
+
+	return left;
+}
+
+/* return the node that takes the place of node */
+static struct order_avl_node*
+rebalance(struct order_avl_node *node)
+{
+	int balance = node_height(node->right) - node_height(node->left);
+
+	if (balance > 1) {
+		if (node_height(node->right->left) >
+		    node_height(node->right->right))
+			node->right = rotate_right(node->right);
+		return rotate_left(node);
+	}
+
+	if (balance < -1) {
+		if (node_height(node->left->right) >
+		    node_height(node->left->left))
+			node->left = rotate_left(node->left);
+		return rotate_right(node);
+	}
+
+	update(node);
+
+	return node;
+}
+
+/*
+ * path has the links (pointers to the child pointer) from the
+ * root to the changed node. Sizes change up to the root, so
+ * all of them are updated
+ */
+static inline void
+rebalance_path(struct order_avl_node ***path, int depth)
+{
+	while (depth--)
+		*path[depth] = rebalance(*path[depth]);
+}
+
+/*
+ * Join and split
+ * ==============
+ *
+ * join() makes a tree of left, pivot and right, the keys of left
+ * being smaller than the key of pivot and those of right
+ * greater. The taller tree is descended along its inner side to
+ * a subtree as high as the other one, where pivot is put, and
+ * the way back is rebalanced.
+ */
+
+static struct order_avl_node*
+join(struct order_avl_node *left, struct order_avl_node *pivot,
+     struct order_avl_node *right)
+{
+	int left_height = node_height(left);
+	int right_height = node_height(right);
+
+	if (left_height > right_height + 1) {
+		left->right = join(left->right, pivot, right);
+		return rebalance(left);
+	}
+
+	if (right_height > left_height + 1) {
+		right->left = join(left, pivot, right->left);
+		return rebalance(right);
+	}
+
+	pivot->left = left;
+	pivot->right = right;
+	update(pivot);
+
+	return pivot;
+}
+
+/* remove the greatest node of node (in *last) */
+static struct order_avl_node*
+split_last(struct order_avl_node *node, struct order_avl_node **last)
+{
+	struct order_avl_node *right;
+
+	if (node->right == NULL) {
+		*last = node;
+		return node->left;
+	}
+
+	right = split_last(node->right, last);
+
+	return join(node->left, node, right);
+}
+
+/* join without pivot */
+static struct order_avl_node*
+join2(struct order_avl_node *left, struct order_avl_node *right)
+{
+	struct order_avl_node *last;
+
+	if (left == NULL)
+		return right;
+
+	left = split_last(left, &last);
+
+	return join(left, last, right);
+}
+
+/*
+ * split node in the keys smaller (*left) and greater (*right)
+ * than key. Return the node with key, which is in neither
+ * of them, or NULL
+ */
+static struct order_avl_node*
+split(struct order_avl_node *node, unsigned long key,
+      struct order_avl_node **left, struct order_avl_node **right)
+{
+	struct order_avl_node *found;
+	unsigned long tmp;
+
+	if (node == NULL) {
+		*left = NULL;
+		*right = NULL;
+		return NULL;
+	}
+
+	tmp = node_key(node);
+
+	if (key < tmp) {
+		found = split(node->left, key, left, right);
+		*right = join(*right, node, node->right);
+	} else if (key > tmp) {
+		found = split(node->right, key, left, right);
+		*left = join(node->left, node, *left);
+	} else {
+		*left = node->left;
+		*right = node->right;
+		found = node;
+	}
+
+	return found;
+}
+
+/*
+ * make node a list in the order of the keys, linked by the right
+ * child pointer. A node with a left child is rotated right until
+ * it has none (as the "tree to vine" of Day-Stout-Warren), so it
+ * takes no stack
+ */
+static struct order_avl_node*
+to_list(struct order_avl_node *node)
+{
+	struct order_avl_node *head = NULL, **tail = &head, *left;
+
+	while (node) {
+		if (node->left) {
+			left = node->left;
+			node->left = left->right;
+			left->right = node;
+			node = left;
+		} else {
+			*tail = node;
+			tail = &node->right;
+			node = node->right;
+		}
+	}
+
+	return head;
+}
+
+/*
+ * the keys from lo to hi are split out of node (*range) and the
+ * rest is joined back. It's O(log n), besides making the list
+ */
+static struct order_avl_node*
+delete_range(struct order_avl_node *node, unsigned long lo, unsigned long hi,
+             struct order_avl_node **range)
+{
+	struct order_avl_node *left, *right, *first, *last;
+
+	first = split(node, lo, &left, &node);
+	last = split(node, hi, range, &right);
+
+	if (first)
+		*range = join(NULL, first, *range);
+	if (last)
+		*range = join(*range, last, NULL);
+
+	return join2(left, right);
+}
+
+/*
+ * Set operations
+ * ==============
+ *
+ * b is split by the key of the root of a, and the operation is
+ * done on the left and right halves (independent of each other)
+ * that are joined back, with or without the root of a.
+ *
+ * Nodes not in the result (e.g. of b whose key is in a, in the
+ * union) are in no tree.
+ */
+
+enum {
+	SET_UNION,
+	SET_INTERSECTION,
+	SET_DIFFERENCE,
+};
+
+/* at least this many nodes to run a half in another thread */
+#define PARALLEL_MIN_SIZE  4096
+
+static struct order_avl_node*
+set_operation(int op, struct order_avl_node *a, struct order_avl_node *b,
+              int depth);
+
+#if PARALLEL_DEPTH
+
+struct set_task {
+	pthread_t thread;
+	int op;
+	struct order_avl_node *a;
+	struct order_avl_node *b;
+	int depth;
+	struct order_avl_node *result;
+};
+
+static void*
+set_task_run(void *arg)
+{
+	struct set_task *task = arg;
+
+	task->result = set_operation(task->op, task->a, task->b,
+	                             task->depth);
+
+	return NULL;
+}
+
+#endif /* PARALLEL_DEPTH */
+
+static struct order_avl_node*
+set_operation(int op, struct order_avl_node *a, struct order_avl_node *b,
+              int depth)
+{
+	struct order_avl_node *left, *right, *found;
+
+	if (a == NULL)
+		return op == SET_UNION ? b : NULL;
+	if (b == NULL)
+		return op == SET_INTERSECTION ? NULL : a;
+
+	found = split(b, node_key(a), &left, &right);
+
+#if PARALLEL_DEPTH
+	if (depth < PARALLEL_DEPTH && a->size >= PARALLEL_MIN_SIZE) {
+		struct set_task task = {
+			.op = op,
+			.a = a->left,
+			.b = left,
+			.depth = depth + 1,
+		};
+
+		/* fork the left half, join after the right one */
+		if (pthread_create(&task.thread, NULL, set_task_run,
+		                   &task) == 0) {
+			right = set_operation(op, a->right, right, depth + 1);
+			pthread_join(task.thread, NULL);
+			left = task.result;
+			goto _go_join;
+		}
+	}
+#endif
+
+	left = set_operation(op, a->left, left, depth + 1);
+	right = set_operation(op, a->right, right, depth + 1);
+
+#if PARALLEL_DEPTH
+_go_join:
+#endif
+	/* is the root of a in the result? */
+	if (op == SET_UNION || (op == SET_INTERSECTION) == (found != NULL))
+		return join(left, a, right);
+
+	return join2(left, right);
+}
+
+static int
+avl_insert(struct order_avl_root *root, struct foo *new)
+{
+	struct order_avl_node **path[MAX_HEIGHT];
+	struct order_avl_node **link = &root->node;
+	int depth = 0;
+
+	while (*link) {
+		unsigned long key = node_key(*link);
+
+		if (new->key == key)
+			return -1;
+
+		path[depth++] = link;
+		link = new->key < key ? &(*link)->left : &(*link)->right;
+	}
+
+	new->node.left = NULL;
+	new->node.right = NULL;
+	new->node.size = 1;
+	new->node.height = 1;
+	*link = &new->node;
+
+	rebalance_path(path, depth);
+
+	return 0;
+}
+
+static int
+avl_delete(struct order_avl_root *root, unsigned long key)
+{
+	struct order_avl_node **path[MAX_HEIGHT];
+	struct order_avl_node **link = &root->node;
+	struct order_avl_node *node, *successor;
+	int depth = 0, node_depth;
+
+	while (*link && key != node_key(*link)) {
+		path[depth++] = link;
+		link = key < node_key(*link) ? &(*link)->left :
+		                               &(*link)->right;
+	}
+
+	node = *link;
+	if (node == NULL)
+		return -1;
+
+	if (!node->left || !node->right) {
+		*link = node->left ? node->left : node->right;
+		rebalance_path(path, depth);
+		return 0;
+	}
+
+	/* take the place of node with its successor */
+	node_depth = depth;
+	path[depth++] = link;
+	link = &node->right;
+	while ((*link)->left) {
+		path[depth++] = link;
+		link = &(*link)->left;
+	}
+
+	successor = *link;
+	*link = successor->right;
+	successor->left = node->left;
+	successor->right = node->right;
+	*path[node_depth] = successor;
+
+	/* the link below node is now in successor */
+	if (depth > node_depth + 1)
+		path[node_depth + 1] = &successor->right;
+
+	rebalance_path(path, depth);
+
+	return 0;
+}
+
+static struct foo*
+avl_search(struct order_avl_root *root, unsigned long key)
+{
+	struct order_avl_node *node = root->node;
+
+	while (node) {
+		unsigned long tmp = node_key(node);
+
+		if (key < tmp)
+			node = node->left;
+		else if (key > tmp)
+			node = node->right;
+		else
+			return container_of(node, struct foo, node);
+	}
+
+	return NULL;
+}
+
+static struct foo*
+avl_select(struct order_avl_root *root, unsigned long k)
+{
+	struct order_avl_node *node = root->node;
+	unsigned long left;
+
+	while (node) {
+		left = node_size(node->left);
+
+		if (k < left) {
+			node = node->left;
+		} else if (k > left) {
+			k -= left + 1;
+			node = node->right;
+		} else {
+			return container_of(node, struct foo, node);
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned long
+avl_rank(struct order_avl_root *root, unsigned long key)
+{
+	struct order_avl_node *node = root->node;
+	unsigned long rank = 0;
+
+	while (node) {
+		if (key <= node_key(node)) {
+			node = node->left;
+		} else {
+			rank += node_size(node->left) + 1;
+			node = node->right;
+		}
+	}
+
+	return rank;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct order_avl_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct order_avl_root, node);
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct order_avl_node, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct order_avl_node, right);
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return offsetof(struct foo, node);
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+static unsigned int
+get_balance(void *_node)
+{
+	struct order_avl_node *node = _node;
+
+	return node_height(node->right) - node_height(node->left);
+}
+
+static void
+insert(void *root, void *pos)
+{
+	avl_insert(root, pos);
+}
+
+static void
+delete(void *root, unsigned long key)
+{
+	avl_delete(root, key);
+}
+
+static void*
+search(void *root, unsigned long key)
+{
+	return avl_search(root, key);
+}
+
+static void*
+select(void *root, unsigned long k)
+{
+	return avl_select(root, k);
+}
+
+static unsigned long
+rank(void *root, unsigned long key)
+{
+	return avl_rank(root, key);
+}
+
+static void*
+split_op(void *_root, unsigned long key, void *_left, void *_right)
+{
+	struct order_avl_root *root = _root;
+	struct order_avl_root *left = _left, *right = _right;
+	struct order_avl_node *node = root->node, *found;
+
+	root->node = NULL;
+	found = split(node, key, &left->node, &right->node);
+
+	return found ? container_of(found, struct foo, node) : NULL;
+}
+
+static void
+join_op(void *_root, void *_left, void *pivot, void *_right)
+{
+	struct order_avl_root *root = _root;
+	struct order_avl_root *left = _left, *right = _right;
+	struct foo *element = pivot;
+	struct order_avl_node *l = left->node, *r = right->node;
+
+	left->node = NULL;
+	right->node = NULL;
+	root->node = join(l, &element->node, r);
+}
+
+static void*
+delete_range_op(void *_root, unsigned long lo, unsigned long hi)
+{
+	struct order_avl_root *root = _root;
+	struct order_avl_node *range;
+
+	if (lo > hi)
+		return NULL;
+
+	root->node = delete_range(root->node, lo, hi, &range);
+	range = to_list(range);
+
+	return range ? container_of(range, struct foo, node) : NULL;
+}
+
+static void
+set_op(int op, void *_root, void *_a, void *_b)
+{
+	struct order_avl_root *root = _root;
+	struct order_avl_root *a = _a, *b = _b;
+	struct order_avl_node *node_a = a->node, *node_b = b->node;
+
+	a->node = NULL;
+	b->node = NULL;
+	root->node = set_operation(op, node_a, node_b, 0);
+}
+
+static void
+set_union(void *root, void *a, void *b)
+{
+	set_op(SET_UNION, root, a, b);
+}
+
+static void
+set_intersection(void *root, void *a, void *b)
+{
+	set_op(SET_INTERSECTION, root, a, b);
+}
+
+static void
+set_difference(void *root, void *a, void *b)
+{
+	set_op(SET_DIFFERENCE, root, a, b);
+}
+
+static void
+init(void *_root)
+{
+	struct order_avl_root *root = _root;
+
+	*root = ORDER_AVL_ROOT;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_ORDER |
+		                TREE_CAP_SET | TREE_CAP_RELAYOUT |
+		                TREE_CAP_DELETE_RANGE,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = search,
+		.select = select,
+		.rank = rank,
+
+		.split = split_op,
+		.join = join_op,
+		.set_union = set_union,
+		.set_intersection = set_intersection,
+		.set_difference = set_difference,
+
+		.delete_range = delete_range_op,
+	},
+};
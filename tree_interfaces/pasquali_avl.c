@@ -32,59 +32,57 @@
 #include "example.h"
 #include "avl_tree.h"
 
-/* NOTE: dlsym() does not get 'static' things */
-
-char *magic_string = "binary_tree_module";
+#include "tree_operations.h"
 
-size_t
+static size_t
 get_root_size(void)
 {
 	return sizeof(struct avl_root);
 }
 
-size_t
+static size_t
 get_element_size(void)
 {
 	return sizeof(struct example);
 }
 
-size_t
+static size_t
 get_root_node_offset(void)
 {
 	return offsetof(struct avl_root, avl_node);
 }
 
-size_t
+static size_t
 get_left_offset(void)
 {
 	return offsetof(struct avl_node, left);
 }
 
-size_t
+static size_t
 get_right_offset(void)
 {
 	return offsetof(struct avl_node, right);
 }
 
-size_t
+static size_t
 get_node_offset_in_element(void)
 {
 	return offsetof(struct example, node);
 }
 
-size_t
+static size_t
 get_key_offset_in_element(void)
 {
 	return offsetof(struct example, key);
 }
 
-unsigned int
+static unsigned int
 get_balance(void *node)
 {
 	return ((struct avl_node*) node)->balance;
 }
 
-void
+static void
 insert(void *root, void *pos)
 {
 	struct example *new = pos;
@@ -92,16 +90,40 @@ insert(void *root, void *pos)
 	avl_insert(root, new);
 }
 
-void
+static void
 delete(void *root, unsigned long key)
 {
 	avl_delete(root, key);
 }
 
-void
+static void
 init(void *_root)
 {
 	struct avl_root *root = _root;
 
 	*root = AVL_ROOT;
 }
+
+/* NOTE: dlsym() does not get 'static' things */
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_RELAYOUT,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+	},
+};
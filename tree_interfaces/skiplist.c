@@ -0,0 +1,280 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, no parent, stores level, intrusive
+ *
+ * Skip list of unsigned long keys. Each element has a tower of
+ * next pointers stored inline (no allocation), and a level
+ * drawn with probability 1/4 of going up: the search visits
+ * about 4 elements per level in log4(n) levels, and most
+ * elements use one or two pointers of the tower. Elements are
+ * aligned to a cache line: the key and the first LINE_LEVELS
+ * levels of the tower are in the first 64 bytes, and the upper
+ * levels (used by 1 in 1024 elements) in the next line, so a
+ * step of the search below them touches a single cache line.
+ *
+ * To the tree manager the list is a tree without left children
+ * (left is always NULL, right is the next element), so it can be
+ * walked, validated and printed. get_balance is the level of an
+ * element. The levels are drawn from a generator kept in the
+ * root, so the same operations build the same list.
+ *
+ * It's the list itself, not an interface to another
+ * implementation.
+ */
+
+#include <stddef.h> /* offsetof */
+
+#include "tree_operations.h"
+
+#ifndef container_of
+#define container_of(ptr, type, member) ({                      \
+        const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+#endif
+
+/* enough levels for about 4^12 (16M) elements */
+#define MAX_LEVEL  12
+
+/* levels in the cache line of the key */
+#define LINE_LEVELS  5
+
+struct skip_node {
+	unsigned int level;
+	/* always NULL, the left child seen by the tree manager */
+	struct skip_node *left;
+	struct skip_node *next[MAX_LEVEL];
+};
+
+struct skip_root {
+	/* towers of the list, next[0] is the first element */
+	struct skip_node head;
+	/* levels in use */
+	unsigned int level;
+	/* generator of the levels (xorshift) */
+	unsigned long random;
+};
+
+#define SKIP_RANDOM_SEED  0x2545f4914f6cdd1dUL
+
+/* key, level, left and next[0 .. LINE_LEVELS - 1] in 64 bytes */
+struct foo {
+	unsigned long key;
+	struct skip_node node;
+} __attribute__((aligned(64)));
+
+_Static_assert(offsetof(struct foo, node.next[LINE_LEVELS]) == 64,
+               "the first levels must be in the cache line of the key");
+
+static inline unsigned long
+node_key(struct skip_node *node)
+{
+	return container_of(node, struct foo, node)->key;
+}
+
+/* 1 + the number of times of probability 1/4 that go up */
+static unsigned int
+random_level(struct skip_root *root)
+{
+	unsigned long x = root->random;
+	unsigned int level = 1;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	root->random = x;
+
+	while ((x & 3) == 0 && level < MAX_LEVEL) {
+		level++;
+		x >>= 2;
+	}
+
+	return level;
+}
+
+/*
+ * fill update with the last node before key in each level (the
+ * head if none). Return the node with key or NULL
+ */
+static struct skip_node*
+find(struct skip_root *root, unsigned long key, struct skip_node **update)
+{
+	struct skip_node *x = &root->head, *next;
+	int i;
+
+	for (i = root->level - 1; i >= 0; i--) {
+		while ((next = x->next[i]) && node_key(next) < key)
+			x = next;
+		update[i] = x;
+	}
+
+	next = x->next[0];
+
+	return next && node_key(next) == key ? next : NULL;
+}
+
+static struct foo*
+skip_search(struct skip_root *root, unsigned long key)
+{
+	struct skip_node *x = &root->head, *next = NULL;
+	int i;
+
+	for (i = root->level - 1; i >= 0; i--) {
+		while ((next = x->next[i]) && node_key(next) < key)
+			x = next;
+	}
+
+	if (next == NULL || node_key(next) != key)
+		return NULL;
+
+	return container_of(next, struct foo, node);
+}
+
+static int
+skip_insert(struct skip_root *root, struct foo *new)
+{
+	struct skip_node *update[MAX_LEVEL], *node = &new->node;
+	unsigned int level, i;
+
+	if (find(root, new->key, update))
+		return -1;
+
+	level = random_level(root);
+	for (i = root->level; i < level; i++)
+		update[i] = &root->head;
+	if (level > root->level)
+		root->level = level;
+
+	node->level = level;
+	node->left = NULL;
+	for (i = 0; i < level; i++) {
+		node->next[i] = update[i]->next[i];
+		update[i]->next[i] = node;
+	}
+
+	return 0;
+}
+
+static int
+skip_delete(struct skip_root *root, unsigned long key)
+{
+	struct skip_node *update[MAX_LEVEL], *node;
+	unsigned int i;
+
+	node = find(root, key, update);
+	if (node == NULL)
+		return -1;
+
+	for (i = 0; i < node->level; i++)
+		update[i]->next[i] = node->next[i];
+
+	while (root->level > 1 && root->head.next[root->level - 1] == NULL)
+		root->level--;
+
+	return 0;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct skip_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct skip_root, head.next[0]);
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct skip_node, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct skip_node, next[0]);
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return offsetof(struct foo, node);
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+/* the level, not a balance factor (TREE_CAP_NON_AVL) */
+static unsigned int
+get_balance(void *node)
+{
+	return ((struct skip_node*) node)->level;
+}
+
+static void
+insert(void *root, void *pos)
+{
+	skip_insert(root, pos);
+}
+
+static void
+delete(void *root, unsigned long key)
+{
+	skip_delete(root, key);
+}
+
+static void*
+search(void *root, unsigned long key)
+{
+	return skip_search(root, key);
+}
+
+static void
+init(void *_root)
+{
+	struct skip_root *root = _root;
+	int i;
+
+	root->head.level = MAX_LEVEL;
+	root->head.left = NULL;
+	for (i = 0; i < MAX_LEVEL; i++)
+		root->head.next[i] = NULL;
+	root->level = 1;
+	root->random = SKIP_RANDOM_SEED;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_NON_AVL,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = search,
+	},
+};
@@ -0,0 +1,270 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, no parent, no balance, intrusive
+ *
+ * Splay tree: every operation moves the node with the key (or the
+ * last node on its way) to the root, so the keys used most are
+ * kept near the root and a skewed workload reads a few levels of
+ * the tree. The cost is amortized O(log n): the tree can be a
+ * path of n nodes (e.g. after inserting keys in order), which is
+ * walked at the next operation.
+ *
+ * The splay is top-down (Sleator and Tarjan): it's done walking
+ * down, hanging the nodes smaller and greater than key in two
+ * trees, without recursion, a stack or a parent pointer. Note a
+ * search changes the tree (TREE_CAP_SEARCH_WRITES).
+ *
+ * It's the tree itself, not an interface to another
+ * implementation.
+ */
+
+#include <stddef.h> /* offsetof */
+
+#include "tree_operations.h"
+
+#ifndef container_of
+#define container_of(ptr, type, member) ({                      \
+        const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+#endif
+
+struct splay_node {
+	struct splay_node *left;
+	struct splay_node *right;
+};
+
+struct splay_root {
+	struct splay_node *node;
+};
+
+#define SPLAY_ROOT  (struct splay_root) {NULL, }
+
+struct foo {
+	struct splay_node node;
+	unsigned long key;
+};
+
+static inline unsigned long
+node_key(struct splay_node *node)
+{
+	return container_of(node, struct foo, node)->key;
+}
+
+/*
+ * return the subtree of node with key at the root, or the last
+ * node on the way to key if it isn't in the subtree
+ */
+static struct splay_node*
+splay(struct splay_node *node, unsigned long key)
+{
+	/* left of header: nodes greater than key, right: smaller */
+	struct splay_node header = {NULL, NULL};
+	struct splay_node *l = &header, *r = &header, *tmp;
+
+	if (node == NULL)
+		return NULL;
+
+	for (;;) {
+		if (key < node_key(node)) {
+			if (node->left == NULL)
+				break;
+			/* zig-zig: rotate right */
+			if (key < node_key(node->left)) {
+				tmp = node->left;
+				node->left = tmp->right;
+				tmp->right = node;
+				node = tmp;
+				if (node->left == NULL)
+					break;
+			}
+			/* link right */
+			r->left = node;
+			r = node;
+			node = node->left;
+		} else if (key > node_key(node)) {
+			if (node->right == NULL)
+				break;
+			/* zag-zag: rotate left */
+			if (key > node_key(node->right)) {
+				tmp = node->right;
+				node->right = tmp->left;
+				tmp->left = node;
+				node = tmp;
+				if (node->right == NULL)
+					break;
+			}
+			/* link left */
+			l->right = node;
+			l = node;
+			node = node->right;
+		} else {
+			break;
+		}
+	}
+
+	/* assemble */
+	l->right = node->left;
+	r->left = node->right;
+	node->left = header.right;
+	node->right = header.left;
+
+	return node;
+}
+
+static struct foo*
+splay_search(struct splay_root *root, unsigned long key)
+{
+	root->node = splay(root->node, key);
+
+	if (root->node == NULL || node_key(root->node) != key)
+		return NULL;
+
+	return container_of(root->node, struct foo, node);
+}
+
+static int
+splay_insert(struct splay_root *root, struct foo *new)
+{
+	struct splay_node *node = splay(root->node, new->key);
+
+	if (node == NULL) {
+		new->node.left = NULL;
+		new->node.right = NULL;
+	} else if (new->key < node_key(node)) {
+		new->node.left = node->left;
+		new->node.right = node;
+		node->left = NULL;
+	} else if (new->key > node_key(node)) {
+		new->node.right = node->right;
+		new->node.left = node;
+		node->right = NULL;
+	} else {
+		root->node = node;
+		return -1;
+	}
+
+	root->node = &new->node;
+
+	return 0;
+}
+
+static int
+splay_delete(struct splay_root *root, unsigned long key)
+{
+	struct splay_node *node = splay(root->node, key);
+
+	root->node = node;
+	if (node == NULL || node_key(node) != key)
+		return -1;
+
+	if (node->left == NULL) {
+		root->node = node->right;
+	} else {
+		/* the greatest key of left goes to the root, no right */
+		root->node = splay(node->left, key);
+		root->node->right = node->right;
+	}
+
+	return 0;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct splay_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct splay_root, node);
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct splay_node, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct splay_node, right);
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return offsetof(struct foo, node);
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+/* there's no balance (TREE_CAP_NON_AVL) */
+static unsigned int
+get_balance(void *node)
+{
+	return 0;
+}
+
+static void
+insert(void *root, void *pos)
+{
+	splay_insert(root, pos);
+}
+
+static void
+delete(void *root, unsigned long key)
+{
+	splay_delete(root, key);
+}
+
+static void*
+search(void *root, unsigned long key)
+{
+	return splay_search(root, key);
+}
+
+static void
+init(void *_root)
+{
+	struct splay_root *root = _root;
+
+	*root = SPLAY_ROOT;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_RELAYOUT |
+		                TREE_CAP_NON_AVL | TREE_CAP_SEARCH_WRITES,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = search,
+	},
+};
@@ -0,0 +1,261 @@
+/*
+ * 18/10/2026
+ *
+ * iterative, no parent, stores priority, intrusive
+ *
+ * Treap: a binary search tree by key and a heap by priority, so
+ * it's as a tree built by inserting the keys in random order
+ * (expected depth of O(log n)). The priority is a hash of the
+ * key, so the same keys always make the same tree and a key
+ * already in the tree is met on the way down.
+ *
+ * Insert goes down to the first node of lower priority and
+ * splits it by the key into the children of the new node. Delete
+ * merges the children of the node into its place. Both are done
+ * walking down, without recursion or a stack.
+ *
+ * get_balance is the priority, not a balance factor.
+ *
+ * It's the tree itself, not an interface to another
+ * implementation.
+ */
+
+#include <stddef.h> /* offsetof */
+
+#include "tree_operations.h"
+
+#ifndef container_of
+#define container_of(ptr, type, member) ({                      \
+        const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+#endif
+
+struct treap_node {
+	struct treap_node *left;
+	struct treap_node *right;
+	unsigned int priority;
+};
+
+struct treap_root {
+	struct treap_node *node;
+};
+
+#define TREAP_ROOT  (struct treap_root) {NULL, }
+
+struct foo {
+	struct treap_node node;
+	unsigned long key;
+};
+
+static inline unsigned long
+node_key(struct treap_node *node)
+{
+	return container_of(node, struct foo, node)->key;
+}
+
+/* splitmix64 finalizer */
+static inline unsigned int
+key_priority(unsigned long key)
+{
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9UL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebUL;
+
+	return (key ^ (key >> 31)) >> 32;
+}
+
+/* the keys of node smaller than key to *left, the others to *right */
+static void
+split(struct treap_node *node, unsigned long key, struct treap_node **left,
+      struct treap_node **right)
+{
+	while (node) {
+		if (node_key(node) < key) {
+			*left = node;
+			left = &node->right;
+			node = node->right;
+		} else {
+			*right = node;
+			right = &node->left;
+			node = node->left;
+		}
+	}
+
+	*left = NULL;
+	*right = NULL;
+}
+
+/* left and right (keys of left smaller) to *link */
+static void
+merge(struct treap_node **link, struct treap_node *left,
+      struct treap_node *right)
+{
+	while (left && right) {
+		if (left->priority > right->priority) {
+			*link = left;
+			link = &left->right;
+			left = left->right;
+		} else {
+			*link = right;
+			link = &right->left;
+			right = right->left;
+		}
+	}
+
+	*link = left ? left : right;
+}
+
+static struct foo*
+treap_search(struct treap_root *root, unsigned long key)
+{
+	struct treap_node *node = root->node;
+	unsigned long tmp;
+
+	while (node) {
+		tmp = node_key(node);
+		if (key == tmp)
+			return container_of(node, struct foo, node);
+		node = key < tmp ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+static int
+treap_insert(struct treap_root *root, struct foo *new)
+{
+	struct treap_node **link = &root->node;
+	unsigned long key = new->key, tmp;
+
+	new->node.priority = key_priority(key);
+
+	/* a node with key has the same priority, it's above */
+	while (*link && (*link)->priority >= new->node.priority) {
+		tmp = node_key(*link);
+		if (key == tmp)
+			return -1;
+		link = key < tmp ? &(*link)->left : &(*link)->right;
+	}
+
+	split(*link, key, &new->node.left, &new->node.right);
+	*link = &new->node;
+
+	return 0;
+}
+
+static int
+treap_delete(struct treap_root *root, unsigned long key)
+{
+	struct treap_node **link = &root->node;
+	unsigned long tmp;
+
+	while (*link) {
+		tmp = node_key(*link);
+		if (key == tmp) {
+			merge(link, (*link)->left, (*link)->right);
+			return 0;
+		}
+		link = key < tmp ? &(*link)->left : &(*link)->right;
+	}
+
+	return -1;
+}
+
+static size_t
+get_root_size(void)
+{
+	return sizeof(struct treap_root);
+}
+
+static size_t
+get_element_size(void)
+{
+	return sizeof(struct foo);
+}
+
+static size_t
+get_root_node_offset(void)
+{
+	return offsetof(struct treap_root, node);
+}
+
+static size_t
+get_left_offset(void)
+{
+	return offsetof(struct treap_node, left);
+}
+
+static size_t
+get_right_offset(void)
+{
+	return offsetof(struct treap_node, right);
+}
+
+static size_t
+get_node_offset_in_element(void)
+{
+	return offsetof(struct foo, node);
+}
+
+static size_t
+get_key_offset_in_element(void)
+{
+	return offsetof(struct foo, key);
+}
+
+/* the priority, not a balance factor (TREE_CAP_NON_AVL) */
+static unsigned int
+get_balance(void *node)
+{
+	return ((struct treap_node*) node)->priority;
+}
+
+static void
+insert(void *root, void *pos)
+{
+	treap_insert(root, pos);
+}
+
+static void
+delete(void *root, unsigned long key)
+{
+	treap_delete(root, key);
+}
+
+static void*
+search(void *root, unsigned long key)
+{
+	return treap_search(root, key);
+}
+
+static void
+init(void *_root)
+{
+	struct treap_root *root = _root;
+
+	*root = TREAP_ROOT;
+}
+
+const struct tree_module tree_module = {
+	TREE_MODULE_HEADER,
+	.ops = {
+		.capabilities = TREE_CAP_SEARCH | TREE_CAP_RELAYOUT |
+		                TREE_CAP_NON_AVL,
+
+		.get_root_size = get_root_size,
+		.get_element_size = get_element_size,
+
+		.get_root_node_offset = get_root_node_offset,
+		.get_left_offset = get_left_offset,
+		.get_right_offset = get_right_offset,
+		.get_node_offset_in_element = get_node_offset_in_element,
+		.get_key_offset_in_element = get_key_offset_in_element,
+
+		.get_balance = get_balance,
+
+		.delete = delete,
+		.insert = insert,
+		.init = init,
+
+		.search = search,
+	},
+};
@@ -22,16 +22,34 @@
  * Read the README
  */
 
-#include <stdlib.h> /* malloc free */
+#define _GNU_SOURCE /* dlinfo */
+
+#include <stdio.h> /* sprintf */
+#include <stdlib.h> /* malloc aligned_alloc free mkstemps */
 #include <string.h> /* strcmp strrchr strncmp strdup */
 #include <sys/types.h>
 #include <dirent.h> /* opendir readdir */
+#include <fcntl.h> /* open */
+#include <fnmatch.h> /* fnmatch */
+#include <limits.h> /* PATH_MAX ULONG_MAX */
+#include <pthread.h> /* pthread_create pthread_setaffinity_np */
+#include <sched.h> /* sched_yield CPU_SET */
+#include <sys/stat.h> /* stat */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* read write close unlink */
+
+#if defined(__x86_64__)
+#include <immintrin.h> /* AVX2 and AVX-512 intrinsics */
+#endif
 
 /* NOTE: link with -ldl */
-#include <dlfcn.h> /* dlopen */
+#include <dlfcn.h> /* dlopen dlinfo */
+#include <link.h> /* struct link_map */
 
 #include "tree_manager.h"
 
+#define CACHE_LINE_SIZE  64
+
 /*
  * Tree library
  * ============
@@ -40,10 +58,22 @@
  *
  * The exposed functions are:
  * - tree_library_load()
+ * - tree_library_load_isa()
+ * - tree_library_get() and tree_library_put()
+ * - tree_library_reload()
  * - tree_manager_unload_trees()
  * - tree_manager_load_trees()
+ * - tree_manager_load_trees_with()
  */
 
+/* stop - start in seconds */
+static double
+elapsed_time(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) +
+	       (stop->tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static const char*
 get_filename_ext(const char *filename)
 {
@@ -54,9 +84,144 @@ get_filename_ext(const char *filename)
 	return dot + 1;
 }
 
+/*
+ * ISA variants of a library, from best to worst. The variant
+ * of "name.so" is "name.<isa>.so" (see tree_interfaces/Makefile).
+ * A tree built with profile-guided optimization for the actual
+ * workload is preferred over any ISA. It's "pgo" if built for
+ * baseline, or "pgo-<isa>" (PGO_ISA)
+ */
+static const char *isa_variants[] = {
+	"pgo-x86-64-v4",
+	"pgo-x86-64-v3",
+	"pgo",
+	"x86-64-v4",
+	"x86-64-v3",
+	NULL,
+};
+
+#define BASELINE_ISA  "baseline"
+#define PGO_ISA       "pgo"
+
+static int
+isa_supported(const char *isa)
+{
+	if (strncmp(isa, PGO_ISA, 3) == 0) {
+		if (isa[3] == '\0')
+			return 1;
+		return isa[3] == '-' && isa_supported(isa + 4);
+	}
+#if defined(__x86_64__)
+	if (strcmp(isa, "x86-64-v4") == 0)
+		return __builtin_cpu_supports("x86-64-v4");
+	if (strcmp(isa, "x86-64-v3") == 0)
+		return __builtin_cpu_supports("x86-64-v3");
+#endif
+	return 0;
+}
+
+/* return the ISA if filename is a variant, NULL otherwise */
+static const char*
+get_filename_isa(const char *filename)
+{
+	size_t len = strlen(filename);
+	size_t isa_len;
+	const char **isa;
+
+	for (isa = isa_variants; *isa; isa++) {
+		isa_len = strlen(*isa);
+
+		/* ".<isa>.so" */
+		if (len < isa_len + 4)
+			continue;
+		if (strcmp(filename + len - 3, ".so") != 0 ||
+		    filename[len - isa_len - 4] != '.' ||
+		    strncmp(filename + len - isa_len - 3, *isa, isa_len) != 0)
+			continue;
+
+		return *isa;
+	}
+
+	return NULL;
+}
+
+/* dlopen() "name.<isa>.so" for filename "name.so" */
+static void*
+open_variant(const char *filename, const char *isa, int flags)
+{
+	size_t len = strlen(filename);
+	char *variant;
+	void *library;
+
+	if (len < 3 || strcmp(filename + len - 3, ".so") != 0)
+		return NULL;
+
+	variant = malloc(len + strlen(isa) + 2);
+	if (variant == NULL)
+		return NULL;
+	sprintf(variant, "%.*s.%s.so", (int) len - 3, filename, isa);
+	library = dlopen(variant, flags);
+	free(variant);
+
+	return library;
+}
+
+/*
+ * dlopen() the best ISA variant of filename supported by the
+ * running CPU, or filename itself if there's none. With
+ * pgo_only, the best pgo variant or NULL
+ */
+static void*
+open_best_variant(const char *filename, const char **isa_out, int flags,
+                  int pgo_only)
+{
+	const char **isa;
+	void *library;
+
+	*isa_out = get_filename_isa(filename);
+	if (*isa_out)
+		return pgo_only ? NULL : dlopen(filename, flags);
+
+	for (isa = isa_variants; *isa; isa++) {
+		if (pgo_only && strncmp(*isa, PGO_ISA, 3) != 0)
+			continue;
+		if (!isa_supported(*isa))
+			continue;
+
+		library = open_variant(filename, *isa, flags);
+		if (library) {
+			*isa_out = *isa;
+			return library;
+		}
+	}
+
+	if (pgo_only)
+		return NULL;
+
+	*isa_out = BASELINE_ISA;
+
+	return dlopen(filename, flags);
+}
+
+/*
+ * get operations of a library without a module descriptor:
+ * it must have the magic_string symbol and a symbol for each
+ * of the main operations
+ */
 static int
 get_symbols(void *library, struct tree_operations *ops)
 {
+	char **magic_string;
+
+#define EXPECTED_MAGIC_STRING  "binary_tree_module"
+
+	/* error if magic string isn't found or if it's wrong */
+	magic_string = dlsym(library, "magic_string");
+	if (magic_string == NULL)
+		return -1;
+	if (strncmp(*magic_string, EXPECTED_MAGIC_STRING,
+	            sizeof(EXPECTED_MAGIC_STRING)) != 0)
+		return -1;
 
 #define IF_NULL_RETURN_ERROR(ptr) \
 do { \
@@ -67,6 +232,9 @@ do { \
 #define __get_symbol(library, operations, symbol) \
   IF_NULL_RETURN_ERROR( (operations)->symbol = dlsym(library, #symbol) )
 
+	/* these libraries have no optional operation */
+	memset(ops, 0, sizeof(*ops));
+
 	/* size */
 	__get_symbol(library, ops, get_root_size);
 	__get_symbol(library, ops, get_element_size);
@@ -84,51 +252,197 @@ do { \
 	__get_symbol(library, ops, delete);
 	__get_symbol(library, ops, insert);
 	__get_symbol(library, ops, init);
+
+	return 0;
+}
+
+/* get operations from the tree_module symbol (one dlsym()) */
+static int
+get_module(void *library, struct tree_operations *ops)
+{
+	const struct tree_module *module;
+	size_t size;
+
+	module = dlsym(library, "tree_module");
+	if (module == NULL)
+		return -1;
+
+	if (module->abi_version != TREE_MODULE_ABI_VERSION)
+		return -1;
+
+	/* operations the tree doesn't know are NULL */
+	size = module->ops_size;
+	if (size > sizeof(*ops))
+		size = sizeof(*ops);
+	memset(ops, 0, sizeof(*ops));
+	memcpy(ops, &module->ops, size);
+
+	if (!ops->get_root_size || !ops->get_element_size ||
+	    !ops->get_root_node_offset || !ops->get_left_offset ||
+	    !ops->get_right_offset || !ops->get_node_offset_in_element ||
+	    !ops->get_key_offset_in_element || !ops->get_balance ||
+	    !ops->insert || !ops->init)
+		return -1;
+
+	/* the key type needs both operations */
+	if (!ops->get_key_info || !ops->delete_key)
+		ops->capabilities &= ~TREE_CAP_KEY_TYPE;
+	if (!(ops->capabilities & TREE_CAP_KEY_TYPE)) {
+		ops->get_key_info = NULL;
+		ops->delete_key = NULL;
+	}
+
+	/* search with an unsigned long key or a pointer to a key */
+	if (!(ops->capabilities & TREE_CAP_KEY_TYPE))
+		ops->search_key = NULL;
+	if (!ops->search && !ops->search_key)
+		ops->capabilities &= ~TREE_CAP_SEARCH;
+	if (!(ops->capabilities & TREE_CAP_SEARCH)) {
+		ops->search = NULL;
+		ops->search_key = NULL;
+	}
+
+	/* order statistics are of unsigned long keys */
+	if (!ops->select || !ops->rank ||
+	    (ops->capabilities & TREE_CAP_KEY_TYPE))
+		ops->capabilities &= ~TREE_CAP_ORDER;
+	if (!(ops->capabilities & TREE_CAP_ORDER)) {
+		ops->select = NULL;
+		ops->rank = NULL;
+	}
+
+	if (!ops->split || !ops->join || !ops->set_union ||
+	    !ops->set_intersection || !ops->set_difference ||
+	    (ops->capabilities & TREE_CAP_KEY_TYPE))
+		ops->capabilities &= ~TREE_CAP_SET;
+	if (!(ops->capabilities & TREE_CAP_SET)) {
+		ops->split = NULL;
+		ops->join = NULL;
+		ops->set_union = NULL;
+		ops->set_intersection = NULL;
+		ops->set_difference = NULL;
+	}
+
+	if (!ops->delete_element)
+		ops->capabilities &= ~TREE_CAP_DELETE_ELEMENT;
+	if (!(ops->capabilities & TREE_CAP_DELETE_ELEMENT))
+		ops->delete_element = NULL;
+
+	if (!ops->insert_hint)
+		ops->capabilities &= ~TREE_CAP_INSERT_HINT;
+	if (!(ops->capabilities & TREE_CAP_INSERT_HINT))
+		ops->insert_hint = NULL;
+
+	if (!ops->delete_range)
+		ops->capabilities &= ~TREE_CAP_DELETE_RANGE;
+	if (!(ops->capabilities & TREE_CAP_DELETE_RANGE))
+		ops->delete_range = NULL;
+
+	if (!ops->snapshot || !ops->release || !ops->get_allocated)
+		ops->capabilities &= ~TREE_CAP_SNAPSHOT;
+	if (!(ops->capabilities & TREE_CAP_SNAPSHOT)) {
+		ops->snapshot = NULL;
+		ops->release = NULL;
+		ops->get_allocated = NULL;
+	}
+
+	/* a tree that can't be walked is searched and not moved */
+	if (ops->capabilities & TREE_CAP_NON_BINARY) {
+		if (!(ops->capabilities & TREE_CAP_SEARCH))
+			return -1;
+		ops->capabilities &= ~TREE_CAP_RELAYOUT;
+	}
+
+	/* set_parent is optional, trees without parent don't have it */
+	if (!(ops->capabilities & TREE_CAP_RELAYOUT))
+		ops->set_parent = NULL;
+
+	/* delete is needed for unsigned long keys */
+	if (ops->delete == NULL) {
+		struct tree_key_info key;
+
+		if (!(ops->capabilities & TREE_CAP_KEY_TYPE))
+			return -1;
+		ops->get_key_info(&key);
+		if (key.type == TREE_KEY_ULONG)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* module descriptor, or symbols of an older library */
+static int
+get_operations(void *library, struct tree_operations *ops)
+{
+	if (dlsym(library, "tree_module"))
+		return get_module(library, ops);
+
+	return get_symbols(library, ops);
 }
 
 /*
- * 1. Load the library using dlopen()
- * 2. Check if it's a valid tree library by checking the
- *    magic_string symbol
- * 3. Allocate memory for tree_library structure
- * 4. Get the library symbols (functions) and store them in
- *    tree operations structure inside tree_library
- * 5. Insert tree_library in a single linked list of loaded
+ * 1. Load the library using dlopen(). If filename is not an
+ *    ISA variant itself, its best variant for the running CPU
+ *    is loaded instead
+ * 2. Allocate memory for tree_library structure
+ * 3. Get the tree operations from the module descriptor (or the
+ *    symbols of an older library) and store them inside
+ *    tree_library. It's not a valid tree library if it fails
+ * 4. Insert tree_library in a single linked list of loaded
  *    tree libraries
  *
  * assume filename is not NULL
+ *
+ * flags are passed to dlopen() and time spent is added to
+ * stats (if not NULL)
  */
-struct tree_library*
-tree_library_load(const char *filename, struct list_head *tree_list)
+static struct tree_library*
+__tree_library_load(const char *filename, const char *isa, int flags,
+                    struct list_head *tree_list,
+                    struct tree_load_stats *stats)
 {
 	void *library;
-	char **magic_string;
 	struct tree_library *new;
+	struct timespec start, stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	/* rpath is set to . (see Makefile) */
-	library = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
-	if (library == NULL)
-		return NULL;
+	if (isa == NULL)
+		library = open_best_variant(filename, &isa, flags, 0);
+	else if (strcmp(isa, PGO_ISA) == 0)
+		library = open_best_variant(filename, &isa, flags, 1);
+	else if (strcmp(isa, BASELINE_ISA) == 0)
+		library = dlopen(filename, flags);
+	else
+		library = open_variant(filename, isa, flags);
 
-#define EXPECTED_MAGIC_STRING  "binary_tree_module"
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	if (stats)
+		stats->open += elapsed_time(&start, &stop);
 
-	/* error if magic string isn't found or if it's wrong */
-	magic_string = dlsym(library, "magic_string");
-	if (magic_string == NULL)
-		goto _go_close_library;
-	if (strncmp(*magic_string, EXPECTED_MAGIC_STRING,
-	            sizeof(EXPECTED_MAGIC_STRING)) != 0)
-		goto _go_close_library;
+	if (library == NULL)
+		return NULL;
 
 	/* allocate memory for the new tree library */
 	new = malloc(sizeof(*new));
+	if (new == NULL)
+		goto _go_close_library;
 
-	/* get the symbols (functions) from library */
-	if (get_symbols(library, &new->ops) == -1)
+	/* get the tree operations from library */
+	if (get_operations(library, &new->ops) == -1)
 		goto _go_free_tree_library;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (stats)
+		stats->validate += elapsed_time(&stop, &start);
+
 	/* set library's name to filename */
 	new->name = strdup(filename);
+	new->isa = isa;
+	new->users = 0;
+	new->retired = (struct list_head) LIST_HEAD_INIT;
 
 	/* store library handle so we can close it later */
 	new->library = library;
@@ -148,149 +462,1394 @@ _go_close_library:
 	return NULL;
 }
 
-void
-tree_manager_unload_trees(struct list_head *tree_list)
+struct tree_library*
+tree_library_load(const char *filename, struct list_head *tree_list)
 {
-	struct list_node *current;
-	struct list_node *next;
-
-	list_for_each_safe (current, next, tree_list->first) {
-		struct tree_library *tmp;
-
-		tmp = container_of(current, struct tree_library, list_node);
-
-		dlclose(tmp->library);
-		free(tmp->name);
-		free(tmp);
-	}
+	return __tree_library_load(filename, NULL, RTLD_NOW | RTLD_LOCAL,
+	                           tree_list, NULL);
 }
 
 /*
- * dynamic load all trees in current working directory
- *
- * It simply calls tree_library_load() for each .so file.
- *     so = shared object, because it may be shared between
- *     multiple programs :-)
+ * load exactly the variant isa ("baseline" for filename
+ * itself) of filename, which must be a baseline library. "pgo"
+ * is the best pgo variant supported by the running CPU
  */
-int
-tree_manager_load_trees(struct list_head *tree_list)
+struct tree_library*
+tree_library_load_isa(const char *filename, const char *isa,
+                      struct list_head *tree_list)
 {
-	DIR *directory;
-	struct dirent *current_file;
-	char *current_filename;
-
-	/* open the current working directory */
-	directory = opendir(".");
-	if (directory == NULL)
-		return -1;
+	return __tree_library_load(filename, isa, RTLD_NOW | RTLD_LOCAL,
+	                           tree_list, NULL);
+}
 
-	/* for each file in directory */
-	while (current_file = readdir(directory)) {
-		current_filename = current_file->d_name;
+/*
+ * trees of a library in use, so it can't be reloaded with a
+ * different layout (see tree_library_reload())
+ */
+void
+tree_library_get(struct tree_library *lib)
+{
+	lib->users++;
+}
 
-		/* skip current and parent entries */
-		if (strcmp(current_filename, ".") == 0
-		    || strcmp(current_filename, "..") == 0)
-			continue;
+/* a handle replaced by tree_library_reload() with trees in use */
+struct retired_library {
+	struct list_node list_node;
+	void *library;
+};
 
-		/* skip if file extension is not .so */
-		if (strcmp(get_filename_ext(current_filename), "so") != 0)
-			continue;
+static void
+close_retired(struct tree_library *lib)
+{
+	struct list_node *current, *next;
+	struct retired_library *r;
 
-		/*
-		 * Dynamic load the shared library.
-		 * If it's a valid tree library, set up a
-		 * 'struct tree_library'
-		 */
-		tree_library_load(current_filename, tree_list);
+	list_for_each_safe (current, next, lib->retired.first) {
+		r = container_of(current, struct retired_library, list_node);
+		dlclose(r->library);
+		free(r);
 	}
 
-	closedir(directory);
+	lib->retired.first = NULL;
+}
 
-	return 0;
+/* the last tree of lib is freed: close the old builds */
+void
+tree_library_put(struct tree_library *lib)
+{
+	if (--lib->users == 0)
+		close_retired(lib);
 }
 
 /*
- * Tree information
- * ================
+ * 1 if trees of a can be used with b: the same sizes, offsets,
+ * capabilities and key type
  */
-
-void
-tree_info_setup(struct tree_info *info, struct tree_operations *ops)
+static int
+same_layout(struct tree_operations *a, struct tree_operations *b)
 {
-	/* get sizes */
-	info->root_size = ops->get_root_size();
-	info->element_size = ops->get_element_size();
+	struct tree_info ia, ib;
 
-	/* get offsets */
-	info->root_node_offset = ops->get_root_node_offset();
-	info->left_child_offset = ops->get_left_offset();
-	info->right_child_offset = ops->get_right_offset();
-	info->node_offset_in_element = ops->get_node_offset_in_element();
-	info->key_offset_in_element = ops->get_key_offset_in_element();
+	tree_info_setup(&ia, a);
+	tree_info_setup(&ib, b);
 
-	/* include a pointer to tree operations inside tree_info */
-	info->ops = ops;
+	return a->capabilities == b->capabilities &&
+	       ia.root_size == ib.root_size &&
+	       ia.element_size == ib.element_size &&
+	       ia.root_node_offset == ib.root_node_offset &&
+	       ia.left_child_offset == ib.left_child_offset &&
+	       ia.right_child_offset == ib.right_child_offset &&
+	       ia.node_offset_in_element == ib.node_offset_in_element &&
+	       ia.key_offset_in_element == ib.key_offset_in_element &&
+	       ia.key.type == ib.key.type &&
+	       ia.key.size == ib.key.size &&
+	       ia.key.prefix_len == ib.key.prefix_len;
 }
 
 /*
- * Tree memory
- * ===========
+ * dlopen() a private copy of path. The dynamic linker returns
+ * the handle already loaded for a path (even if the file was
+ * replaced), so the new file is opened under another name
  */
-
-void
-tree_memory_free(struct tree_memory *m)
+static void*
+open_copy(const char *path)
 {
-	free(m->addr);
-}
+	char copy[] = "/tmp/tree_library_XXXXXX.so";
+	char buffer[4096];
+	void *library = NULL;
+	ssize_t len;
+	int in, out;
 
-void
-tree_memory_allocate(struct tree_memory *m, struct tree_info *i,
-                     unsigned int size)
-{
-	/* allocate memory to root pointer and tree elements */
-	m->addr = malloc(i->root_size + i->element_size * size);
-	m->root = m->addr;
-	m->array = m->addr + i->root_size;
-}
+	in = open(path, O_RDONLY);
+	if (in == -1)
+		return NULL;
 
-void
-tree_fill_in_order(struct tree_memory *m, struct tree_info *i,
-                   unsigned long current)
-{
-	unsigned long *tmp;
+	out = mkstemps(copy, 3);
+	if (out == -1)
+		goto _go_close_in;
 
-	/* set array in-order */
-	while (current--) {
-		tmp = m->array + current * i->element_size +
-		      i->key_offset_in_element;
-		*tmp = current;
+	while ((len = read(in, buffer, sizeof(buffer))) > 0) {
+		if (write(out, buffer, len) != len) {
+			len = -1;
+			break;
+		}
 	}
+
+	if (len == 0)
+		library = dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+
+	/* the mapping stays valid after the file is removed */
+	unlink(copy);
+	close(out);
+_go_close_in:
+	close(in);
+
+	return library;
 }
 
-void
-tree_randomize(struct tree_memory *m, struct tree_info *i,
-               unsigned long current)
+/*
+ * Load again the file lib was loaded from (e.g. a new build)
+ * and switch lib to it.
+ *
+ * Trees in use (see tree_library_get()) are migrated when the
+ * new build has the same layout (same_layout()): their memory
+ * stays valid and the new operations are used from now on.
+ * Otherwise they must be drained (freed) first and -1 is
+ * returned. The old build stays loaded until the last tree is
+ * put, as their struct tree_info may point to it (the key
+ * compare function): call tree_info_setup() again to use the
+ * new one.
+ *
+ * NOTE: no operation of lib may be running during the reload.
+ */
+int
+tree_library_reload(struct tree_library *lib)
 {
-	unsigned long *a, *b;
-	unsigned long elements = current;
-	unsigned long tmp, random_idx;
+	struct retired_library *r = NULL;
+	struct tree_operations ops;
+	struct link_map *map;
+	void *library;
 
-	/* shuffle array */
-	while (current--) {
-		/* exchange values between 'a' and 'b' */
+	/* full path of the loaded file */
+	if (dlinfo(lib->library, RTLD_DI_LINKMAP, &map) == -1)
+		return -1;
 
-		/* define the pointers */
-		a = m->array + current * i->element_size +
-		    i->key_offset_in_element;
-		random_idx = random() % elements;
-		b = m->array + random_idx * i->element_size +
-		    i->key_offset_in_element;
+	library = open_copy(map->l_name);
+	if (library == NULL)
+		return -1;
 
-		/* exchange values */
-		tmp = *a;
-		*a = *b;
-		*b = tmp;
+	if (get_operations(library, &ops) == -1)
+		goto _go_close_library;
+
+	if (lib->users) {
+		if (!same_layout(&lib->ops, &ops))
+			goto _go_close_library;
+		r = malloc(sizeof(*r));
+		if (r == NULL)
+			goto _go_close_library;
+	}
+
+	/* trees point to lib->ops, they see the new operations */
+	lib->ops = ops;
+	if (r) {
+		r->library = lib->library;
+		list_add(&r->list_node, &lib->retired);
+	} else {
+		dlclose(lib->library);
+	}
+	lib->library = library;
+
+	return 0;
+
+_go_close_library:
+	dlclose(library);
+
+	return -1;
+}
+
+void
+tree_manager_unload_trees(struct list_head *tree_list)
+{
+	struct list_node *current;
+	struct list_node *next;
+
+	list_for_each_safe (current, next, tree_list->first) {
+		struct tree_library *tmp;
+
+		tmp = container_of(current, struct tree_library, list_node);
+
+		close_retired(tmp);
+		dlclose(tmp->library);
+		free(tmp->name);
+		free(tmp);
+	}
+}
+
+/*
+ * Manifest
+ *
+ * A text file with a line per library file seen before:
+ *   <mtime sec> <mtime nsec> <size> <hash> <valid> <path>
+ *
+ * The path is the rest of the line, so it may have spaces. A
+ * file with the same mtime and size, or else the same hash
+ * (FNV-1a of the content), is not checked again. Files that
+ * are not valid tree libraries are not even opened.
+ *
+ * Unchanged tree libraries are still opened and their
+ * operations checked: dlopen() is needed for the operations
+ * anyway, and the checks take a small part of the time of
+ * dlopen() (see performance_test -l). The variant loaded may
+ * also be another file than the one in the manifest.
+ */
+
+struct manifest_entry {
+	struct list_node list_node;
+	char *path;
+	long mtime_sec;
+	long mtime_nsec;
+	long size;
+	unsigned long long hash;
+	int valid;
+};
+
+static void
+manifest_free(struct list_head *manifest)
+{
+	struct list_node *current, *next;
+
+	list_for_each_safe (current, next, manifest->first) {
+		struct manifest_entry *tmp;
+
+		tmp = container_of(current, struct manifest_entry, list_node);
+		free(tmp->path);
+		free(tmp);
+	}
+	manifest->first = NULL;
+}
+
+static void
+manifest_read(const char *filename, struct list_head *manifest)
+{
+	struct manifest_entry *new;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *file;
+	int path;
+
+	file = fopen(filename, "r");
+	if (file == NULL)
+		return;
+
+	while ((len = getline(&line, &size, file)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		new = malloc(sizeof(*new));
+		if (new == NULL)
+			break;
+
+		/* the path starts after the last number */
+		if (sscanf(line, "%ld %ld %ld %llx %d %n", &new->mtime_sec,
+		           &new->mtime_nsec, &new->size, &new->hash,
+		           &new->valid, &path) != 5 || line[path] == '\0') {
+			free(new);
+			continue;
+		}
+
+		new->path = strdup(line + path);
+		if (new->path == NULL) {
+			free(new);
+			break;
+		}
+		list_add(&new->list_node, manifest);
+	}
+
+	free(line);
+	fclose(file);
+}
+
+static void
+manifest_write(const char *filename, struct list_head *manifest)
+{
+	struct list_node *current;
+	FILE *file;
+
+	file = fopen(filename, "w");
+	if (file == NULL)
+		return;
+
+	list_for_each (current, manifest->first) {
+		struct manifest_entry *tmp;
+
+		tmp = container_of(current, struct manifest_entry, list_node);
+		fprintf(file, "%ld %ld %ld %llx %d %s\n", tmp->mtime_sec,
+		        tmp->mtime_nsec, tmp->size, tmp->hash, tmp->valid,
+		        tmp->path);
+	}
+
+	fclose(file);
+}
+
+static struct manifest_entry*
+manifest_find(struct list_head *manifest, const char *path)
+{
+	struct list_node *current;
+
+	list_for_each (current, manifest->first) {
+		struct manifest_entry *tmp;
+
+		tmp = container_of(current, struct manifest_entry, list_node);
+		if (strcmp(tmp->path, path) == 0)
+			return tmp;
+	}
+
+	return NULL;
+}
+
+/* FNV-1a of the file content */
+static int
+file_hash(const char *path, unsigned long long *hash)
+{
+	unsigned char buffer[65536];
+	ssize_t len, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	*hash = 14695981039346656037ULL;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (i = 0; i < len; i++) {
+			*hash ^= buffer[i];
+			*hash *= 1099511628211ULL;
+		}
+	}
+
+	close(fd);
+
+	return len;
+}
+
+/*
+ * return the manifest entry of path, updated to the current
+ * file, in *entry. Return 1 if the file didn't change since
+ * the entry was written, 0 otherwise
+ */
+static int
+manifest_check(struct list_head *manifest, const char *path,
+               struct manifest_entry **entry)
+{
+	struct manifest_entry *tmp;
+	unsigned long long hash;
+	struct stat st;
+	int unchanged;
+
+	*entry = NULL;
+
+	if (stat(path, &st) == -1)
+		return 0;
+
+	tmp = manifest_find(manifest, path);
+	if (tmp && tmp->mtime_sec == st.st_mtim.tv_sec &&
+	    tmp->mtime_nsec == st.st_mtim.tv_nsec &&
+	    tmp->size == st.st_size) {
+		*entry = tmp;
+		return 1;
+	}
+
+	if (file_hash(path, &hash) == -1)
+		return 0;
+
+	/* touched but not changed */
+	unchanged = tmp && tmp->hash == hash;
+
+	if (tmp == NULL) {
+		tmp = calloc(1, sizeof(*tmp));
+		if (tmp == NULL)
+			return 0;
+		tmp->path = strdup(path);
+		list_add(&tmp->list_node, manifest);
+	}
+
+	*entry = tmp;
+	tmp->mtime_sec = st.st_mtim.tv_sec;
+	tmp->mtime_nsec = st.st_mtim.tv_nsec;
+	tmp->size = st.st_size;
+	tmp->hash = hash;
+
+	return unchanged;
+}
+
+/* 1 if a library with the same file name is in tree_list */
+static int
+is_loaded(struct list_head *tree_list, const char *filename)
+{
+	struct list_node *current;
+	const char *name;
+
+	list_for_each (current, tree_list->first) {
+		struct tree_library *tmp;
+
+		tmp = container_of(current, struct tree_library, list_node);
+		name = strrchr(tmp->name, '/');
+		name = name ? name + 1 : tmp->name;
+		if (strcmp(name, filename) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * load trees of one directory. dir "." is special: libraries
+ * are loaded by their file name only, as before
+ */
+static void
+load_directory(const char *dir, size_t dir_len,
+               struct tree_load_options *options,
+               struct list_head *manifest, int *manifest_dirty,
+               struct list_head *tree_list, struct tree_load_stats *stats)
+{
+	DIR *directory;
+	struct dirent *current_file;
+	char *current_filename;
+	char path[PATH_MAX];
+	struct manifest_entry *entry;
+	struct timespec start, stop;
+	struct tree_library *lib;
+	int unchanged;
+
+	snprintf(path, sizeof(path), "%.*s", (int) dir_len, dir);
+	directory = opendir(dir_len ? path : ".");
+	if (directory == NULL)
+		return;
+
+	/* for each file in directory */
+	while (current_file = readdir(directory)) {
+		current_filename = current_file->d_name;
+
+		/* skip current and parent entries */
+		if (strcmp(current_filename, ".") == 0
+		    || strcmp(current_filename, "..") == 0)
+			continue;
+
+		/* skip if file extension is not .so */
+		if (strcmp(get_filename_ext(current_filename), "so") != 0)
+			continue;
+
+		/* variants are loaded through their baseline library */
+		if (get_filename_isa(current_filename))
+			continue;
+
+		if (options->filter &&
+		    fnmatch(options->filter, current_filename, 0) != 0)
+			continue;
+
+		/* the first directory in path has priority */
+		if (is_loaded(tree_list, current_filename))
+			continue;
+
+		if (dir_len == 0 || (dir_len == 1 && dir[0] == '.'))
+			snprintf(path, sizeof(path), "%s", current_filename);
+		else
+			snprintf(path, sizeof(path), "%.*s/%s", (int) dir_len,
+			         dir, current_filename);
+
+		stats->n_files++;
+
+		entry = NULL;
+		unchanged = 0;
+		if (options->manifest) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			unchanged = manifest_check(manifest, path, &entry);
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+			stats->manifest += elapsed_time(&start, &stop);
+
+			/* known not to be a tree library */
+			if (unchanged && !entry->valid) {
+				stats->n_cached++;
+				continue;
+			}
+		}
+
+		/*
+		 * Dynamic load the shared library.
+		 * If it's a valid tree library, set up a
+		 * 'struct tree_library'
+		 */
+		lib = __tree_library_load(path, NULL, options->lazy ?
+		                          RTLD_LAZY | RTLD_LOCAL :
+		                          RTLD_NOW | RTLD_LOCAL,
+		                          tree_list, stats);
+		if (lib)
+			stats->n_loaded++;
+
+		if (entry && (!unchanged || entry->valid != !!lib)) {
+			entry->valid = !!lib;
+			*manifest_dirty = 1;
+		}
+	}
+
+	closedir(directory);
+}
+
+/*
+ * dynamic load all trees in the directories of options->path
+ *
+ * It simply calls tree_library_load() for each .so file whose
+ * name matches options->filter.
+ *     so = shared object, because it may be shared between
+ *     multiple programs :-)
+ *
+ * stats may be NULL.
+ */
+int
+tree_manager_load_trees_with(struct list_head *tree_list,
+                             struct tree_load_options *options,
+                             struct tree_load_stats *stats)
+{
+	struct list_head manifest = LIST_HEAD_INIT;
+	struct tree_load_stats dummy;
+	struct timespec start, stop;
+	const char *dir, *end;
+	int manifest_dirty = 0;
+
+	if (stats == NULL)
+		stats = &dummy;
+	memset(stats, 0, sizeof(*stats));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (options->manifest)
+		manifest_read(options->manifest, &manifest);
+
+	/* for each directory in path */
+	dir = options->path ? options->path : ".";
+	for (;;) {
+		end = strchr(dir, ':');
+		if (end == NULL)
+			end = dir + strlen(dir);
+
+		load_directory(dir, end - dir, options, &manifest,
+		               &manifest_dirty, tree_list, stats);
+
+		if (*end == '\0')
+			break;
+		dir = end + 1;
+	}
+
+	if (options->manifest) {
+		if (manifest_dirty)
+			manifest_write(options->manifest, &manifest);
+		manifest_free(&manifest);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	/* the rest is reading directories */
+	stats->total = elapsed_time(&start, &stop);
+	stats->scan = stats->total - stats->manifest - stats->open -
+	              stats->validate;
+
+	return 0;
+}
+
+/*
+ * dynamic load all trees in the directories of TREE_PATH
+ * (colon separated) or, if not set, the current working
+ * directory
+ */
+int
+tree_manager_load_trees(struct list_head *tree_list)
+{
+	struct tree_load_options options = {
+		.path = getenv("TREE_PATH"),
+	};
+
+	return tree_manager_load_trees_with(tree_list, &options, NULL);
+}
+
+/*
+ * Tree information
+ * ================
+ */
+
+static const struct tree_walk*
+find_walk(struct tree_info *info);
+
+static const struct tree_walk*
+get_walk(struct tree_info *t);
+
+void
+tree_info_setup(struct tree_info *info, struct tree_operations *ops)
+{
+	/* get sizes */
+	info->root_size = ops->get_root_size();
+	info->element_size = ops->get_element_size();
+
+	/* get offsets */
+	info->root_node_offset = ops->get_root_node_offset();
+	info->left_child_offset = ops->get_left_offset();
+	info->right_child_offset = ops->get_right_offset();
+	info->node_offset_in_element = ops->get_node_offset_in_element();
+	info->key_offset_in_element = ops->get_key_offset_in_element();
+
+	/* get key type */
+	if (ops->capabilities & TREE_CAP_KEY_TYPE) {
+		ops->get_key_info(&info->key);
+	} else {
+		info->key.type = TREE_KEY_ULONG;
+		info->key.size = sizeof(unsigned long);
+		info->key.prefix_len = 0;
+		info->key.compare = NULL;
+	}
+
+	/* include a pointer to tree operations inside tree_info */
+	info->ops = ops;
+
+	info->walk = find_walk(info);
+}
+
+/*
+ * Keys
+ *
+ * a and b point to keys like the ones in the elements of the
+ * tree (see struct tree_key_info)
+ */
+
+static int
+compare_var_key(const struct tree_var_key *a, const struct tree_var_key *b)
+{
+	size_t len = a->len < b->len ? a->len : b->len;
+	int ret;
+
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+
+	ret = memcmp(a->data, b->data, len);
+	if (ret)
+		return ret;
+
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+int
+tree_key_compare(struct tree_info *t, const void *a, const void *b)
+{
+	unsigned long key_a, key_b;
+
+	if (t->key.compare)
+		return t->key.compare(a, b);
+
+	switch (t->key.type) {
+	case TREE_KEY_BYTES:
+		return memcmp(a, b, t->key.size);
+	case TREE_KEY_VAR:
+		return compare_var_key(a, b);
+	default: /* TREE_KEY_ULONG */
+		key_a = *(unsigned long*) a;
+		key_b = *(unsigned long*) b;
+		return (key_a > key_b) - (key_a < key_b);
+	}
+}
+
+/* set a variable-length key, and its prefix if the tree uses it */
+void
+tree_var_key_set(struct tree_info *t, struct tree_var_key *key,
+                 const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+	size_t i;
+
+	key->data = data;
+	key->len = len;
+	key->prefix = 0;
+
+	if (t->key.prefix_len == 0)
+		return;
+
+	for (i = 0; i < t->key.prefix_len; i++) {
+		key->prefix <<= 8;
+		if (i < len)
+			key->prefix |= bytes[i];
+	}
+	key->prefix <<= 8 * (sizeof(key->prefix) - t->key.prefix_len);
+}
+
+void*
+tree_search(struct tree_info *t, void *root, unsigned long key)
+{
+	if (tree_has_capability(t, TREE_CAP_NON_BINARY))
+		return t->ops->search(root, key);
+
+	return get_walk(t)->search(t, root, key);
+}
+
+/*
+ * Tree kernels
+ * ============
+ *
+ * Bulk operations over keys and nodes. Keys live at a fixed
+ * stride (element_size) in the tree memory, and nodes of a
+ * tree level are scattered anywhere, so both are gathers or
+ * scatters in SIMD terms.
+ *
+ * Every kernel has a scalar version and, on x86-64, AVX2 and
+ * AVX-512 versions. The best level supported by the running
+ * CPU is chosen the first time a kernel is used. Note AVX2 has
+ * no scatter instruction, so its stores are scalar.
+ */
+
+#if defined(__x86_64__)
+#define HAVE_X86_SIMD
+#endif
+
+struct tree_kernels {
+	void (*fill_keys)(void *base, unsigned int stride,
+	                  unsigned long n);
+	void (*scatter_keys)(void *base, unsigned int stride,
+	                     const unsigned long *src, unsigned long n);
+	void (*copy_keys)(void *dst, unsigned int dst_stride,
+	                  const void *src, unsigned int src_stride,
+	                  unsigned long n);
+	void (*node_keys)(unsigned long *keys, void **nodes, long delta,
+	                  unsigned long n);
+	void (*node_children)(void **children, void **nodes,
+	                      unsigned int left, unsigned int right,
+	                      unsigned long n);
+	unsigned long (*keys_mismatch)(const unsigned long *a,
+	                               const unsigned long *b,
+	                               unsigned long n);
+	long (*frontier_compact)(void **a, void **b, unsigned long n);
+};
+
+#define key_at(base, stride, idx) \
+	*( (unsigned long*) ( (void*) (base) + (idx) * (stride)))
+
+static void
+scalar_fill_keys(void *base, unsigned int stride, unsigned long n)
+{
+	while (n--)
+		key_at(base, stride, n) = n;
+}
+
+static void
+scalar_scatter_keys(void *base, unsigned int stride,
+                    const unsigned long *src, unsigned long n)
+{
+	while (n--)
+		key_at(base, stride, n) = src[n];
+}
+
+static void
+scalar_copy_keys(void *dst, unsigned int dst_stride,
+                 const void *src, unsigned int src_stride, unsigned long n)
+{
+	while (n--)
+		key_at(dst, dst_stride, n) = key_at(src, src_stride, n);
+}
+
+static void
+scalar_node_keys(unsigned long *keys, void **nodes, long delta,
+                 unsigned long n)
+{
+	while (n--)
+		keys[n] = *(unsigned long*) (nodes[n] + delta);
+}
+
+static void
+scalar_node_children(void **children, void **nodes,
+                     unsigned int left, unsigned int right, unsigned long n)
+{
+	while (n--) {
+		children[2 * n] = *(void**) (nodes[n] + left);
+		children[2 * n + 1] = *(void**) (nodes[n] + right);
+	}
+}
+
+static unsigned long
+scalar_keys_mismatch(const unsigned long *a, const unsigned long *b,
+                     unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		if (a[i] != b[i])
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * drop NULL entries from a and b keeping the order. It's an
+ * error (-1) if a NULL in one array has a non-NULL in the
+ * other, i.e. the trees have different shapes
+ */
+static long
+scalar_frontier_compact(void **a, void **b, unsigned long n)
+{
+	unsigned long i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!a[i] != !b[i])
+			return -1;
+		if (!a[i])
+			continue;
+		a[count] = a[i];
+		b[count++] = b[i];
+	}
+
+	return count;
+}
+
+static const struct tree_kernels scalar_kernels = {
+	.fill_keys = scalar_fill_keys,
+	.scatter_keys = scalar_scatter_keys,
+	.copy_keys = scalar_copy_keys,
+	.node_keys = scalar_node_keys,
+	.node_children = scalar_node_children,
+	.keys_mismatch = scalar_keys_mismatch,
+	.frontier_compact = scalar_frontier_compact,
+};
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * AVX2
+ */
+
+__attribute__((target("avx2"))) static void
+avx2_copy_keys(void *dst, unsigned int dst_stride,
+               const void *src, unsigned int src_stride, unsigned long n)
+{
+	const __m256i step = _mm256_set1_epi64x(4L * src_stride);
+	__m256i idx = _mm256_setr_epi64x(0, src_stride,
+	                                 2L * src_stride, 3L * src_stride);
+	unsigned long i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_i64gather_epi64(src, idx, 1);
+
+		/* no scatter in AVX2 */
+		key_at(dst, dst_stride, i) = _mm256_extract_epi64(v, 0);
+		key_at(dst, dst_stride, i + 1) = _mm256_extract_epi64(v, 1);
+		key_at(dst, dst_stride, i + 2) = _mm256_extract_epi64(v, 2);
+		key_at(dst, dst_stride, i + 3) = _mm256_extract_epi64(v, 3);
+		idx = _mm256_add_epi64(idx, step);
+	}
+
+	for (; i < n; i++)
+		key_at(dst, dst_stride, i) = key_at(src, src_stride, i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_node_keys(unsigned long *keys, void **nodes, long delta,
+               unsigned long n)
+{
+	const __m256i vdelta = _mm256_set1_epi64x(delta);
+	unsigned long i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i ptr = _mm256_loadu_si256((void*) (nodes + i));
+
+		ptr = _mm256_add_epi64(ptr, vdelta);
+		_mm256_storeu_si256((void*) (keys + i),
+		                    _mm256_i64gather_epi64(NULL, ptr, 1));
+	}
+
+	for (; i < n; i++)
+		keys[i] = *(unsigned long*) (nodes[i] + delta);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_node_children(void **children, void **nodes,
+                   unsigned int left, unsigned int right, unsigned long n)
+{
+	const __m256i vleft = _mm256_set1_epi64x(left);
+	const __m256i vright = _mm256_set1_epi64x(right);
+	unsigned long i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i ptr = _mm256_loadu_si256((void*) (nodes + i));
+		__m256i l, r, lo, hi;
+
+		l = _mm256_i64gather_epi64(NULL, _mm256_add_epi64(ptr, vleft),
+		                           1);
+		r = _mm256_i64gather_epi64(NULL, _mm256_add_epi64(ptr, vright),
+		                           1);
+
+		/* interleave: l0 r0 l1 r1 | l2 r2 l3 r3 */
+		lo = _mm256_unpacklo_epi64(l, r); /* l0 r0 l2 r2 */
+		hi = _mm256_unpackhi_epi64(l, r); /* l1 r1 l3 r3 */
+		_mm256_storeu_si256((void*) (children + 2 * i),
+		                    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((void*) (children + 2 * i + 4),
+		                    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	for (; i < n; i++) {
+		children[2 * i] = *(void**) (nodes[i] + left);
+		children[2 * i + 1] = *(void**) (nodes[i] + right);
+	}
+}
+
+__attribute__((target("avx2"))) static unsigned long
+avx2_keys_mismatch(const unsigned long *a, const unsigned long *b,
+                   unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i va = _mm256_loadu_si256((void*) (a + i));
+		__m256i vb = _mm256_loadu_si256((void*) (b + i));
+		int eq = _mm256_movemask_pd(
+		         _mm256_castsi256_pd(_mm256_cmpeq_epi64(va, vb)));
+
+		if (eq != 0xf)
+			return i + __builtin_ctz(~eq);
+	}
+
+	return i + scalar_keys_mismatch(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static long
+avx2_frontier_compact(void **a, void **b, unsigned long n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned long i, count = 0;
+	long tail;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i va = _mm256_loadu_si256((void*) (a + i));
+		__m256i vb = _mm256_loadu_si256((void*) (b + i));
+		int null_a = _mm256_movemask_pd(
+		             _mm256_castsi256_pd(_mm256_cmpeq_epi64(va, zero)));
+		int null_b = _mm256_movemask_pd(
+		             _mm256_castsi256_pd(_mm256_cmpeq_epi64(vb, zero)));
+		int live = ~null_a & 0xf;
+		unsigned int lane;
+
+		if (null_a != null_b)
+			return -1;
+
+		/* no compress in AVX2 */
+		while (live) {
+			lane = __builtin_ctz(live);
+			live &= live - 1;
+			a[count] = a[i + lane];
+			b[count++] = b[i + lane];
+		}
+	}
+
+	tail = scalar_frontier_compact(a + i, b + i, n - i);
+	if (tail < 0)
+		return -1;
+	memmove(a + count, a + i, tail * sizeof(*a));
+	memmove(b + count, b + i, tail * sizeof(*b));
+
+	return count + tail;
+}
+
+static const struct tree_kernels avx2_kernels = {
+	.fill_keys = scalar_fill_keys,
+	.scatter_keys = scalar_scatter_keys,
+	.copy_keys = avx2_copy_keys,
+	.node_keys = avx2_node_keys,
+	.node_children = avx2_node_children,
+	.keys_mismatch = avx2_keys_mismatch,
+	.frontier_compact = avx2_frontier_compact,
+};
+
+/*
+ * AVX-512
+ */
+
+/* mask with the lowest n lanes set (n < 8) */
+#define tail_mask(n)  ((__mmask8) ((1U << (n)) - 1))
+
+__attribute__((target("avx512f"))) static void
+avx512_fill_keys(void *base, unsigned int stride, unsigned long n)
+{
+	const __m512i step = _mm512_set1_epi64(8L * stride);
+	const __m512i eight = _mm512_set1_epi64(8);
+	__m512i idx = _mm512_setr_epi64(0, stride, 2L * stride,
+	                                3L * stride, 4L * stride,
+	                                5L * stride, 6L * stride,
+	                                7L * stride);
+	__m512i keys = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+	unsigned long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		_mm512_i64scatter_epi64(base, idx, keys, 1);
+		idx = _mm512_add_epi64(idx, step);
+		keys = _mm512_add_epi64(keys, eight);
+	}
+
+	if (i < n)
+		_mm512_mask_i64scatter_epi64(base, tail_mask(n - i),
+		                             idx, keys, 1);
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_scatter_keys(void *base, unsigned int stride,
+                    const unsigned long *src, unsigned long n)
+{
+	const __m512i step = _mm512_set1_epi64(8L * stride);
+	__m512i idx = _mm512_setr_epi64(0, stride, 2L * stride,
+	                                3L * stride, 4L * stride,
+	                                5L * stride, 6L * stride,
+	                                7L * stride);
+	unsigned long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		_mm512_i64scatter_epi64(base, idx,
+		                        _mm512_loadu_si512(src + i), 1);
+		idx = _mm512_add_epi64(idx, step);
+	}
+
+	if (i < n) {
+		__mmask8 mask = tail_mask(n - i);
+
+		_mm512_mask_i64scatter_epi64(base, mask, idx,
+		        _mm512_maskz_loadu_epi64(mask, src + i), 1);
+	}
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_copy_keys(void *dst, unsigned int dst_stride,
+                 const void *src, unsigned int src_stride, unsigned long n)
+{
+	const __m512i dst_step = _mm512_set1_epi64(8L * dst_stride);
+	const __m512i src_step = _mm512_set1_epi64(8L * src_stride);
+	const __m512i lane = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+	__m512i dst_idx = _mm512_mullox_epi64(lane,
+	                                      _mm512_set1_epi64(dst_stride));
+	__m512i src_idx = _mm512_mullox_epi64(lane,
+	                                      _mm512_set1_epi64(src_stride));
+	unsigned long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		_mm512_i64scatter_epi64(dst, dst_idx,
+		        _mm512_i64gather_epi64(src_idx, src, 1), 1);
+		dst_idx = _mm512_add_epi64(dst_idx, dst_step);
+		src_idx = _mm512_add_epi64(src_idx, src_step);
+	}
+
+	if (i < n) {
+		__mmask8 mask = tail_mask(n - i);
+		__m512i v;
+
+		v = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), mask,
+		                                src_idx, src, 1);
+		_mm512_mask_i64scatter_epi64(dst, mask, dst_idx, v, 1);
+	}
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_node_keys(unsigned long *keys, void **nodes, long delta,
+                 unsigned long n)
+{
+	const __m512i vdelta = _mm512_set1_epi64(delta);
+	unsigned long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m512i ptr = _mm512_loadu_si512(nodes + i);
+
+		ptr = _mm512_add_epi64(ptr, vdelta);
+		_mm512_storeu_si512(keys + i,
+		                    _mm512_i64gather_epi64(ptr, NULL, 1));
+	}
+
+	if (i < n) {
+		__mmask8 mask = tail_mask(n - i);
+		__m512i ptr = _mm512_maskz_loadu_epi64(mask, nodes + i);
+
+		ptr = _mm512_add_epi64(ptr, vdelta);
+		_mm512_mask_storeu_epi64(keys + i, mask,
+		        _mm512_mask_i64gather_epi64(_mm512_setzero_si512(),
+		                                    mask, ptr, NULL, 1));
+	}
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_node_children(void **children, void **nodes,
+                     unsigned int left, unsigned int right, unsigned long n)
+{
+	const __m512i vleft = _mm512_set1_epi64(left);
+	const __m512i vright = _mm512_set1_epi64(right);
+	const __m512i perm_lo = _mm512_setr_epi64(0, 8, 1, 9, 2, 10, 3, 11);
+	const __m512i perm_hi = _mm512_setr_epi64(4, 12, 5, 13, 6, 14, 7, 15);
+	unsigned long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m512i ptr = _mm512_loadu_si512(nodes + i);
+		__m512i l, r;
+
+		l = _mm512_i64gather_epi64(_mm512_add_epi64(ptr, vleft),
+		                           NULL, 1);
+		r = _mm512_i64gather_epi64(_mm512_add_epi64(ptr, vright),
+		                           NULL, 1);
+
+		_mm512_storeu_si512(children + 2 * i,
+		                    _mm512_permutex2var_epi64(l, perm_lo, r));
+		_mm512_storeu_si512(children + 2 * i + 8,
+		                    _mm512_permutex2var_epi64(l, perm_hi, r));
+	}
+
+	scalar_node_children(children + 2 * i, nodes + i, left, right, n - i);
+}
+
+__attribute__((target("avx512f"))) static unsigned long
+avx512_keys_mismatch(const unsigned long *a, const unsigned long *b,
+                     unsigned long n)
+{
+	unsigned long i;
+	__mmask8 ne;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		ne = _mm512_cmpneq_epu64_mask(_mm512_loadu_si512(a + i),
+		                              _mm512_loadu_si512(b + i));
+		if (ne)
+			return i + __builtin_ctz(ne);
+	}
+
+	if (i < n) {
+		__mmask8 mask = tail_mask(n - i);
+
+		ne = _mm512_mask_cmpneq_epu64_mask(mask,
+		             _mm512_maskz_loadu_epi64(mask, a + i),
+		             _mm512_maskz_loadu_epi64(mask, b + i));
+		if (ne)
+			return i + __builtin_ctz(ne);
+	}
+
+	return n;
+}
+
+__attribute__((target("avx512f"))) static long
+avx512_frontier_compact(void **a, void **b, unsigned long n)
+{
+	unsigned long i, count = 0;
+	__mmask8 live_a, live_b;
+
+	for (i = 0; i < n; i += 8) {
+		__mmask8 mask = n - i >= 8 ? 0xff : tail_mask(n - i);
+		__m512i va = _mm512_maskz_loadu_epi64(mask, a + i);
+		__m512i vb = _mm512_maskz_loadu_epi64(mask, b + i);
+
+		live_a = _mm512_test_epi64_mask(va, va);
+		live_b = _mm512_test_epi64_mask(vb, vb);
+		if (live_a != live_b)
+			return -1;
+
+		_mm512_mask_compressstoreu_epi64(a + count, live_a, va);
+		_mm512_mask_compressstoreu_epi64(b + count, live_a, vb);
+		count += __builtin_popcount(live_a);
+	}
+
+	return count;
+}
+
+static const struct tree_kernels avx512_kernels = {
+	.fill_keys = avx512_fill_keys,
+	.scatter_keys = avx512_scatter_keys,
+	.copy_keys = avx512_copy_keys,
+	.node_keys = avx512_node_keys,
+	.node_children = avx512_node_children,
+	.keys_mismatch = avx512_keys_mismatch,
+	.frontier_compact = avx512_frontier_compact,
+};
+
+#endif /* HAVE_X86_SIMD */
+
+static const struct tree_kernels *kernels;
+static enum tree_simd_level kernels_level;
+
+static const char *simd_level_names[] = {
+	[TREE_SIMD_SCALAR] = "scalar",
+	[TREE_SIMD_AVX2] = "avx2",
+	[TREE_SIMD_AVX512] = "avx512",
+};
+
+static int
+simd_level_supported(enum tree_simd_level level)
+{
+	switch (level) {
+	case TREE_SIMD_SCALAR:
+		return 1;
+#ifdef HAVE_X86_SIMD
+	case TREE_SIMD_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case TREE_SIMD_AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return 0;
+	}
+}
+
+static const struct tree_kernels*
+get_kernels(void)
+{
+	enum tree_simd_level level = TREE_SIMD_LAST;
+
+	if (kernels)
+		return kernels;
+
+	/* pick the best level the CPU supports */
+	while (!simd_level_supported(--level))
+		;
+	tree_simd_set_level(level);
+
+	return kernels;
+}
+
+/* -1 if the running CPU doesn't support level */
+int
+tree_simd_set_level(enum tree_simd_level level)
+{
+	if (level >= TREE_SIMD_LAST || !simd_level_supported(level))
+		return -1;
+
+	switch (level) {
+#ifdef HAVE_X86_SIMD
+	case TREE_SIMD_AVX2:
+		kernels = &avx2_kernels;
+		break;
+	case TREE_SIMD_AVX512:
+		kernels = &avx512_kernels;
+		break;
+#endif
+	default:
+		kernels = &scalar_kernels;
+	}
+	kernels_level = level;
+
+	return 0;
+}
+
+enum tree_simd_level
+tree_simd_get_level(void)
+{
+	get_kernels();
+
+	return kernels_level;
+}
+
+const char*
+tree_simd_level_name(enum tree_simd_level level)
+{
+	if (level >= TREE_SIMD_LAST)
+		return "unknown";
+
+	return simd_level_names[level];
+}
+
+/* keys[k] = key of nodes[k] */
+void
+tree_nodes_get_keys(struct tree_info *t, void **nodes, unsigned long *keys,
+                    unsigned long n)
+{
+	if (get_kernels() == &scalar_kernels)
+		get_walk(t)->node_keys(t, nodes, keys, n);
+	else
+		kernels->node_keys(keys, nodes,
+		                   (long) t->key_offset_in_element -
+		                   (long) t->node_offset_in_element, n);
+}
+
+/* children[2k] and children[2k+1] = left and right of nodes[k] */
+void
+tree_nodes_get_children(struct tree_info *t, void **nodes, void **children,
+                        unsigned long n)
+{
+	if (get_kernels() == &scalar_kernels)
+		get_walk(t)->node_children(t, nodes, children, n);
+	else
+		kernels->node_children(children, nodes, t->left_child_offset,
+		                       t->right_child_offset, n);
+}
+
+/* index of the first different key or n if all are equal */
+unsigned long
+tree_keys_mismatch(const unsigned long *a, const unsigned long *b,
+                   unsigned long n)
+{
+	return get_kernels()->keys_mismatch(a, b, n);
+}
+
+/*
+ * remove NULL pointers from two node arrays, in place. Return
+ * the new length or -1 if a and b have NULLs in different
+ * positions
+ */
+long
+tree_frontier_compact(void **a, void **b, unsigned long n)
+{
+	return get_kernels()->frontier_compact(a, b, n);
+}
+
+/*
+ * Tree memory
+ * ===========
+ */
+
+void
+tree_memory_free(struct tree_memory *m)
+{
+	free(m->addr);
+	free(m->slots);
+}
+
+void
+tree_memory_allocate(struct tree_memory *m, struct tree_info *i,
+                     unsigned int size)
+{
+	/* the elements start in a cache line (after the root) */
+	unsigned long root_size = (i->root_size + CACHE_LINE_SIZE - 1) &
+	                          ~(CACHE_LINE_SIZE - 1UL);
+	unsigned long total = (root_size + i->element_size * size +
+	                       CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1UL);
+
+	/* allocate memory to root pointer and tree elements */
+	m->addr = aligned_alloc(CACHE_LINE_SIZE, total);
+	m->root = m->addr;
+	m->array = m->addr + root_size;
+	m->size = size;
+	m->slots = NULL;
+}
+
+#define element_key(m, i, idx) \
+	((unsigned long*) (tree_memory_element(m, i, idx) + \
+	                   (i)->key_offset_in_element))
+
+/*
+ * The kernels work on elements in their slots. With a placement
+ * (slots), keys are set one by one
+ */
+
+void
+tree_fill_in_order(struct tree_memory *m, struct tree_info *i,
+                   unsigned long current)
+{
+	unsigned long idx;
+
+	if (m->slots) {
+		for (idx = 0; idx < current; idx++)
+			*element_key(m, i, idx) = idx;
+		return;
+	}
+
+	/* set array in-order */
+	get_kernels()->fill_keys(m->array + i->key_offset_in_element,
+	                         i->element_size, current);
+}
+
+void
+tree_randomize(struct tree_memory *m, struct tree_info *i,
+               unsigned long current)
+{
+	unsigned long *a, *b;
+	unsigned long elements = current;
+	unsigned long tmp, random_idx;
+
+	/* shuffle array */
+	while (current--) {
+		/* exchange values between 'a' and 'b' */
+
+		/* define the pointers */
+		a = element_key(m, i, current);
+		random_idx = random() % elements;
+		b = element_key(m, i, random_idx);
+
+		/* exchange values */
+		tmp = *a;
+		*a = *b;
+		*b = tmp;
 	}
 }
 
@@ -301,30 +1860,1387 @@ tree_copy_keys(struct tree_memory *dst_mem,
                struct tree_info *src_info,
                unsigned long current)
 {
-	unsigned long *dst, *src;
+	unsigned long idx;
+
+	if (dst_mem->slots || src_mem->slots) {
+		for (idx = 0; idx < current; idx++) {
+			*element_key(dst_mem, dst_info, idx) =
+			*element_key(src_mem, src_info, idx);
+		}
+		return;
+	}
+
+	get_kernels()->copy_keys(dst_mem->array +
+	                         dst_info->key_offset_in_element,
+	                         dst_info->element_size,
+	                         src_mem->array +
+	                         src_info->key_offset_in_element,
+	                         src_info->element_size, current);
+}
+
+void
+tree_assign_keys(struct tree_memory *m, struct tree_info *i,
+                 unsigned long *key_array, unsigned long current)
+{
+	unsigned long idx;
+
+	if (m->slots) {
+		for (idx = 0; idx < current; idx++)
+			*element_key(m, i, idx) = key_array[idx];
+		return;
+	}
+
+	get_kernels()->scatter_keys(m->array + i->key_offset_in_element,
+	                            i->element_size, key_array, current);
+}
+
+/* shuffle n slots */
+static void
+shuffle_slots(unsigned long *slots, unsigned long n)
+{
+	unsigned long tmp, random_idx;
+
+	while (n > 1) {
+		random_idx = random() % n--;
+
+		tmp = slots[n];
+		slots[n] = slots[random_idx];
+		slots[random_idx] = tmp;
+	}
+}
+
+int
+tree_memory_place(struct tree_memory *m, struct tree_info *i,
+                  enum tree_placement placement)
+{
+	unsigned long *slots, *runs, *order, n_runs = 0, run, idx, slot, end;
+	void *copy;
+
+	if (m->size == 0)
+		return 0;
+
+	slots = malloc(m->size * sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+
+	if (placement != TREE_PLACE_FRAGMENTED) {
+		for (idx = 0; idx < m->size; idx++)
+			slots[idx] = idx;
+		if (placement == TREE_PLACE_SHUFFLED)
+			shuffle_slots(slots, m->size);
+		goto _go_move;
+	}
+
+	/* start of each run, and the runs in a random order */
+	runs = malloc(2 * m->size * sizeof(*runs));
+	if (runs == NULL) {
+		free(slots);
+		return -1;
+	}
+	order = runs + m->size;
+
+	for (slot = 0; slot < m->size;
+	     slot += 1 + random() % TREE_PLACE_MAX_RUN) {
+		order[n_runs] = n_runs;
+		runs[n_runs++] = slot;
+	}
+	shuffle_slots(order, n_runs);
+
+	for (idx = 0, run = 0; run < n_runs; run++) {
+		end = order[run] + 1 < n_runs ? runs[order[run] + 1] :
+		                                m->size;
+		for (slot = runs[order[run]]; slot < end; slot++)
+			slots[idx++] = slot;
+	}
+
+	free(runs);
+
+_go_move:
+	/* move the elements (and their keys) to their slots */
+	copy = malloc(m->size * i->element_size);
+	if (copy == NULL) {
+		free(slots);
+		return -1;
+	}
+	memcpy(copy, m->array, m->size * i->element_size);
+
+	for (idx = 0; idx < m->size; idx++) {
+		memcpy(m->array + slots[idx] * i->element_size,
+		       copy + (m->slots ? m->slots[idx] : idx) *
+		       i->element_size, i->element_size);
+	}
+
+	free(m->slots);
+	m->slots = placement == TREE_PLACE_SEQUENTIAL ? NULL : slots;
+	if (m->slots == NULL)
+		free(slots);
+
+	free(copy);
+
+	return 0;
+}
+
+/* vEB layout of trees up to this height (it's recursive) */
+#define MAX_VEB_HEIGHT  256
+
+/* nodes of a tree in the order of a layout */
+struct layout {
+	struct tree_info *t;
+	struct tree_memory *m;
+	void **nodes;
+	unsigned long n;
+};
+
+/* slot of the element of node, or -1 if it's not in the memory */
+static long
+node_slot(struct layout *l, void *node)
+{
+	long offset = node - l->t->node_offset_in_element - l->m->array;
+
+	if (offset < 0 || offset % l->t->element_size ||
+	    offset / l->t->element_size >= l->m->size)
+		return -1;
+
+	return offset / l->t->element_size;
+}
+
+/* BFS, checking the nodes are in the memory. Return the height */
+static long
+layout_bfs(struct layout *l)
+{
+	void *node, *children[2];
+	unsigned long k, level_end = 1;
+	long height = 0;
+	int c;
+
+	l->n = 0;
+	node = tree_root_get_node(l->t, l->m->root);
+	if (node == NULL)
+		return 0;
+	if (node_slot(l, node) == -1)
+		return -1;
+	l->nodes[l->n++] = node;
+
+	for (k = 0; k < l->n; k++) {
+		children[0] = tree_node_get_left(l->t, l->nodes[k]);
+		children[1] = tree_node_get_right(l->t, l->nodes[k]);
+
+		for (c = 0; c < 2; c++) {
+			if (children[c] == NULL)
+				continue;
+			/* a node out of the memory, or a cycle */
+			if (node_slot(l, children[c]) == -1 ||
+			    l->n == l->m->size)
+				return -1;
+			l->nodes[l->n++] = children[c];
+		}
+
+		if (k + 1 == level_end) {
+			height++;
+			level_end = l->n;
+		}
+	}
+
+	return height;
+}
+
+/* in-order or pre-order, stack has room for all nodes */
+static void
+layout_dfs(struct layout *l, void **stack, int in_order)
+{
+	void *node = tree_root_get_node(l->t, l->m->root);
+	unsigned long n = 0;
+
+	l->n = 0;
+
+	if (!in_order) {
+		if (node)
+			stack[n++] = node;
+		while (n) {
+			node = stack[--n];
+			l->nodes[l->n++] = node;
+			if (tree_node_get_right(l->t, node))
+				stack[n++] = tree_node_get_right(l->t, node);
+			if (tree_node_get_left(l->t, node))
+				stack[n++] = tree_node_get_left(l->t, node);
+		}
+		return;
+	}
+
+	while (n || node) {
+		if (node) {
+			stack[n++] = node;
+			node = tree_node_get_left(l->t, node);
+			continue;
+		}
+		node = stack[--n];
+		l->nodes[l->n++] = node;
+		node = tree_node_get_right(l->t, node);
+	}
+}
+
+static void
+layout_veb(struct layout *l, void *node, unsigned long height);
+
+/* vEB layout of the subtrees depth levels below node */
+static void
+layout_veb_below(struct layout *l, void *node, unsigned long depth,
+                 unsigned long height)
+{
+	if (node == NULL)
+		return;
+
+	if (depth == 0) {
+		layout_veb(l, node, height);
+		return;
+	}
+
+	layout_veb_below(l, tree_node_get_left(l->t, node), depth - 1,
+	                 height);
+	layout_veb_below(l, tree_node_get_right(l->t, node), depth - 1,
+	                 height);
+}
+
+/* the first height levels of the subtree of node */
+static void
+layout_veb(struct layout *l, void *node, unsigned long height)
+{
+	unsigned long top = height / 2;
+
+	if (node == NULL)
+		return;
+
+	if (height == 1) {
+		l->nodes[l->n++] = node;
+		return;
+	}
+
+	layout_veb(l, node, top);
+	layout_veb_below(l, node, top, height - top);
+}
+
+/* address of node after the element moved to its new slot */
+#define moved_node(l, new_slot, node) \
+	((l)->m->array + (new_slot)[node_slot(l, node)] * \
+	 (l)->t->element_size + (l)->t->node_offset_in_element)
+
+int
+tree_relayout(struct tree_memory *m, struct tree_info *t,
+              enum tree_layout layout)
+{
+	struct layout l = { t, m, NULL, 0 };
+	unsigned long *new_slot, *slots, k, slot, next;
+	void *copy, **stack, *node, *child;
+	size_t size = t->element_size;
+	long height;
+	int ret = -1;
+
+	if (!tree_has_capability(t, TREE_CAP_RELAYOUT) || m->size == 0)
+		return -1;
+
+	l.nodes = malloc(m->size * sizeof(*l.nodes));
+	stack = malloc(m->size * sizeof(*stack));
+	new_slot = malloc(m->size * sizeof(*new_slot));
+	slots = m->slots ? m->slots : malloc(m->size * sizeof(*slots));
+	copy = malloc(m->size * size);
+	if (!l.nodes || !stack || !new_slot || !slots || !copy)
+		goto _go_free;
+
+	height = layout_bfs(&l);
+	if (height == -1)
+		goto _go_free;
+
+	if (layout == TREE_LAYOUT_INORDER || layout == TREE_LAYOUT_PREORDER) {
+		layout_dfs(&l, stack, layout == TREE_LAYOUT_INORDER);
+	} else if (layout == TREE_LAYOUT_VEB) {
+		if (height > MAX_VEB_HEIGHT)
+			goto _go_free;
+		l.n = 0;
+		layout_veb(&l, tree_root_get_node(t, m->root), height);
+	}
+
+	/* new slot of each slot: the nodes in order, then the others */
+	for (slot = 0; slot < m->size; slot++)
+		new_slot[slot] = ULONG_MAX;
+	for (k = 0; k < l.n; k++)
+		new_slot[node_slot(&l, l.nodes[k])] = k;
+	for (slot = 0, next = l.n; slot < m->size; slot++) {
+		if (new_slot[slot] == ULONG_MAX)
+			new_slot[slot] = next++;
+	}
+
+	/* links still point to the old slots, fixed below */
+	memcpy(copy, m->array, m->size * size);
+	for (slot = 0; slot < m->size; slot++)
+		memcpy(m->array + new_slot[slot] * size, copy + slot * size,
+		       size);
+
+	/* node_slot() of old addresses, the array didn't move */
+	node = tree_root_get_node(t, m->root);
+	if (node)
+		tree_root_get_node(t, m->root) = moved_node(&l, new_slot, node);
+
+	for (k = 0; k < l.n; k++) {
+		node = m->array + k * size + t->node_offset_in_element;
+
+		child = tree_node_get_left(t, node);
+		if (child)
+			tree_node_get_left(t, node) =
+				moved_node(&l, new_slot, child);
+
+		child = tree_node_get_right(t, node);
+		if (child)
+			tree_node_get_right(t, node) =
+				moved_node(&l, new_slot, child);
+	}
+
+	if (t->ops->set_parent && l.n) {
+		t->ops->set_parent(tree_root_get_node(t, m->root), NULL);
+
+		for (k = 0; k < l.n; k++) {
+			node = m->array + k * size + t->node_offset_in_element;
+
+			child = tree_node_get_left(t, node);
+			if (child)
+				t->ops->set_parent(child, node);
+			child = tree_node_get_right(t, node);
+			if (child)
+				t->ops->set_parent(child, node);
+		}
+	}
+
+	/* slots of the elements */
+	for (k = 0; k < m->size; k++)
+		slots[k] = new_slot[m->slots ? slots[k] : k];
+	m->slots = slots;
+
+	ret = 0;
+
+_go_free:
+	if (ret == -1 && slots != m->slots)
+		free(slots);
+	free(copy);
+	free(new_slot);
+	free(stack);
+	free(l.nodes);
+
+	return ret;
+}
+
+/*
+ * Tree comparison
+ * ===============
+ */
+
+/* first frontier capacity, it doubles when needed */
+#define FRONTIER_SIZE  1024
+
+/*
+ * a level (frontier) of nodes of each tree, and the
+ * buffers for the next level
+ */
+struct frontier {
+	void **nodes_a, **next_a;
+	void **nodes_b, **next_b;
+	unsigned long *keys_a;
+	unsigned long *keys_b;
+	unsigned long size;
+};
+
+static void
+frontier_free(struct frontier *f)
+{
+	free(f->nodes_a);
+	free(f->next_a);
+	free(f->nodes_b);
+	free(f->next_b);
+	free(f->keys_a);
+	free(f->keys_b);
+}
+
+static int
+__frontier_grow(void **ptr, unsigned long size)
+{
+	void *tmp = realloc(*ptr, size);
+
+	if (tmp == NULL)
+		return -1;
+
+	*ptr = tmp;
+
+	return 0;
+}
+
+/* make room for `size` nodes in every array */
+static int
+frontier_reserve(struct frontier *f, unsigned long size)
+{
+	if (size <= f->size)
+		return 0;
+
+	if (__frontier_grow((void**) &f->nodes_a, size * sizeof(void*)) ||
+	    __frontier_grow((void**) &f->next_a, size * sizeof(void*)) ||
+	    __frontier_grow((void**) &f->nodes_b, size * sizeof(void*)) ||
+	    __frontier_grow((void**) &f->next_b, size * sizeof(void*)) ||
+	    __frontier_grow((void**) &f->keys_a, size * sizeof(long)) ||
+	    __frontier_grow((void**) &f->keys_b, size * sizeof(long)))
+		return -1;
+
+	f->size = size;
+
+	return 0;
+}
+
+/*
+ * Compare both trees level by level (BFS). The whole level
+ * (frontier) of each tree is kept in an array, so keys and
+ * children are loaded with gathers and compared many at a
+ * time by the tree kernels.
+ *
+ * Return 1 if the trees have the same shape and keys, 0 if
+ * not, and -1 on memory allocation error or if the keys are
+ * not unsigned long or a tree isn't binary. stats may be NULL.
+ */
+int /* NOTE: boolean function */
+tree_is_identical(struct tree_info *a, void *_root_a,
+                  struct tree_info *b, void *_root_b,
+                  struct tree_compare_stats *stats)
+{
+	struct frontier f = { NULL, };
+	struct tree_compare_stats dummy;
+	unsigned long n, idx;
+	void **tmp;
+	long next;
+	int ret = 1;
+
+	if (stats == NULL)
+		stats = &dummy;
+	stats->max_frontier = 0;
+	stats->n_checked = 0;
+	stats->key_a = 0;
+	stats->key_b = 0;
+
+	/* the kernels load keys as unsigned long */
+	if (a->key.type != TREE_KEY_ULONG || b->key.type != TREE_KEY_ULONG)
+		return -1;
+
+	if (tree_has_capability(a, TREE_CAP_NON_BINARY) ||
+	    tree_has_capability(b, TREE_CAP_NON_BINARY))
+		return -1;
+
+	if (frontier_reserve(&f, FRONTIER_SIZE) == -1) {
+		ret = -1;
+		goto _go_free_frontier;
+	}
+
+	/* the roots are the first level */
+	f.nodes_a[0] = tree_root_get_node(a, _root_a);
+	f.nodes_b[0] = tree_root_get_node(b, _root_b);
+	next = tree_frontier_compact(f.nodes_a, f.nodes_b, 1);
+
+	/* not identical if one is empty and other is not */
+	if (next == -1)
+		ret = 0;
+
+	while (next > 0) {
+		n = next;
+
+		if (n > stats->max_frontier)
+			stats->max_frontier = n;
+
+		/* compare keys of the whole level */
+		tree_nodes_get_keys(a, f.nodes_a, f.keys_a, n);
+		tree_nodes_get_keys(b, f.nodes_b, f.keys_b, n);
+		idx = tree_keys_mismatch(f.keys_a, f.keys_b, n);
+		stats->n_checked += idx;
+		if (idx != n) {
+			stats->key_a = f.keys_a[idx];
+			stats->key_b = f.keys_b[idx];
+			ret = 0;
+			break;
+		}
+
+		/* the next level has at most 2 * n nodes */
+		if (frontier_reserve(&f, 2 * n) == -1) {
+			ret = -1;
+			break;
+		}
+		tree_nodes_get_children(a, f.nodes_a, f.next_a, n);
+		tree_nodes_get_children(b, f.nodes_b, f.next_b, n);
+
+		/* one child is empty and the corresponding is not */
+		next = tree_frontier_compact(f.next_a, f.next_b, 2 * n);
+		if (next == -1)
+			ret = 0;
+
+		/* next level becomes the current one */
+		tmp = f.nodes_a, f.nodes_a = f.next_a, f.next_a = tmp;
+		tmp = f.nodes_b, f.nodes_b = f.next_b, f.next_b = tmp;
+	}
+
+_go_free_frontier:
+	frontier_free(&f);
+
+	return ret;
+}
+
+/*
+ * Tree validation
+ * ===============
+ */
+
+/* a node in the stack of tree_validate() */
+struct validate_frame {
+	void *node;
+	/* 0: go left, 1: visit and go right, 2: done */
+	int stage;
+	unsigned long left_height;
+	unsigned long right_height;
+};
+
+/*
+ * Check the tree in a post-order walk: keys are in order and,
+ * with TREE_VALIDATE_BALANCE, the balance of every node is the
+ * height of its right subtree minus the left one, from -1 to 1
+ * (AVL trees, not checked in trees with TREE_CAP_NON_AVL).
+ * max_nodes (0 for no limit) stops the walk of a tree with a
+ * cycle.
+ *
+ * Return TREE_VALID, a TREE_INVALID_* error, TREE_UNSUPPORTED
+ * for a tree that isn't binary or whose key isn't unsigned long,
+ * or -1 on memory allocation error. stats may be NULL.
+ */
+int
+tree_validate(struct tree_info *t, void *root, int flags,
+              unsigned long max_nodes, struct tree_validate_stats *stats)
+{
+	struct tree_validate_stats dummy;
 
-	while (current--) {
-		/* define the pointers */
-		dst = dst_mem->array + current * dst_info->element_size +
-		      dst_info->key_offset_in_element;
-		src = src_mem->array + current * src_info->element_size +
-		      src_info->key_offset_in_element;
+	if (stats == NULL)
+		stats = &dummy;
+	memset(stats, 0, sizeof(*stats));
+
+	/* the walks compare unsigned long keys */
+	if (tree_has_capability(t, TREE_CAP_NON_BINARY) ||
+	    t->key.type != TREE_KEY_ULONG)
+		return TREE_UNSUPPORTED;
+
+	if (tree_has_capability(t, TREE_CAP_NON_AVL))
+		flags &= ~TREE_VALIDATE_BALANCE;
+
+	return get_walk(t)->validate(t, root, flags, max_nodes, stats);
+}
+
+const char*
+tree_validate_error(int error)
+{
+	switch (error) {
+	case TREE_VALID:
+		return "valid";
+	case TREE_INVALID_ORDER:
+		return "keys out of order";
+	case TREE_INVALID_BALANCE:
+		return "wrong balance factor";
+	case TREE_INVALID_SIZE:
+		return "too many nodes";
+	case TREE_UNSUPPORTED:
+		return "not a binary tree of unsigned long keys";
+	}
+
+	return "out of memory";
+}
+
+/*
+ * Tree walks
+ * ==========
+ *
+ * tree_search(), tree_validate() and the scalar kernels of
+ * tree_is_identical() load the children and the key of every
+ * node at offsets read from struct tree_info, which the
+ * compiler can't fold. Each walk is written once below as an
+ * inline function of the offsets and compiled for the layouts
+ * of the known trees with constant offsets, and for any layout
+ * with the offsets of tree_info (the generic walk).
+ * tree_info_setup() picks the walk of the layout of a tree, or
+ * the generic one.
+ */
+
+#define walk_left(node, left) \
+	*( (void**) ( (void*) (node) + (left)))
+
+#define walk_right(node, right) \
+	*( (void**) ( (void*) (node) + (right)))
+
+/* delta: offset of the key from the node */
+#define walk_key(node, delta) \
+	*( (unsigned long*) ( (void*) (node) + (delta)))
+
+static inline long
+key_delta(struct tree_info *t)
+{
+	return (long) t->key_offset_in_element -
+	       (long) t->node_offset_in_element;
+}
+
+static inline __attribute__((always_inline)) void*
+__walk_search(struct tree_info *t, void *root, unsigned long key,
+              unsigned int left, unsigned int right, long delta)
+{
+	void *node = tree_root_get_node(t, root);
+	unsigned long tmp;
+
+	while (node) {
+		tmp = walk_key(node, delta);
+		if (key == tmp)
+			return node - t->node_offset_in_element;
+		node = key < tmp ? walk_left(node, left) :
+		                   walk_right(node, right);
+	}
+
+	return NULL;
+}
+
+/* tree_validate() of a binary tree, stats zeroed */
+static inline __attribute__((always_inline)) int
+__walk_validate(struct tree_info *t, void *root, int flags,
+                unsigned long max_nodes, struct tree_validate_stats *stats,
+                unsigned int left, unsigned int right, long delta)
+{
+	struct validate_frame *stack, *tmp, *f;
+	unsigned long size = 64, n = 0, key, height;
+	void *node = tree_root_get_node(t, root);
+	int has_key = 0, ret = TREE_VALID;
+	int balance;
+
+	stack = malloc(size * sizeof(*stack));
+	if (stack == NULL)
+		return -1;
+
+	if (node)
+		stack[n++] = (struct validate_frame) {node, 0, 0, 0};
+
+	while (n && ret == TREE_VALID) {
+		f = &stack[n - 1];
+
+		if (f->stage < 2) {
+			if (f->stage == 0) {
+				node = walk_left(f->node, left);
+			} else {
+				key = walk_key(f->node, delta);
+				if (has_key && key <= stats->key) {
+					stats->key = key;
+					ret = TREE_INVALID_ORDER;
+					break;
+				}
+				stats->key = key;
+				has_key = 1;
+
+				if (++stats->n_nodes > max_nodes && max_nodes) {
+					ret = TREE_INVALID_SIZE;
+					break;
+				}
+
+				node = walk_right(f->node, right);
+			}
+			f->stage++;
+
+			if (node == NULL)
+				continue;
+
+			if (n == size) {
+				tmp = realloc(stack, 2 * size * sizeof(*stack));
+				if (tmp == NULL) {
+					ret = -1;
+					break;
+				}
+				stack = tmp;
+				size *= 2;
+			}
+			stack[n++] = (struct validate_frame) {node, 0, 0, 0};
+			continue;
+		}
+
+		/* both subtrees are done */
+		height = (f->left_height > f->right_height ?
+		          f->left_height : f->right_height) + 1;
+		if (height > stats->height)
+			stats->height = height;
+
+		if (flags & TREE_VALIDATE_BALANCE) {
+			balance = t->ops->get_balance(f->node);
+			if (balance != (long) f->right_height -
+			               (long) f->left_height ||
+			    balance < -1 || balance > 1) {
+				stats->key = walk_key(f->node, delta);
+				ret = TREE_INVALID_BALANCE;
+				break;
+			}
+		}
+
+		/* return the height to the parent */
+		if (--n) {
+			if (stack[n - 1].stage == 1)
+				stack[n - 1].left_height = height;
+			else
+				stack[n - 1].right_height = height;
+		}
+	}
+
+	free(stack);
+
+	return ret;
+}
+
+static inline __attribute__((always_inline)) void
+__walk_node_keys(void **nodes, unsigned long *keys, unsigned long n,
+                 long delta)
+{
+	unsigned long k;
+
+	for (k = 0; k < n; k++)
+		keys[k] = walk_key(nodes[k], delta);
+}
+
+static inline __attribute__((always_inline)) void
+__walk_node_children(void **nodes, void **children, unsigned long n,
+                     unsigned int left, unsigned int right)
+{
+	unsigned long k;
+
+	for (k = 0; k < n; k++) {
+		children[2 * k] = walk_left(nodes[k], left);
+		children[2 * k + 1] = walk_right(nodes[k], right);
+	}
+}
+
+/*
+ * define the walks of a layout, name_walk. The offsets may be
+ * expressions of t (struct tree_info)
+ */
+#define DEFINE_TREE_WALK(name, left, right, delta)                     \
+static void*                                                           \
+name##_search(struct tree_info *t, void *root, unsigned long key)      \
+{                                                                      \
+	return __walk_search(t, root, key, left, right, delta);        \
+}                                                                      \
+                                                                       \
+static int                                                             \
+name##_validate(struct tree_info *t, void *root, int flags,            \
+                unsigned long max_nodes,                               \
+                struct tree_validate_stats *stats)                     \
+{                                                                      \
+	return __walk_validate(t, root, flags, max_nodes, stats,       \
+	                       left, right, delta);                    \
+}                                                                      \
+                                                                       \
+static void                                                            \
+name##_node_keys(struct tree_info *t, void **nodes,                    \
+                 unsigned long *keys, unsigned long n)                 \
+{                                                                      \
+	__walk_node_keys(nodes, keys, n, delta);                       \
+}                                                                      \
+                                                                       \
+static void                                                            \
+name##_node_children(struct tree_info *t, void **nodes,                \
+                     void **children, unsigned long n)                 \
+{                                                                      \
+	__walk_node_children(nodes, children, n, left, right);         \
+}                                                                      \
+                                                                       \
+static const struct tree_walk name##_walk = {                          \
+	#name,                                                         \
+	name##_search,                                                 \
+	name##_validate,                                               \
+	name##_node_keys,                                              \
+	name##_node_children,                                          \
+};
+
+DEFINE_TREE_WALK(generic, t->left_child_offset, t->right_child_offset,
+                 key_delta(t))
+
+/* left, right and key (from the node) of the known trees */
+DEFINE_TREE_WALK(l0_r8_k16, 0, 8, 16)   /* splay */
+DEFINE_TREE_WALK(l0_r8_k24, 0, 8, 24)   /* ebiggers, pasquali, treap */
+DEFINE_TREE_WALK(l0_r8_k32, 0, 8, 32)   /* order_avl */
+DEFINE_TREE_WALK(l8_r16_k0, 8, 16, 0)   /* cow_avl */
+DEFINE_TREE_WALK(l8_r16_km8, 8, 16, -8) /* skiplist */
+
+static const struct {
+	unsigned int left;
+	unsigned int right;
+	long delta;
+	const struct tree_walk *walk;
+} known_walks[] = {
+	{0, 8, 16, &l0_r8_k16_walk},
+	{0, 8, 24, &l0_r8_k24_walk},
+	{0, 8, 32, &l0_r8_k32_walk},
+	{8, 16, 0, &l8_r16_k0_walk},
+	{8, 16, -8, &l8_r16_km8_walk},
+};
 
-		*dst = *src;
+static const struct tree_walk*
+find_walk(struct tree_info *info)
+{
+	unsigned int i;
+
+	/* the walks load unsigned long keys */
+	if (info->key.type != TREE_KEY_ULONG)
+		return &generic_walk;
+
+	for (i = 0; i < sizeof(known_walks) / sizeof(*known_walks); i++) {
+		if (known_walks[i].left == info->left_child_offset &&
+		    known_walks[i].right == info->right_child_offset &&
+		    known_walks[i].delta == key_delta(info))
+			return known_walks[i].walk;
 	}
+
+	return &generic_walk;
+}
+
+/* the generic walk if tree_info_setup() didn't pick one */
+static const struct tree_walk*
+get_walk(struct tree_info *t)
+{
+	return t->walk ? t->walk : &generic_walk;
 }
 
 void
-tree_assign_keys(struct tree_memory *m, struct tree_info *i,
-                 unsigned long *key_array, unsigned long current)
+tree_info_use_generic_walk(struct tree_info *info)
 {
-	unsigned long *dst;
+	info->walk = &generic_walk;
+}
 
-	while (current--) {
-		/* define the pointer */
-		dst = m->array + current * i->element_size +
-		      i->key_offset_in_element;
+/*
+ * Tree snapshots
+ * ==============
+ */
+
+void
+tree_versions_init(struct tree_versions *v, struct tree_info *t,
+                   void *root)
+{
+	v->t = t;
+	v->root = root;
+	v->snapshots = (struct list_head) LIST_HEAD_INIT;
+	v->n_snapshots = 0;
+}
+
+struct tree_snapshot*
+tree_snapshot_take(struct tree_versions *v)
+{
+	struct tree_snapshot *s;
+
+	if (!tree_has_capability(v->t, TREE_CAP_SNAPSHOT))
+		return NULL;
+
+	/* the root follows the snapshot */
+	s = malloc(sizeof(*s) + v->t->root_size);
+	if (s == NULL)
+		return NULL;
+
+	s->root = s + 1;
+	s->version = v->t->ops->snapshot(s->root, v->root);
+	list_add(&s->list_node, &v->snapshots);
+	v->n_snapshots++;
+
+	return s;
+}
+
+void
+tree_snapshot_release(struct tree_versions *v, struct tree_snapshot *s)
+{
+	struct list_node **link = &v->snapshots.first;
+
+	while (*link && *link != &s->list_node)
+		link = &(*link)->next;
+	if (*link == NULL)
+		return;
+
+	*link = s->list_node.next;
+	v->n_snapshots--;
+
+	v->t->ops->release(s->root);
+	free(s);
+}
+
+void
+tree_versions_trim(struct tree_versions *v, unsigned long keep)
+{
+	struct list_node **link = &v->snapshots.first, *current, *next;
+	struct tree_snapshot *s;
+
+	while (*link && keep--)
+		link = &(*link)->next;
+
+	list_for_each_safe (current, next, *link) {
+		s = container_of(current, struct tree_snapshot, list_node);
+		v->t->ops->release(s->root);
+		free(s);
+		v->n_snapshots--;
+	}
+
+	*link = NULL;
+}
+
+unsigned long
+tree_versions_oldest(struct tree_versions *v)
+{
+	struct list_node *current;
+	struct tree_snapshot *s = NULL;
+
+	list_for_each (current, v->snapshots.first)
+		s = container_of(current, struct tree_snapshot, list_node);
+
+	return s ? s->version : ULONG_MAX;
+}
+
+/*
+ * Tree synchronization
+ * ====================
+ */
+
+/* do op in the tree in root. Return the element found by a search */
+static void*
+tree_do_op(struct tree_info *t, void *root, enum tree_op op,
+           unsigned long key, void *element)
+{
+	switch (op) {
+	case TREE_OP_INSERT:
+		t->ops->insert(root, element);
+		break;
+	case TREE_OP_DELETE:
+		t->ops->delete(root, key);
+		break;
+	case TREE_OP_SEARCH:
+		if (t->ops->search)
+			return t->ops->search(root, key);
+		return tree_search(t, root, key);
+	}
+
+	return NULL;
+}
+
+/* an operation published by a thread (flat combining) */
+struct tree_sync_slot {
+	enum tree_op op;
+	unsigned long key;
+	void *element;
+	void *result;
+	/* set by the thread, cleared by the combiner when done */
+	int pending;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+int
+tree_sync_init(struct tree_sync *s, struct tree_info *t, void *root,
+               enum tree_sync_type type, unsigned int n_threads,
+               int flags)
+{
+	int ret = 0;
 
-		*dst = key_array[current];
+	/* the operations take unsigned long keys */
+	if (t->key.type != TREE_KEY_ULONG)
+		return -1;
+
+	s->t = t;
+	s->root = root;
+	s->type = type;
+	s->flags = flags;
+	s->slots = NULL;
+	s->batch = NULL;
+	s->n_threads = n_threads;
+	s->n_batches = 0;
+	s->n_combined = 0;
+
+	switch (type) {
+	case TREE_SYNC_MUTEX:
+		ret = pthread_mutex_init(&s->lock.mutex, NULL);
+		break;
+	case TREE_SYNC_SPINLOCK:
+		ret = pthread_spin_init(&s->lock.spinlock,
+		                        PTHREAD_PROCESS_PRIVATE);
+		break;
+	case TREE_SYNC_RWLOCK:
+		ret = pthread_rwlock_init(&s->lock.rwlock, NULL);
+		break;
+	case TREE_SYNC_COMBINING:
+		s->lock.combiner = 0;
+		s->slots = aligned_alloc(CACHE_LINE_SIZE,
+		                         n_threads * sizeof(*s->slots));
+		s->batch = malloc(n_threads * sizeof(*s->batch));
+		if (s->slots == NULL || s->batch == NULL) {
+			tree_sync_free(s);
+			return -1;
+		}
+		memset(s->slots, 0, n_threads * sizeof(*s->slots));
+		break;
+	default:
+		return -1;
+	}
+
+	return ret ? -1 : 0;
+}
+
+void
+tree_sync_free(struct tree_sync *s)
+{
+	switch (s->type) {
+	case TREE_SYNC_MUTEX:
+		pthread_mutex_destroy(&s->lock.mutex);
+		break;
+	case TREE_SYNC_SPINLOCK:
+		pthread_spin_destroy(&s->lock.spinlock);
+		break;
+	case TREE_SYNC_RWLOCK:
+		pthread_rwlock_destroy(&s->lock.rwlock);
+		break;
+	default:
+		break;
+	}
+
+	free(s->slots);
+	free(s->batch);
+	s->slots = NULL;
+	s->batch = NULL;
+}
+
+static inline unsigned long
+slot_key(struct tree_sync *s, struct tree_sync_slot *slot)
+{
+	if (slot->op == TREE_OP_INSERT)
+		return tree_element_get_key(s->t, slot->element);
+
+	return slot->key;
+}
+
+/*
+ * the combiner: do the operations pending in the slots. A thread
+ * has one operation at a time, so they can be done in any order
+ */
+static void
+combine(struct tree_sync *s)
+{
+	struct tree_sync_slot *slot, *tmp;
+	unsigned long key;
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < s->n_threads; i++) {
+		slot = &s->slots[i];
+		if (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE))
+			s->batch[n++] = slot;
+	}
+
+	/* insertion sort, a batch has up to n_threads operations */
+	if (s->flags & TREE_SYNC_SORT) {
+		for (i = 1; i < n; i++) {
+			tmp = s->batch[i];
+			key = slot_key(s, tmp);
+			for (j = i; j > 0 && slot_key(s, s->batch[j - 1]) > key;
+			     j--)
+				s->batch[j] = s->batch[j - 1];
+			s->batch[j] = tmp;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		slot = s->batch[i];
+		slot->result = tree_do_op(s->t, s->root, slot->op, slot->key,
+		                          slot->element);
+		__atomic_store_n(&slot->pending, 0, __ATOMIC_RELEASE);
+	}
+
+	s->n_batches++;
+	s->n_combined += n;
+}
+
+static void*
+combining_op(struct tree_sync *s, unsigned int thread, enum tree_op op,
+             unsigned long key, void *element)
+{
+	struct tree_sync_slot *slot = &s->slots[thread];
+
+	slot->op = op;
+	slot->key = key;
+	slot->element = element;
+	__atomic_store_n(&slot->pending, 1, __ATOMIC_RELEASE);
+
+	/* done by a combiner, or become the combiner */
+	while (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&s->lock.combiner, __ATOMIC_RELAXED) ||
+		    __atomic_exchange_n(&s->lock.combiner, 1,
+		                        __ATOMIC_ACQUIRE)) {
+			sched_yield();
+			continue;
+		}
+
+		combine(s);
+		__atomic_store_n(&s->lock.combiner, 0, __ATOMIC_RELEASE);
+	}
+
+	return slot->result;
+}
+
+void*
+tree_sync_op(struct tree_sync *s, unsigned int thread, enum tree_op op,
+             unsigned long key, void *element)
+{
+	void *ret;
+
+	switch (s->type) {
+	case TREE_SYNC_MUTEX:
+		pthread_mutex_lock(&s->lock.mutex);
+		ret = tree_do_op(s->t, s->root, op, key, element);
+		pthread_mutex_unlock(&s->lock.mutex);
+		return ret;
+	case TREE_SYNC_SPINLOCK:
+		pthread_spin_lock(&s->lock.spinlock);
+		ret = tree_do_op(s->t, s->root, op, key, element);
+		pthread_spin_unlock(&s->lock.spinlock);
+		return ret;
+	case TREE_SYNC_RWLOCK:
+		if (op == TREE_OP_SEARCH &&
+		    !tree_has_capability(s->t, TREE_CAP_SEARCH_WRITES))
+			pthread_rwlock_rdlock(&s->lock.rwlock);
+		else
+			pthread_rwlock_wrlock(&s->lock.rwlock);
+		ret = tree_do_op(s->t, s->root, op, key, element);
+		pthread_rwlock_unlock(&s->lock.rwlock);
+		return ret;
+	case TREE_SYNC_COMBINING:
+		return combining_op(s, thread, op, key, element);
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Tree shards
+ * ===========
+ */
+
+struct shard_entry {
+	enum tree_op op;
+	unsigned long key;
+	void *element;
+};
+
+struct shard_queue {
+	/* next entry to read, written by the owner */
+	unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* next entry to write, written by the producer */
+	unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* head read by the producer, read again when full */
+	unsigned long head_cache;
+
+	struct shard_entry entry[TREE_SHARD_QUEUE_SIZE];
+};
+
+struct tree_shard {
+	struct tree_shards *s;
+	unsigned int idx;
+	pthread_t thread;
+	/* a queue per producer */
+	struct shard_queue *queues;
+	/* searches that found their key */
+	unsigned long n_found;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define round_up(x, y)  (((x) + (y) - 1) / (y) * (y))
+
+int
+tree_shards_init(struct tree_shards *s, struct tree_info *t,
+                 unsigned int n, enum tree_shard_route route,
+                 unsigned long key_max)
+{
+	unsigned int i;
+
+	if (t->key.type != TREE_KEY_ULONG || n == 0)
+		return -1;
+
+	s->t = t;
+	s->n = n;
+	s->route = route;
+	s->range = key_max / n + 1;
+	s->root_stride = round_up(t->root_size, CACHE_LINE_SIZE);
+	s->shard = NULL;
+	s->n_producers = 0;
+	s->stop = 0;
+
+	s->roots = aligned_alloc(CACHE_LINE_SIZE, n * s->root_stride);
+	if (s->roots == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		t->ops->init(tree_shard_root(s, i));
+
+	return 0;
+}
+
+void
+tree_shards_free(struct tree_shards *s)
+{
+	free(s->roots);
+	s->roots = NULL;
+}
+
+int
+tree_pin_thread(unsigned int cpu)
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (n_cpus < 1)
+		return -1;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % n_cpus, &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ?
+	       -1 : 0;
+}
+
+/* do the operations in queue q of shard. Return how many */
+static unsigned long
+shard_drain(struct tree_shard *shard, struct shard_queue *q)
+{
+	struct tree_info *t = shard->s->t;
+	void *root = tree_shard_root(shard->s, shard->idx);
+	unsigned long head = q->head, tail, n;
+	struct shard_entry *e;
+
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	n = tail - head;
+
+	for (; head != tail; head++) {
+		e = &q->entry[head % TREE_SHARD_QUEUE_SIZE];
+		if (tree_do_op(t, root, e->op, e->key, e->element))
+			shard->n_found++;
+	}
+
+	/* the entries can be written again */
+	__atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static void*
+shard_owner(void *arg)
+{
+	struct tree_shard *shard = arg;
+	struct tree_shards *s = shard->s;
+	unsigned long n;
+	unsigned int p;
+	int stop;
+
+	tree_pin_thread(shard->idx);
+
+	for (;;) {
+		/* read before the queues: stop is set after the last op */
+		stop = __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE);
+
+		n = 0;
+		for (p = 0; p < s->n_producers; p++)
+			n += shard_drain(shard, &shard->queues[p]);
+
+		if (n)
+			continue;
+		if (stop)
+			break;
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+/* stop the owners of the first n shards */
+static unsigned long
+shards_join(struct tree_shards *s, unsigned int n)
+{
+	unsigned long n_found = 0;
+	unsigned int i;
+
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(s->shard[i].thread, NULL);
+		n_found += s->shard[i].n_found;
+		free(s->shard[i].queues);
+	}
+
+	free(s->shard);
+	s->shard = NULL;
+	s->n_producers = 0;
+
+	return n_found;
+}
+
+int
+tree_shards_start(struct tree_shards *s, unsigned int n_producers)
+{
+	struct tree_shard *shard;
+	unsigned int i;
+
+	s->shard = aligned_alloc(CACHE_LINE_SIZE, s->n * sizeof(*s->shard));
+	if (s->shard == NULL)
+		return -1;
+
+	s->n_producers = n_producers;
+	s->stop = 0;
+
+	for (i = 0; i < s->n; i++) {
+		shard = &s->shard[i];
+		shard->s = s;
+		shard->idx = i;
+		shard->n_found = 0;
+		shard->queues = aligned_alloc(CACHE_LINE_SIZE, n_producers *
+		                              sizeof(*shard->queues));
+		if (shard->queues == NULL)
+			goto _go_stop;
+		memset(shard->queues, 0, n_producers * sizeof(*shard->queues));
+
+		if (pthread_create(&shard->thread, NULL, shard_owner, shard)) {
+			free(shard->queues);
+			goto _go_stop;
+		}
 	}
+
+	return 0;
+
+_go_stop:
+	shards_join(s, i);
+	return -1;
+}
+
+void
+tree_shards_submit(struct tree_shards *s, unsigned int producer,
+                   enum tree_op op, unsigned long key,
+                   void *element)
+{
+	struct shard_queue *q;
+	unsigned long tail;
+
+	if (op == TREE_OP_INSERT)
+		key = tree_element_get_key(s->t, element);
+	q = &s->shard[tree_shard_of(s, key)].queues[producer];
+	tail = q->tail;
+
+	/* full: wait for the owner */
+	while (tail - q->head_cache == TREE_SHARD_QUEUE_SIZE) {
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail - q->head_cache == TREE_SHARD_QUEUE_SIZE)
+			sched_yield();
+	}
+
+	q->entry[tail % TREE_SHARD_QUEUE_SIZE] =
+		(struct shard_entry) {op, key, element};
+
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long
+tree_shards_stop(struct tree_shards *s)
+{
+	if (s->shard == NULL)
+		return 0;
+
+	return shards_join(s, s->n);
 }
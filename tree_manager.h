@@ -23,6 +23,8 @@
 #ifndef TREE_MANAGER_H
 #define TREE_MANAGER_H
 
+#include <pthread.h> /* locks of struct tree_sync */
+
 #include "tree_operations.h"
 #include "single_linked_list.h"
 
@@ -38,22 +40,76 @@ struct tree_library {
 	/* library's name (filename is used) */
 	char *name;
 
+	/* ISA variant that was loaded ("baseline" if none) */
+	const char *isa;
+
 	/* dlopen() handle */
 	void *library;
 
 	/* has pointers to library's functions */
 	struct tree_operations ops;
+
+	/* trees in use, see tree_library_get() */
+	unsigned int users;
+
+	/* builds replaced by tree_library_reload() while in use */
+	struct list_head retired;
+};
+
+struct tree_load_options {
+	/* directories separated by ':' (NULL for ".") */
+	const char *path;
+
+	/* fnmatch() pattern of file names to load (NULL for all) */
+	const char *filter;
+
+	/* bind symbols of the libraries only when first used */
+	int lazy;
+
+	/* manifest file to skip checking unchanged files (or NULL) */
+	const char *manifest;
+};
+
+/* where the time (in seconds) to load trees was spent */
+struct tree_load_stats {
+	double total;
+	double scan;     /* reading directories */
+	double manifest; /* checking files in the manifest */
+	double open;     /* dlopen() */
+	double validate; /* getting and checking tree operations */
+
+	unsigned int n_files;  /* .so files found */
+	unsigned int n_loaded; /* valid tree libraries */
+	unsigned int n_cached; /* skipped (not tree libraries) */
 };
 
 struct tree_library*
 tree_library_load(const char *filename, struct list_head *tree_list);
 
+struct tree_library*
+tree_library_load_isa(const char *filename, const char *isa,
+                      struct list_head *tree_list);
+
+void
+tree_library_get(struct tree_library *lib);
+
+void
+tree_library_put(struct tree_library *lib);
+
+int
+tree_library_reload(struct tree_library *lib);
+
 void
 tree_manager_unload_trees(struct list_head *tree_list);
 
 int
 tree_manager_load_trees(struct list_head *tree_list);
 
+int
+tree_manager_load_trees_with(struct list_head *tree_list,
+                             struct tree_load_options *options,
+                             struct tree_load_stats *stats);
+
 #endif /* tree_library */
 
 /*
@@ -62,6 +118,27 @@ tree_manager_load_trees(struct list_head *tree_list);
  */
 #if 1 /* tree_information */
 
+struct tree_info;
+struct tree_validate_stats;
+
+/*
+ * walks of a layout (offsets of the children and the key), see
+ * tree_info_setup(). For unsigned long keys
+ */
+struct tree_walk {
+	const char *name;
+
+	void* (*search)(struct tree_info *t, void *root, unsigned long key);
+	int (*validate)(struct tree_info *t, void *root, int flags,
+	                unsigned long max_nodes,
+	                struct tree_validate_stats *stats);
+	/* scalar tree_nodes_get_keys() and tree_nodes_get_children() */
+	void (*node_keys)(struct tree_info *t, void **nodes,
+	                  unsigned long *keys, unsigned long n);
+	void (*node_children)(struct tree_info *t, void **nodes,
+	                      void **children, unsigned long n);
+};
+
 struct tree_info {
 	struct tree_operations *ops;
 
@@ -75,11 +152,54 @@ struct tree_info {
 	unsigned int right_child_offset;
 	unsigned int node_offset_in_element;
 	unsigned int key_offset_in_element;
+
+	/* key type (unsigned long if not TREE_CAP_KEY_TYPE) */
+	struct tree_key_info key;
+
+	/* walks compiled for the layout of the tree, or generic */
+	const struct tree_walk *walk;
 };
 
+/*
+ * get the sizes, offsets and key type of a tree, and pick the
+ * walks compiled with the offsets of its layout as constants
+ * (the generic walks read them from info)
+ *
+ * NOTE: a tree_info must be set up with it. One filled by hand
+ * has no operations and no walk (a NULL walk falls back to the
+ * generic walks, but operations are required by most calls)
+ */
 void
 tree_info_setup(struct tree_info *info, struct tree_operations *ops);
 
+/* use the generic walks (e.g. to compare them) */
+void
+tree_info_use_generic_walk(struct tree_info *info);
+
+int
+tree_key_compare(struct tree_info *t, const void *a, const void *b);
+
+void
+tree_var_key_set(struct tree_info *t, struct tree_var_key *key,
+                 const void *data, size_t len);
+
+/*
+ * search key walking the tree with the offsets, as a tree
+ * without TREE_CAP_SEARCH would be searched. For unsigned long
+ * keys. Return the element with key or NULL
+ *
+ * NOTE: trees with TREE_CAP_NON_BINARY can't be walked. Here
+ * they're searched with their search operation, while
+ * tree_relayout(), tree_is_identical() and tree_validate() don't
+ * support them
+ */
+void*
+tree_search(struct tree_info *t, void *root, unsigned long key);
+
+/* false if tree has no operations (tree_info_setup() not called) */
+#define tree_has_capability(tree, cap) \
+	((tree)->ops && ((tree)->ops->capabilities & (cap)))
+
 /*
  * NOTE: we like size of void* to be 1 in pointer arithmetic :-)
  * I hope everything is memory aligned.
@@ -88,7 +208,12 @@ tree_info_setup(struct tree_info *info, struct tree_operations *ops);
 #define tree_root_get_node(tree, root) \
 	*( (void**) ( (void*) root + (tree)->root_node_offset))
 
-/* ptr refers to the node, not the element */
+/*
+ * ptr refers to the node, not the element
+ *
+ * NOTE: get_key and set_key are for unsigned long keys only,
+ * get_key_ptr works for every key type
+ */
 
 #define tree_node_get_left(tree, ptr) \
 	*( (void**) ( (void*) ptr + (tree)->left_child_offset))
@@ -106,8 +231,16 @@ tree_info_setup(struct tree_info *info, struct tree_operations *ops);
 	(tree)->node_offset_in_element + \
 	(tree)->key_offset_in_element) ) = key
 
+#define tree_node_get_key_ptr(tree, ptr) \
+	( (void*) ptr - \
+	(tree)->node_offset_in_element + \
+	(tree)->key_offset_in_element)
+
 /* ptr refers to the element */
 
+#define tree_element_get_key_ptr(tree, ptr) \
+	( (void*) ptr + (tree)->key_offset_in_element)
+
 #define tree_element_get_key(tree, ptr) \
 	*( (unsigned long*) ( (void*) ptr + \
 	(tree)->key_offset_in_element))
@@ -119,8 +252,57 @@ tree_info_setup(struct tree_info *info, struct tree_operations *ops);
 #define tree_element_get_node(tree, ptr) \
 	*( (void**) ( (void*) ptr + (tree)->node_offset_in_element))
 
+/* element after ptr in the list returned by delete_range, or NULL */
+static inline void*
+tree_list_next(struct tree_info *t, void *ptr)
+{
+	void *node = tree_node_get_right(t, ptr + t->node_offset_in_element);
+
+	return node ? node - t->node_offset_in_element : NULL;
+}
+
 #endif /* tree_information */
 
+/*
+ * Tree kernels
+ * ============
+ */
+#if 1 /* tree_kernels */
+
+/* instruction sets the kernels may use, from worst to best */
+enum tree_simd_level {
+	TREE_SIMD_SCALAR,
+	TREE_SIMD_AVX2,
+	TREE_SIMD_AVX512,
+	TREE_SIMD_LAST,
+};
+
+int
+tree_simd_set_level(enum tree_simd_level level);
+
+enum tree_simd_level
+tree_simd_get_level(void);
+
+const char*
+tree_simd_level_name(enum tree_simd_level level);
+
+void
+tree_nodes_get_keys(struct tree_info *t, void **nodes, unsigned long *keys,
+                    unsigned long n);
+
+void
+tree_nodes_get_children(struct tree_info *t, void **nodes, void **children,
+                        unsigned long n);
+
+unsigned long
+tree_keys_mismatch(const unsigned long *a, const unsigned long *b,
+                   unsigned long n);
+
+long
+tree_frontier_compact(void **a, void **b, unsigned long n);
+
+#endif /* tree_kernels */
+
 /*
  * Tree memory
  * ===========
@@ -131,11 +313,52 @@ struct tree_memory {
 	void *addr;
 	void *root;
 	void *array;
+	/* number of elements */
+	unsigned long size;
+	/* slot in array of element idx, NULL if it's idx */
+	unsigned long *slots;
+};
+
+/*
+ * Placement of the elements in the array (see
+ * tree_memory_place())
+ */
+enum tree_placement {
+	/* element idx in slot idx */
+	TREE_PLACE_SEQUENTIAL,
+	/* each element in a random slot */
+	TREE_PLACE_SHUFFLED,
+	/*
+	 * runs of 1 to TREE_PLACE_MAX_RUN adjacent slots in random
+	 * order, as given by a free list after many allocations
+	 * and frees
+	 */
+	TREE_PLACE_FRAGMENTED,
+	TREE_PLACE_LAST,
+};
+
+#define TREE_PLACE_MAX_RUN  16
+
+/* order of the elements after tree_relayout() */
+enum tree_layout {
+	/* in-order (sorted by key) */
+	TREE_LAYOUT_INORDER,
+	/* pre-order (DFS): a node, its left and its right subtree */
+	TREE_LAYOUT_PREORDER,
+	/* level by level (BFS) */
+	TREE_LAYOUT_BFS,
+	/*
+	 * van Emde Boas: the top half of the levels, then each
+	 * subtree below it, recursively
+	 */
+	TREE_LAYOUT_VEB,
+	TREE_LAYOUT_LAST,
 };
 
 void
 tree_memory_free(struct tree_memory *m);
 
+/* the array of elements starts at a cache line */
 void
 tree_memory_allocate(struct tree_memory *m, struct tree_info *i,
                      unsigned int size);
@@ -159,21 +382,399 @@ void
 tree_assign_keys(struct tree_memory *m, struct tree_info *i,
                  unsigned long *key_array, unsigned long current);
 
+/*
+ * assign a slot to each element, keys included. Return -1 if
+ * out of memory
+ */
+int
+tree_memory_place(struct tree_memory *m, struct tree_info *i,
+                  enum tree_placement placement);
+
+/*
+ * move the elements of the tree in the memory to the order of
+ * layout, with the elements in no tree after them. The links are
+ * fixed and the slots of the elements updated. The tree needs
+ * TREE_CAP_RELAYOUT. Return -1 on error (out of memory, or a node
+ * out of the memory)
+ */
+int
+tree_relayout(struct tree_memory *m, struct tree_info *i,
+              enum tree_layout layout);
+
+static inline void*
+tree_memory_element(struct tree_memory *m, struct tree_info *i,
+                    unsigned long idx)
+{
+	return m->array + (m->slots ? m->slots[idx] : idx) * i->element_size;
+}
+
 static inline void
 tree_delete(struct tree_memory *m, struct tree_info *i, unsigned int idx)
 {
-	unsigned long *tmp = (void*) m->array + idx * i->element_size +
+	unsigned long *tmp = tree_memory_element(m, i, idx) +
 	                     i->key_offset_in_element;
 
-	i->ops->delete(m->root, *tmp);
+	if (i->key.type == TREE_KEY_ULONG)
+		i->ops->delete(m->root, *tmp);
+	else
+		i->ops->delete_key(m->root, tmp);
+}
+
+/* needs TREE_CAP_DELETE_ELEMENT */
+static inline void
+tree_delete_element(struct tree_memory *m, struct tree_info *i,
+                    unsigned int idx)
+{
+	i->ops->delete_element(m->root, tree_memory_element(m, i, idx));
 }
 
 static inline void
 tree_insert(struct tree_memory *m, struct tree_info *i, unsigned int idx)
 {
-	i->ops->insert(m->root, m->array + idx * i->element_size);
+	i->ops->insert(m->root, tree_memory_element(m, i, idx));
+}
+
+/* needs TREE_CAP_INSERT_HINT. Element hint is in the tree */
+static inline void
+tree_insert_hint(struct tree_memory *m, struct tree_info *i,
+                 unsigned int idx, unsigned int hint)
+{
+	i->ops->insert_hint(m->root, tree_memory_element(m, i, idx),
+	                    tree_memory_element(m, i, hint));
 }
 
 #endif /* tree_memory */
 
+/*
+ * Tree comparison
+ * ===============
+ */
+#if 1 /* tree_comparison */
+
+struct tree_compare_stats {
+	/* widest level and number of nodes compared */
+	unsigned long max_frontier;
+	unsigned long n_checked;
+
+	/*
+	 * the first different keys (when not identical), both 0
+	 * if the shapes differ
+	 */
+	unsigned long key_a;
+	unsigned long key_b;
+};
+
+int
+tree_is_identical(struct tree_info *a, void *_root_a,
+                  struct tree_info *b, void *_root_b,
+                  struct tree_compare_stats *stats);
+
+#endif /* tree_comparison */
+
+/*
+ * Tree validation
+ * ===============
+ */
+#if 1 /* tree_validation */
+
+/* flags of tree_validate() */
+#define TREE_VALIDATE_BALANCE  (1 << 0)
+
+enum {
+	TREE_VALID,
+	/* a key is not greater than the previous one (in-order) */
+	TREE_INVALID_ORDER,
+	/* balance is not the difference of the subtree heights */
+	TREE_INVALID_BALANCE,
+	/* more nodes than max_nodes (e.g. a cycle) */
+	TREE_INVALID_SIZE,
+	/* not a binary tree (TREE_CAP_NON_BINARY) or not TREE_KEY_ULONG */
+	TREE_UNSUPPORTED,
+};
+
+struct tree_validate_stats {
+	unsigned long n_nodes;
+	unsigned long height;
+
+	/* key of the node where the tree is invalid */
+	unsigned long key;
+};
+
+int
+tree_validate(struct tree_info *t, void *root, int flags,
+              unsigned long max_nodes, struct tree_validate_stats *stats);
+
+const char*
+tree_validate_error(int error);
+
+#endif /* tree_validation */
+
+/*
+ * Tree snapshots
+ * ==============
+ */
+#if 1 /* tree_snapshots */
+
+/* a copy of a tree with TREE_CAP_SNAPSHOT at a version */
+struct tree_snapshot {
+	struct list_node list_node;
+	/* changes of the tree before the snapshot */
+	unsigned long version;
+	/* root of the snapshot (root_size bytes) */
+	void *root;
+};
+
+/*
+ * snapshots in use of a tree. The functions are called by the
+ * writer of the tree, readers only use the roots of snapshots
+ */
+struct tree_versions {
+	struct tree_info *t;
+	void *root;
+	/* newest first */
+	struct list_head snapshots;
+	unsigned long n_snapshots;
+};
+
+void
+tree_versions_init(struct tree_versions *v, struct tree_info *t,
+                   void *root);
+
+/* snapshot of the tree as it's now (O(1)). NULL on error */
+struct tree_snapshot*
+tree_snapshot_take(struct tree_versions *v);
+
+void
+tree_snapshot_release(struct tree_versions *v, struct tree_snapshot *s);
+
+/* release all but the newest keep snapshots */
+void
+tree_versions_trim(struct tree_versions *v, unsigned long keep);
+
+/* version of the oldest snapshot in use, ULONG_MAX if none */
+unsigned long
+tree_versions_oldest(struct tree_versions *v);
+
+#endif /* tree_snapshots */
+
+/*
+ * Tree synchronization
+ * ====================
+ */
+#if 1 /* tree_sync */
+
+/* operation of tree_sync_op() and tree_shards_submit() */
+enum tree_op {
+	TREE_OP_INSERT,
+	TREE_OP_DELETE,
+	TREE_OP_SEARCH,
+};
+
+/* how tree_sync_op() serializes the operations of threads */
+enum tree_sync_type {
+	/* a mutex around each operation */
+	TREE_SYNC_MUTEX,
+	/* a spinlock around each operation */
+	TREE_SYNC_SPINLOCK,
+	/*
+	 * a readers-writer lock, shared by the searches (unless
+	 * TREE_CAP_SEARCH_WRITES)
+	 */
+	TREE_SYNC_RWLOCK,
+	/*
+	 * flat combining: a thread publishes its operation in its
+	 * slot, and the thread that takes the lock (the combiner)
+	 * does the operations of every slot in a batch
+	 */
+	TREE_SYNC_COMBINING,
+	TREE_SYNC_LAST,
+};
+
+/* flags of tree_sync_init() */
+
+/* the combiner does a batch in key order */
+#define TREE_SYNC_SORT  (1 << 0)
+
+struct tree_sync_slot;
+
+struct tree_sync {
+	struct tree_info *t;
+	void *root;
+	enum tree_sync_type type;
+	int flags;
+
+	union {
+		pthread_mutex_t mutex;
+		pthread_spinlock_t spinlock;
+		pthread_rwlock_t rwlock;
+		/* held by the combiner */
+		int combiner;
+	} lock;
+
+	/* TREE_SYNC_COMBINING: a slot per thread, and the batch */
+	struct tree_sync_slot *slots;
+	struct tree_sync_slot **batch;
+	unsigned int n_threads;
+
+	/* batches done by combiners and their operations */
+	unsigned long n_batches;
+	unsigned long n_combined;
+};
+
+/*
+ * share the tree in root among n_threads threads. Return -1 on
+ * error or if the key of t isn't TREE_KEY_ULONG (keys of the
+ * operations are unsigned long)
+ */
+int
+tree_sync_init(struct tree_sync *s, struct tree_info *t, void *root,
+               enum tree_sync_type type, unsigned int n_threads,
+               int flags);
+
+void
+tree_sync_free(struct tree_sync *s);
+
+/*
+ * do op in the tree, from thread (0 to n_threads - 1). element
+ * is the element to insert, key is for delete and search. Return
+ * the element found by a search
+ */
+void*
+tree_sync_op(struct tree_sync *s, unsigned int thread, enum tree_op op,
+             unsigned long key, void *element);
+
+#endif /* tree_sync */
+
+/*
+ * Tree shards
+ * ===========
+ */
+#if 1 /* tree_shards */
+
+/* how tree_shard_of() routes a key to a shard */
+enum tree_shard_route {
+	/* equal ranges of the keys 0 to key_max, in key order */
+	TREE_SHARD_RANGE,
+	/* a hash of the key */
+	TREE_SHARD_HASH,
+	TREE_SHARD_ROUTE_LAST,
+};
+
+/* entries of a delegation queue (a power of 2) */
+#define TREE_SHARD_QUEUE_SIZE  1024
+
+struct tree_shard;
+
+/*
+ * n roots of a tree, each with a part of the keys (ulong keys
+ * only). The roots are a cache line apart
+ */
+struct tree_shards {
+	struct tree_info *t;
+	unsigned int n;
+	enum tree_shard_route route;
+	/* keys of a shard with TREE_SHARD_RANGE */
+	unsigned long range;
+
+	void *roots;
+	size_t root_stride;
+
+	/* owner threads and queues (see tree_shards_start()) */
+	struct tree_shard *shard;
+	unsigned int n_producers;
+	int stop;
+};
+
+/*
+ * init n roots of tree t. Keys above key_max (TREE_SHARD_RANGE)
+ * go to the last shard. Return -1 on error
+ */
+int
+tree_shards_init(struct tree_shards *s, struct tree_info *t,
+                 unsigned int n, enum tree_shard_route route,
+                 unsigned long key_max);
+
+void
+tree_shards_free(struct tree_shards *s);
+
+static inline unsigned int
+tree_shard_of(struct tree_shards *s, unsigned long key)
+{
+	unsigned long shard;
+
+	if (s->route == TREE_SHARD_HASH)
+		return ((key * 0x9e3779b97f4a7c15UL) >> 32) % s->n;
+
+	shard = key / s->range;
+
+	return shard < s->n ? shard : s->n - 1;
+}
+
+static inline void*
+tree_shard_root(struct tree_shards *s, unsigned int shard)
+{
+	return s->roots + shard * s->root_stride;
+}
+
+/*
+ * Direct operations: the caller is the only thread using the
+ * shard of the key (e.g. a thread per shard, with the keys
+ * partitioned the same way)
+ */
+
+static inline void
+tree_shards_insert(struct tree_shards *s, void *element)
+{
+	unsigned long key = tree_element_get_key(s->t, element);
+
+	s->t->ops->insert(tree_shard_root(s, tree_shard_of(s, key)),
+	                  element);
+}
+
+static inline void
+tree_shards_delete(struct tree_shards *s, unsigned long key)
+{
+	s->t->ops->delete(tree_shard_root(s, tree_shard_of(s, key)), key);
+}
+
+static inline void*
+tree_shards_search(struct tree_shards *s, unsigned long key)
+{
+	void *root = tree_shard_root(s, tree_shard_of(s, key));
+
+	if (s->t->ops->search)
+		return s->t->ops->search(root, key);
+
+	return tree_search(s->t, root, key);
+}
+
+/*
+ * Delegation: a thread per shard (its owner) does the operations
+ * of the shard, sent by n_producers threads through a queue per
+ * producer and shard (single producer, single consumer, without
+ * locks). A producer waits while the queue is full. The owner of
+ * shard k is pinned to CPU k. Return -1 on error
+ */
+int
+tree_shards_start(struct tree_shards *s, unsigned int n_producers);
+
+/* element is the element to insert, key is for delete and search */
+void
+tree_shards_submit(struct tree_shards *s, unsigned int producer,
+                   enum tree_op op, unsigned long key,
+                   void *element);
+
+/*
+ * wait for the owners to do the operations submitted and stop
+ * them. Return the number of searches that found their key
+ */
+unsigned long
+tree_shards_stop(struct tree_shards *s);
+
+/* pin the calling thread to cpu (modulo the CPUs online) */
+int
+tree_pin_thread(unsigned int cpu);
+
+#endif /* tree_shards */
+
 #endif /* TREE_MANAGER_H */
@@ -3,7 +3,88 @@
 #ifndef TREE_OPERATIONS_H
 #define TREE_OPERATIONS_H
 
+#include <stddef.h> /* size_t */
+
+/*
+ * optional operations, and other features, of a tree. An
+ * optional operation is NULL when its flag is not set
+ */
+#define TREE_CAP_SEARCH    (1UL << 0)
+#define TREE_CAP_KEY_TYPE  (1UL << 1)
+#define TREE_CAP_ORDER     (1UL << 2)
+#define TREE_CAP_SET       (1UL << 3)
+#define TREE_CAP_RELAYOUT  (1UL << 4)
+#define TREE_CAP_DELETE_ELEMENT  (1UL << 5)
+#define TREE_CAP_INSERT_HINT  (1UL << 6)
+#define TREE_CAP_DELETE_RANGE  (1UL << 7)
+/*
+ * not a binary search tree (e.g. a radix tree): it has search,
+ * the left and right offsets mean nothing, and the tree manager
+ * doesn't walk it (see tree_manager.h)
+ */
+#define TREE_CAP_NON_BINARY  (1UL << 8)
+/*
+ * balanced other than as an AVL tree (e.g. a treap): get_balance
+ * is something else (e.g. a priority), and the shape differs
+ * from the AVL trees with the same keys
+ */
+#define TREE_CAP_NON_AVL  (1UL << 9)
+/*
+ * search changes the tree (e.g. a splay tree), so searches
+ * can't run at the same time as other operations
+ */
+#define TREE_CAP_SEARCH_WRITES  (1UL << 10)
+#define TREE_CAP_SNAPSHOT  (1UL << 11)
+
+/*
+ * Keys
+ *
+ * Trees without TREE_CAP_KEY_TYPE have an unsigned long key.
+ * Others describe their key in a struct tree_key_info.
+ */
+enum tree_key_type {
+	/* unsigned long */
+	TREE_KEY_ULONG,
+	/* `size` bytes, e.g. a tuple of big-endian integers */
+	TREE_KEY_BYTES,
+	/* struct tree_var_key */
+	TREE_KEY_VAR,
+};
+
+/*
+ * A variable-length key. It's stored in the element, and data
+ * is kept by the user of the tree.
+ *
+ * prefix has the first bytes of data (up to prefix_len of the
+ * key info) as a big-endian integer, the rest is zero. Keys with
+ * different prefixes are ordered by it without reading data.
+ */
+struct tree_var_key {
+	unsigned long prefix;
+	const void *data;
+	size_t len;
+};
+
+struct tree_key_info {
+	enum tree_key_type type;
+
+	/* bytes of the key in the element */
+	size_t size;
+
+	/* bytes of data cached in tree_var_key.prefix (0 to 8) */
+	size_t prefix_len;
+
+	/*
+	 * order of two keys (pointers to the key in the element,
+	 * or to a key like it), as memcmp()
+	 */
+	int (*compare)(const void *a, const void *b);
+};
+
 struct tree_operations {
+	/* TREE_CAP_* flags */
+	unsigned long capabilities;
+
 	/* sizes */
 	size_t (*get_root_size)(void);
 	size_t (*get_element_size)(void);
@@ -18,10 +99,128 @@ struct tree_operations {
 	/* get balance operation */
 	unsigned int (*get_balance)(void *element);
 
-	/* main operations */
+	/*
+	 * main operations
+	 *
+	 * delete may be NULL if the key isn't TREE_KEY_ULONG (see
+	 * delete_key)
+	 */
 	void (*delete)(void *root, unsigned long key);
 	void (*insert)(void *root, void *pos);
 	void (*init)(void *root);
+
+	/*
+	 * optional operations
+	 *
+	 * NOTE: new operations are always added at the end,
+	 * so trees built with an older header still load
+	 */
+
+	/* TREE_CAP_SEARCH: return the element with key or NULL */
+	void *(*search)(void *root, unsigned long key);
+
+	/*
+	 * TREE_CAP_KEY_TYPE: describe the key, and delete or
+	 * search (if TREE_CAP_SEARCH) with a pointer to a key
+	 */
+	void (*get_key_info)(struct tree_key_info *key);
+	void (*delete_key)(void *root, const void *key);
+	void *(*search_key)(void *root, const void *key);
+	/*
+	 * TREE_CAP_ORDER (order statistics, unsigned long keys):
+	 * select returns the element with the k-th smallest key
+	 * (from 0) or NULL, rank returns the number of keys smaller
+	 * than key
+	 */
+	void *(*select)(void *root, unsigned long k);
+	unsigned long (*rank)(void *root, unsigned long key);
+	/*
+	 * TREE_CAP_SET (unsigned long keys):
+	 *
+	 * split moves the keys of root smaller than key to left and
+	 * the greater ones to right, and returns the element with
+	 * key (in no tree) or NULL. join moves left, the element
+	 * pivot and right, in the order of their keys, to root.
+	 *
+	 * set_* move the union, intersection or difference (a - b)
+	 * of a and b to root. Elements of a and b not in root are in
+	 * no tree. root may be a or b.
+	 *
+	 * Roots that are moved become empty.
+	 */
+	void *(*split)(void *root, unsigned long key, void *left,
+	               void *right);
+	void (*join)(void *root, void *left, void *pivot, void *right);
+	void (*set_union)(void *root, void *a, void *b);
+	void (*set_intersection)(void *root, void *a, void *b);
+	void (*set_difference)(void *root, void *a, void *b);
+	/*
+	 * TREE_CAP_RELAYOUT: elements may be moved in memory by
+	 * tree_relayout(), which fixes the child pointers. Trees
+	 * with other pointers to nodes (a parent) have set_parent,
+	 * called for each moved node with its parent (NULL for the
+	 * root)
+	 */
+	void (*set_parent)(void *node, void *parent);
+	/*
+	 * TREE_CAP_DELETE_ELEMENT: delete an element that is in the
+	 * tree without searching its key (e.g. with parent
+	 * pointers)
+	 */
+	void (*delete_element)(void *root, void *element);
+	/*
+	 * TREE_CAP_INSERT_HINT: insert starting the search at hint,
+	 * an element in the tree with a key close to the new one
+	 * (e.g. the last inserted), instead of the root. hint may
+	 * be NULL
+	 */
+	void (*insert_hint)(void *root, void *element, void *hint);
+	/*
+	 * TREE_CAP_DELETE_RANGE (unsigned long keys): delete the
+	 * elements with keys from lo to hi (inclusive) at once.
+	 * Return the first of them or NULL. They are a list in the
+	 * order of the keys, linked by the right child pointer (the
+	 * left one is NULL), so they can be reused
+	 */
+	void *(*delete_range)(void *root, unsigned long lo,
+	                      unsigned long hi);
+	/*
+	 * TREE_CAP_SNAPSHOT (persistent trees): snapshot makes
+	 * snapshot (a root, not initialized) a copy of root in O(1)
+	 * and returns the version of root (changes since init).
+	 * Later changes of either don't show in the other, the
+	 * nodes they share are copied. release frees the nodes used
+	 * only by snapshot. get_allocated returns the bytes of nodes
+	 * allocated by the changes of root
+	 */
+	unsigned long (*snapshot)(void *snapshot, void *root);
+	void (*release)(void *snapshot);
+	unsigned long (*get_allocated)(void *root);
 };
 
+/*
+ * Tree module
+ *
+ * A tree library exports a single symbol, `tree_module`, that
+ * describes it. ops_size is the size of struct tree_operations
+ * the tree was built with: operations beyond it are unknown to
+ * the tree and are set to NULL by the tree manager.
+ *
+ * abi_version changes only when an incompatible change is made
+ * (a tree with a different version is not loaded).
+ */
+
+#define TREE_MODULE_ABI_VERSION  1
+
+struct tree_module {
+	unsigned int abi_version;
+	unsigned int ops_size;
+	struct tree_operations ops;
+};
+
+/* initializer for the header fields of struct tree_module */
+#define TREE_MODULE_HEADER \
+	.abi_version = TREE_MODULE_ABI_VERSION, \
+	.ops_size = sizeof(struct tree_operations)
+
 #endif /* TREE_OPERATIONS_H */
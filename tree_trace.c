@@ -0,0 +1,350 @@
+/*
+ * binary traces of tree operations
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * 18/10/2026
+ *
+ * See tree_trace.h for the format.
+ */
+
+#include <fcntl.h> /* open */
+#include <stdlib.h> /* malloc free */
+#include <string.h> /* memcmp memcpy */
+#include <sys/mman.h> /* mmap madvise */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h> /* close */
+
+#include "tree_trace.h"
+
+/* buffer of the trace file being written */
+#define WRITE_BUFFER_SIZE  (1 << 20)
+
+static void
+put_le(unsigned char *dst, unsigned long value, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++, value >>= 8)
+		dst[i] = value & 0xff;
+}
+
+static unsigned long
+get_le(const unsigned char *src, int bytes)
+{
+	unsigned long value = 0;
+
+	while (bytes--)
+		value = value << 8 | src[bytes];
+
+	return value;
+}
+
+static int
+write_header(struct tree_trace_writer *w)
+{
+	unsigned char buffer[TREE_TRACE_HEADER_SIZE];
+
+	memcpy(buffer, TREE_TRACE_MAGIC, 8);
+	put_le(buffer + 8, TREE_TRACE_VERSION, 4);
+	put_le(buffer + 12, w->header.key_type, 4);
+	put_le(buffer + 16, w->header.n_ops, 8);
+	put_le(buffer + 24, w->header.n_inserts, 8);
+
+	return fwrite(buffer, sizeof(buffer), 1, w->file) == 1 ? 0 : -1;
+}
+
+static void
+put_varint(FILE *file, unsigned long value)
+{
+	while (value >= 0x80) {
+		putc((value & 0x7f) | 0x80, file);
+		value >>= 7;
+	}
+	putc(value, file);
+}
+
+static const unsigned char*
+get_varint(const unsigned char *p, const unsigned char *end,
+           unsigned long *value)
+{
+	unsigned long tmp = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		tmp |= (unsigned long) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*value = tmp;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+int
+tree_trace_create(struct tree_trace_writer *w, const char *path,
+                  unsigned int key_type)
+{
+	memset(w, 0, sizeof(*w));
+	w->header.version = TREE_TRACE_VERSION;
+	w->header.key_type = key_type;
+
+	w->file = fopen(path, "w");
+	if (w->file == NULL)
+		return -1;
+	setvbuf(w->file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+	/* the counts are written again in tree_trace_finish() */
+	if (write_header(w) == -1) {
+		fclose(w->file);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+tree_trace_write(struct tree_trace_writer *w, unsigned int op,
+                 unsigned long key)
+{
+	unsigned long delta = key - w->last_key;
+	unsigned long zigzag = delta << 1 ^ -(delta >> 63);
+
+	if (zigzag >> 62) {
+		putc(TREE_TRACE_ESCAPE, w->file);
+		putc(op, w->file);
+		put_varint(w->file, zigzag);
+	} else {
+		put_varint(w->file, zigzag << 2 | op);
+	}
+
+	w->last_key = key;
+	w->header.n_ops++;
+	if (op == TREE_TRACE_INSERT)
+		w->header.n_inserts++;
+}
+
+int
+tree_trace_finish(struct tree_trace_writer *w)
+{
+	int ret = 0;
+
+	if (fseek(w->file, 0, SEEK_SET) || write_header(w) == -1 ||
+	    ferror(w->file))
+		ret = -1;
+	if (fclose(w->file))
+		ret = -1;
+
+	return ret;
+}
+
+int
+tree_trace_read_header(const void *data, size_t size,
+                       struct tree_trace_header *header)
+{
+	const unsigned char *p = data;
+
+	if (size < TREE_TRACE_HEADER_SIZE ||
+	    memcmp(p, TREE_TRACE_MAGIC, 8) != 0)
+		return -1;
+
+	header->version = get_le(p + 8, 4);
+	header->key_type = get_le(p + 12, 4);
+	header->n_ops = get_le(p + 16, 8);
+	header->n_inserts = get_le(p + 24, 8);
+
+	return header->version == TREE_TRACE_VERSION ? 0 : -1;
+}
+
+const unsigned char*
+tree_trace_decode(const unsigned char *p, const unsigned char *end,
+                  struct tree_trace_op *op, unsigned long *last_key)
+{
+	unsigned long value, zigzag;
+
+	p = get_varint(p, end, &value);
+	if (p == NULL)
+		return NULL;
+
+	op->op = value & 3;
+	zigzag = value >> 2;
+
+	if (op->op == TREE_TRACE_ESCAPE) {
+		if (p == end || *p >= TREE_TRACE_ESCAPE)
+			return NULL;
+		op->op = *p++;
+		p = get_varint(p, end, &zigzag);
+		if (p == NULL)
+			return NULL;
+	}
+
+	*last_key += zigzag >> 1 ^ -(zigzag & 1);
+	op->key = *last_key;
+
+	return p;
+}
+
+/* fill the ring with batches of decoded operations */
+static void*
+decode_thread(void *arg)
+{
+	struct tree_trace_reader *r = arg;
+	const unsigned char *p = r->data + TREE_TRACE_HEADER_SIZE;
+	const unsigned char *end = r->data + r->size;
+	unsigned long remaining = r->header.n_ops, last_key = 0;
+	struct tree_trace_batch *batch;
+	unsigned long n;
+	int stop;
+
+	while (remaining) {
+		pthread_mutex_lock(&r->lock);
+		while (r->head - r->tail == TREE_TRACE_RING_SIZE && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		/* read under the lock, tree_trace_close() sets it */
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+
+		if (stop)
+			break;
+
+		batch = &r->ring[r->head % TREE_TRACE_RING_SIZE];
+
+		for (n = 0; n < TREE_TRACE_BATCH_SIZE && remaining; n++) {
+			p = tree_trace_decode(p, end, &batch->ops[n], &last_key);
+			if (p == NULL) {
+				r->error = 1;
+				goto _go_done;
+			}
+			remaining--;
+		}
+		batch->n_ops = n;
+
+		pthread_mutex_lock(&r->lock);
+		r->head++;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+_go_done:
+	pthread_mutex_lock(&r->lock);
+	r->done = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+struct tree_trace_reader*
+tree_trace_open(const char *path)
+{
+	struct tree_trace_reader *r;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || st.st_size < TREE_TRACE_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	/* read ahead as the trace is decoded */
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	madvise(data, st.st_size, MADV_WILLNEED);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		goto _go_unmap;
+
+	r->data = data;
+	r->size = st.st_size;
+
+	if (tree_trace_read_header(data, st.st_size, &r->header) == -1)
+		goto _go_free;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+
+	if (pthread_create(&r->thread, NULL, decode_thread, r) != 0)
+		goto _go_destroy;
+
+	return r;
+
+_go_destroy:
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+_go_free:
+	free(r);
+_go_unmap:
+	munmap(data, st.st_size);
+
+	return NULL;
+}
+
+struct tree_trace_batch*
+tree_trace_next(struct tree_trace_reader *r)
+{
+	struct tree_trace_batch *batch = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->head == r->tail && !r->done)
+		pthread_cond_wait(&r->cond, &r->lock);
+	if (r->head != r->tail)
+		batch = &r->ring[r->tail % TREE_TRACE_RING_SIZE];
+	pthread_mutex_unlock(&r->lock);
+
+	return batch;
+}
+
+void
+tree_trace_release(struct tree_trace_reader *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->tail++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+int
+tree_trace_close(struct tree_trace_reader *r)
+{
+	int ret;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_join(r->thread, NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+
+	ret = r->error ? -1 : 0;
+
+	munmap((void*) r->data, r->size);
+	free(r);
+
+	return ret;
+}
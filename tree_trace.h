@@ -0,0 +1,169 @@
+/*
+ * binary traces of tree operations
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * 18/10/2026
+ *
+ * Format (integers are little-endian):
+ *
+ *   header (32 bytes):
+ *     magic      8 bytes, "TREETRC" and a zero byte
+ *     version    4 bytes, TREE_TRACE_VERSION
+ *     key_type   4 bytes, enum tree_key_type
+ *     n_ops      8 bytes
+ *     n_inserts  8 bytes
+ *
+ *   an operation per record:
+ *     varint     (zigzag(key - previous key) << 2) | op
+ *
+ * The first previous key is 0. A varint is 7 bits per byte, the
+ * low bits first, with the high bit set in all bytes but the
+ * last. When the zigzag delta doesn't fit in 62 bits, the record
+ * is the op TREE_TRACE_ESCAPE followed by a byte with the op and
+ * a varint with the zigzag delta.
+ *
+ * Keys close to the previous one take a byte or two, e.g. an
+ * in-order insert is one byte.
+ */
+
+#ifndef TREE_TRACE_H
+#define TREE_TRACE_H
+
+#include <pthread.h>
+#include <stddef.h> /* size_t */
+#include <stdio.h> /* FILE */
+
+#define TREE_TRACE_MAGIC  "TREETRC"
+#define TREE_TRACE_VERSION  1
+#define TREE_TRACE_HEADER_SIZE  32
+
+enum {
+	TREE_TRACE_INSERT,
+	TREE_TRACE_DELETE,
+	TREE_TRACE_SEARCH,
+	/* not an operation, see the format above */
+	TREE_TRACE_ESCAPE,
+};
+
+struct tree_trace_header {
+	unsigned int version;
+	unsigned int key_type;
+	unsigned long n_ops;
+	unsigned long n_inserts;
+};
+
+struct tree_trace_op {
+	unsigned int op;
+	unsigned long key;
+};
+
+/*
+ * Writer
+ * ======
+ */
+
+struct tree_trace_writer {
+	FILE *file;
+	struct tree_trace_header header;
+	unsigned long last_key;
+};
+
+int
+tree_trace_create(struct tree_trace_writer *w, const char *path,
+                  unsigned int key_type);
+
+void
+tree_trace_write(struct tree_trace_writer *w, unsigned int op,
+                 unsigned long key);
+
+/* write the counts in the header and close. Return -1 on error */
+int
+tree_trace_finish(struct tree_trace_writer *w);
+
+/*
+ * Decoding
+ * ========
+ */
+
+/* return -1 if data doesn't start with a valid header */
+int
+tree_trace_read_header(const void *data, size_t size,
+                       struct tree_trace_header *header);
+
+/*
+ * decode the record at p in op. last_key is the key of the
+ * previous record (0 at the start) and is updated. Return the
+ * next record, or NULL if the record is invalid or truncated
+ */
+const unsigned char*
+tree_trace_decode(const unsigned char *p, const unsigned char *end,
+                  struct tree_trace_op *op, unsigned long *last_key);
+
+/*
+ * Reader
+ * ======
+ *
+ * The trace is mapped (read ahead by the kernel) and decoded by
+ * a thread into a ring of batches. tree_trace_next() returns the
+ * next batch, waiting for the thread if needed, and NULL at the
+ * end of the trace. The batch is given back to the thread with
+ * tree_trace_release().
+ */
+
+#define TREE_TRACE_BATCH_SIZE  4096
+#define TREE_TRACE_RING_SIZE  8
+
+struct tree_trace_batch {
+	unsigned long n_ops;
+	struct tree_trace_op ops[TREE_TRACE_BATCH_SIZE];
+};
+
+struct tree_trace_reader {
+	struct tree_trace_header header;
+
+	const unsigned char *data;
+	size_t size;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* batches decoded and released, and the ring */
+	unsigned long head;
+	unsigned long tail;
+	/* the thread is done, and stop it (tree_trace_close()) */
+	int done;
+	int stop;
+	int error;
+	struct tree_trace_batch ring[TREE_TRACE_RING_SIZE];
+};
+
+/* return NULL on error */
+struct tree_trace_reader*
+tree_trace_open(const char *path);
+
+struct tree_trace_batch*
+tree_trace_next(struct tree_trace_reader *r);
+
+void
+tree_trace_release(struct tree_trace_reader *r);
+
+/* return -1 if the trace was invalid */
+int
+tree_trace_close(struct tree_trace_reader *r);
+
+#endif /* TREE_TRACE_H */